@@ -0,0 +1,379 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+#include <intrin.h>
+#include <Windows.h>
+
+#include "HookLib/HookLib.h"
+#include "SystemInfo/SystemInfo.h"
+
+using generated_function = int(*)(int value);
+
+// mov eax, imm32; add eax, ecx; ret - followed by int3 padding up to the next slot
+static constexpr size_t function_slot_size = 64;
+
+static constexpr size_t single_count = 1000;
+static constexpr size_t call_iterations = 10000000;
+static constexpr size_t bulk_counts[] = { 1000, 10000 };
+
+static constexpr std::pair<PatchBackend, const char*> patch_backends[] = {
+	{ PatchBackend::protect, "protect" },
+	{ PatchBackend::write_process_memory, "write_process_memory" }
+};
+
+static generated_function original_function = nullptr;
+
+struct Measurement {
+	std::string name;
+	uint64_t count;
+	uint64_t total_ticks;
+	uint64_t thread_cycles;
+
+	// TSC ticks of every single operation, empty for throughput loops
+	std::vector<uint64_t> samples;
+};
+
+// System side of a patch backend, the hooks are still installed when the regions are counted
+struct BackendCost {
+	std::string name;
+	uint64_t count;
+	uint64_t protect_calls;
+	uint64_t write_calls;
+	size_t regions_before;
+	size_t regions_hooked;
+};
+
+static int passthrough_detour(int value) {
+	return original_function(value);
+}
+
+static int bulk_detour(int value) {
+	return value;
+}
+
+static uint8_t* generate_functions(size_t count) {
+	const auto code = static_cast<uint8_t*>(VirtualAlloc(nullptr, count * function_slot_size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE));
+
+	if (code == nullptr) {
+		return nullptr;
+	}
+
+	std::memset(code, 0xCC, count * function_slot_size);
+
+	// Entries sit in the middle of their slot so there is padding on both sides, just like in a real image
+	for (size_t i = 0; i < count; i++) {
+		const auto entry = code + i * function_slot_size + function_slot_size / 2;
+		const auto value = static_cast<uint32_t>(i);
+
+		entry[0] = 0xB8;
+		std::memcpy(entry + 1, &value, sizeof(value));
+		entry[5] = 0x01;
+		entry[6] = 0xC8;
+		entry[7] = 0xC3;
+	}
+
+	FlushInstructionCache(GetCurrentProcess(), code, count * function_slot_size);
+
+	// Read-only like a real .text section, otherwise there would be nothing for the backends to do
+	DWORD old_protect;
+
+	if (!VirtualProtect(code, count * function_slot_size, PAGE_EXECUTE_READ, &old_protect)) {
+		return nullptr;
+	}
+
+	return code;
+}
+
+static void* function_at(uint8_t* code, size_t index) {
+	return code + index * function_slot_size + function_slot_size / 2;
+}
+
+// Every protection change inside a range splits its region, the count is how fragmented the range is
+static size_t count_regions(const uint8_t* begin, size_t size) {
+	size_t count = 0;
+	auto address = begin;
+
+	while (address < begin + size) {
+		MEMORY_BASIC_INFORMATION mbi;
+
+		if (VirtualQuery(address, &mbi, sizeof(mbi)) == 0) {
+			break;
+		}
+
+		address = static_cast<const uint8_t*>(mbi.BaseAddress) + mbi.RegionSize;
+		count++;
+	}
+
+	return count;
+}
+
+static uint64_t thread_cycles() {
+	ULONG64 cycles = 0;
+	QueryThreadCycleTime(GetCurrentThread(), &cycles);
+
+	return cycles;
+}
+
+// One sample per operation, `operation(i)` is timed on its own
+template <typename Operation>
+static Measurement measure_each(const std::string& name, size_t count, Operation operation) {
+	Measurement measurement = { name, count, 0, 0, { } };
+	measurement.samples.reserve(count);
+
+	const auto cycles_begin = thread_cycles();
+
+	for (size_t i = 0; i < count; i++) {
+		const auto begin = __rdtsc();
+		operation(i);
+		measurement.samples.push_back(__rdtsc() - begin);
+	}
+
+	measurement.thread_cycles = thread_cycles() - cycles_begin;
+
+	for (const auto sample : measurement.samples) {
+		measurement.total_ticks += sample;
+	}
+
+	return measurement;
+}
+
+// The whole loop is timed at once
+template <typename Operation>
+static Measurement measure_total(const std::string& name, size_t count, Operation operation) {
+	const auto cycles_begin = thread_cycles();
+	const auto begin = __rdtsc();
+
+	operation();
+
+	const auto ticks = __rdtsc() - begin;
+
+	return { name, count, ticks, thread_cycles() - cycles_begin, { } };
+}
+
+static Measurement measure_calls(const std::string& name, generated_function function) {
+	// volatile keeps the compiler from folding the loop into a constant
+	volatile generated_function target = function;
+	volatile int sink = 0;
+
+	return measure_total(name, call_iterations, [&]() {
+		int sum = 0;
+
+		for (size_t i = 0; i < call_iterations; i++) {
+			sum += target(static_cast<int>(i));
+		}
+
+		sink = sum;
+	});
+}
+
+static double percentile(std::vector<uint64_t> samples, double fraction) {
+	if (samples.empty()) {
+		return 0.0;
+	}
+
+	const auto index = std::min(samples.size() - 1, static_cast<size_t>(fraction * samples.size()));
+	std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+
+	return static_cast<double>(samples[index]);
+}
+
+static void print_csv(const std::vector<Measurement>& measurements) {
+	const auto ns_per_tick = 1e9 / static_cast<double>(SystemInfo::tsc_frequency());
+
+	std::printf("case,count,mean_ns,p50_ns,p99_ns,ops_per_second,thread_cycles_per_op\n");
+
+	for (const auto& measurement : measurements) {
+		const auto count = static_cast<double>(std::max<uint64_t>(measurement.count, 1));
+		const auto mean = measurement.total_ticks * ns_per_tick / count;
+
+		// Loops only have the mean
+		const auto p50 = measurement.samples.empty() ? mean : percentile(measurement.samples, 0.50) * ns_per_tick;
+		const auto p99 = measurement.samples.empty() ? mean : percentile(measurement.samples, 0.99) * ns_per_tick;
+
+		std::printf("%s,%llu,%.2f,%.2f,%.2f,%.0f,%.2f\n", measurement.name.c_str(), (unsigned long long)measurement.count,
+			mean, p50, p99, mean != 0.0 ? 1e9 / mean : 0.0, measurement.thread_cycles / count);
+	}
+}
+
+static bool run_single(HookLib& hook_lib, uint8_t* code, const char* path, std::vector<Measurement>& measurements) {
+	std::vector<void*> trampolines(single_count, nullptr);
+
+	measurements.push_back(measure_each(std::string("install_") + path, single_count, [&](size_t i) {
+		trampolines[i] = hook_lib.apply_hook_x64<void*>(function_at(code, i), &bulk_detour);
+	}));
+
+	if (std::count(trampolines.begin(), trampolines.end(), nullptr) != 0) {
+		std::printf("[error] %s install failed for some functions\n", path);
+		return false;
+	}
+
+	measurements.push_back(measure_each(std::string("remove_") + path, single_count, [&](size_t i) {
+		hook_lib.remove_hook(function_at(code, i));
+	}));
+
+	return true;
+}
+
+static bool run_calls(HookLib& hook_lib, uint8_t* code, std::vector<Measurement>& measurements) {
+	const auto function = reinterpret_cast<generated_function>(function_at(code, 0));
+
+	measurements.push_back(measure_calls("call_unhooked", function));
+
+	original_function = hook_lib.apply_hook_x64<generated_function>(function, &passthrough_detour);
+
+	if (original_function == nullptr) {
+		std::printf("[error] failed to hook the call target\n");
+		return false;
+	}
+
+	if (function(1) != 1) {
+		std::printf("[error] hooked pass-through returned the wrong value\n");
+		hook_lib.remove_hook(function);
+		return false;
+	}
+
+	measurements.push_back(measure_calls("call_hooked", function));
+	measurements.push_back(measure_calls("call_trampoline", original_function));
+
+	hook_lib.remove_hook(function);
+
+	return true;
+}
+
+static bool run_backends(HookLib& hook_lib, uint8_t* code, std::vector<Measurement>& measurements, std::vector<BackendCost>& costs) {
+	const auto code_size = single_count * function_slot_size;
+	std::vector<void*> trampolines(single_count, nullptr);
+
+	for (const auto& [backend, backend_name] : patch_backends) {
+		HookLib::set_patch_backend(backend);
+
+		BackendCost cost = { backend_name, single_count, 0, 0, count_regions(code, code_size), 0 };
+		const auto protect_calls = PageProtection::get_protect_calls();
+		const auto write_calls = PatchWriter::get_write_calls();
+
+		measurements.push_back(measure_each(std::string("install_near_") + backend_name, single_count, [&](size_t i) {
+			trampolines[i] = hook_lib.apply_hook_x64<void*>(function_at(code, i), &bulk_detour);
+		}));
+
+		cost.regions_hooked = count_regions(code, code_size);
+
+		const bool is_installed = std::count(trampolines.begin(), trampolines.end(), nullptr) == 0;
+
+		measurements.push_back(measure_each(std::string("remove_near_") + backend_name, single_count, [&](size_t i) {
+			hook_lib.remove_hook(function_at(code, i));
+		}));
+
+		cost.protect_calls = PageProtection::get_protect_calls() - protect_calls;
+		cost.write_calls = PatchWriter::get_write_calls() - write_calls;
+		costs.push_back(cost);
+
+		if (!is_installed) {
+			std::printf("[error] %s install failed for some functions\n", backend_name);
+			HookLib::set_patch_backend(PatchBackend::protect);
+			return false;
+		}
+	}
+
+	HookLib::set_patch_backend(PatchBackend::protect);
+
+	return true;
+}
+
+static void print_backend_costs(const std::vector<BackendCost>& costs) {
+	if (costs.empty()) {
+		return;
+	}
+
+	// Both per install plus remove of one hook
+	std::printf("\nbackend,count,protect_calls_per_op,write_calls_per_op,regions_before,regions_hooked\n");
+
+	for (const auto& cost : costs) {
+		const auto count = static_cast<double>(std::max<uint64_t>(cost.count, 1));
+
+		std::printf("%s,%llu,%.2f,%.2f,%zu,%zu\n", cost.name.c_str(), (unsigned long long)cost.count,
+			cost.protect_calls / count, cost.write_calls / count, cost.regions_before, cost.regions_hooked);
+	}
+}
+
+static void run_bulk(HookLib& hook_lib, uint8_t* code, std::vector<Measurement>& measurements) {
+	for (const auto count : bulk_counts) {
+		measurements.push_back(measure_total("bulk_install_" + std::to_string(count), count, [&]() {
+			for (size_t i = 0; i < count; i++) {
+				hook_lib.apply_hook_x64<void*>(function_at(code, i), &bulk_detour);
+			}
+		}));
+
+		measurements.push_back(measure_total("bulk_remove_" + std::to_string(count), count, [&]() {
+			std::vector<void*> functions(count);
+
+			for (size_t i = 0; i < count; i++) {
+				functions[i] = function_at(code, i);
+			}
+
+			hook_lib.remove_hooks(functions);
+		}));
+	}
+}
+
+// benchmark [near|far|calls|bulk|backends]...
+// Prints one CSV row per case, all cases run when none is given. Times come from the TSC,
+// thread cycles from QueryThreadCycleTime. `backends` repeats near under every patch backend and adds a
+// second table with the VirtualProtect and WriteProcessMemory calls and the regions of the code range.
+int main(int argc, char** argv) {
+	std::vector<std::string> cases(argv + 1, argv + argc);
+
+	if (cases.empty()) {
+		cases = { "near", "far", "calls", "bulk", "backends" };
+	}
+
+	// Fewer migrations and preemptions between samples
+	SetThreadAffinityMask(GetCurrentThread(), 1);
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
+
+	const auto function_count = *std::max_element(std::begin(bulk_counts), std::end(bulk_counts));
+	const auto code = generate_functions(function_count);
+
+	if (code == nullptr) {
+		std::printf("[error] failed to allocate the generated functions\n");
+		return 1;
+	}
+
+	// Measured once up front so the first sample does not pay for it
+	SystemInfo::tsc_frequency();
+
+	std::vector<Measurement> measurements;
+	std::vector<BackendCost> costs;
+	auto hook_lib = HookLib();
+
+	for (const auto& name : cases) {
+		bool succeeded = true;
+
+		if (name == "near" || name == "far") {
+			hook_lib.force_far_trampolines(name == "far");
+			succeeded = run_single(hook_lib, code, name.c_str(), measurements);
+			hook_lib.force_far_trampolines(false);
+		} else if (name == "calls") {
+			succeeded = run_calls(hook_lib, code, measurements);
+		} else if (name == "bulk") {
+			run_bulk(hook_lib, code, measurements);
+		} else if (name == "backends") {
+			succeeded = run_backends(hook_lib, code, measurements, costs);
+		} else {
+			std::printf("[error] unknown case %s\n", name.c_str());
+			succeeded = false;
+		}
+
+		if (!succeeded) {
+			return 1;
+		}
+	}
+
+	print_csv(measurements);
+	print_backend_costs(costs);
+
+	return 0;
+}
\ No newline at end of file
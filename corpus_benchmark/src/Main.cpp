@@ -0,0 +1,240 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+#include <type_traits>
+#include <intrin.h>
+#include <Windows.h>
+
+#include "HookLib/HookLib.h"
+#include "SystemInfo/SystemInfo.h"
+#include "PatchSite/PatchSite.h"
+#include "PaddingIndex/PaddingIndex.h"
+#include "ControlFlowGraph/ControlFlowGraph.h"
+#include "TrampolineBuilder/TrampolineBuilder.h"
+#include "UnwindInfo/UnwindInfo.h"
+
+static constexpr size_t scratch_size = 0x1000;
+
+static const char* default_modules[] = {
+	"ntdll.dll", "kernel32.dll", "kernelbase.dll", "user32.dll", "gdi32.dll", "gdi32full.dll",
+	"ucrtbase.dll", "msvcp_win.dll", "combase.dll", "advapi32.dll", "ws2_32.dll", "shell32.dll"
+};
+
+struct ModuleResult {
+	std::string name;
+	uint64_t functions = 0;
+	uint64_t built = 0;
+
+	// Rejected the same way HookLib rejects them
+	uint64_t too_small = 0;
+	uint64_t inbound_branch = 0;
+
+	uint64_t unsupported = 0;
+	uint64_t other_failures = 0;
+	uint64_t ticks = 0;
+};
+
+struct Distributions {
+	std::map<size_t, uint64_t> stolen_sizes;
+	std::map<size_t, uint64_t> relocations;
+	std::map<size_t, uint64_t> spills;
+	std::map<std::string, uint64_t> rules;
+	std::map<std::string, uint64_t> unsupported_mnemonics;
+};
+
+static int corpus_hook() {
+	return 0;
+}
+
+static std::vector<std::string> list_system_modules() {
+	char directory[MAX_PATH] = { 0 };
+	GetSystemDirectoryA(directory, MAX_PATH);
+
+	std::vector<std::string> modules;
+	WIN32_FIND_DATAA find_data;
+
+	const auto find = FindFirstFileA((std::string(directory) + "\\*.dll").c_str(), &find_data);
+
+	if (find == INVALID_HANDLE_VALUE) {
+		return modules;
+	}
+
+	do {
+		modules.push_back(find_data.cFileName);
+	} while (FindNextFileA(find, &find_data));
+
+	FindClose(find);
+
+	return modules;
+}
+
+// Plans, sizes and builds a trampoline for `function` the way apply_hook_x64 would, without patching anything
+static void process_function(void* function, uint8_t* scratch, ModuleResult& result, Distributions& distributions) {
+	const auto plan = PatchSite::plan(function, (uintptr_t)scratch, (uintptr_t)scratch + scratch_size);
+	const auto size = HookLib::compute_hook_size(function, plan.entry_size);
+	const auto padding = PaddingIndex::lookup(function);
+
+	if (size < plan.entry_size || (uintptr_t)function + size > padding.end) {
+		result.too_small++;
+		return;
+	}
+
+	const auto graph = ControlFlowGraph::build((uintptr_t)function, padding.end);
+
+	if (graph.find_inbound_target((uintptr_t)function + 1, (uintptr_t)function + size) != 0) {
+		result.inbound_branch++;
+		return;
+	}
+
+	TrampolineBuilder trampoline_builder(function, size, scratch, scratch_size);
+
+	if (!trampoline_builder.build(&corpus_hook)) {
+		const auto mnemonic = trampoline_builder.get_unsupported_mnemonic();
+
+		if (mnemonic != ZYDIS_MNEMONIC_INVALID) {
+			result.unsupported++;
+			distributions.unsupported_mnemonics[ZydisMnemonicGetString(mnemonic)]++;
+		} else {
+			result.other_failures++;
+		}
+
+		return;
+	}
+
+	// The scratch cave is reused for the next function
+	UnwindInfo::unregister(trampoline_builder.get_unwind_table());
+
+	size_t spills = 0;
+
+	for (const auto rule : trampoline_builder.get_applied_rules()) {
+		distributions.rules[rule->name]++;
+		spills += rule->spills ? 1 : 0;
+	}
+
+	result.built++;
+	distributions.stolen_sizes[size]++;
+	distributions.relocations[trampoline_builder.get_relocation_count()]++;
+	distributions.spills[spills]++;
+}
+
+static bool process_module(const std::string& name, ModuleResult& result, Distributions& distributions) {
+	char directory[MAX_PATH] = { 0 };
+	GetSystemDirectoryA(directory, MAX_PATH);
+
+	// Mapped as an image without running its entry point or loading its imports
+	const auto module = LoadLibraryExA((std::string(directory) + "\\" + name).c_str(), nullptr, DONT_RESOLVE_DLL_REFERENCES);
+
+	if (module == nullptr) {
+		std::printf("[error] failed to load %s\n", name.c_str());
+		return false;
+	}
+
+	// Near the module like a real hook, so the rewriter sees the same reachability
+	auto scratch = static_cast<uint8_t*>(HookLib::allocate_around_2gb(module, scratch_size));
+
+	if (scratch == nullptr) {
+		scratch = static_cast<uint8_t*>(VirtualAlloc(nullptr, scratch_size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE));
+	}
+
+	if (scratch == nullptr) {
+		std::printf("[error] failed to allocate a scratch cave for %s\n", name.c_str());
+		return false;
+	}
+
+	const auto functions = HookLib::enumerate_functions(module);
+
+	result.name = name;
+	result.functions = functions.size();
+
+	const auto begin = __rdtsc();
+
+	for (const auto function : functions) {
+		process_function(function, scratch, result, distributions);
+	}
+
+	result.ticks = __rdtsc() - begin;
+
+	VirtualFree(scratch, 0, MEM_RELEASE);
+
+	return true;
+}
+
+static void print_result(const ModuleResult& result) {
+	const auto seconds = result.ticks / static_cast<double>(SystemInfo::tsc_frequency());
+
+	std::printf("%s,%llu,%llu,%llu,%llu,%llu,%llu,%.0f\n", result.name.c_str(), (unsigned long long)result.functions,
+		(unsigned long long)result.built, (unsigned long long)result.too_small, (unsigned long long)result.inbound_branch,
+		(unsigned long long)result.unsupported, (unsigned long long)result.other_failures, seconds != 0.0 ? result.functions / seconds : 0.0);
+}
+
+template <typename Key>
+static void print_distribution(const char* name, const std::map<Key, uint64_t>& distribution) {
+	std::printf("\n%s,count\n", name);
+
+	for (const auto& [key, count] : distribution) {
+		if constexpr (std::is_same_v<Key, std::string>) {
+			std::printf("%s,%llu\n", key.c_str(), (unsigned long long)count);
+		} else {
+			std::printf("%zu,%llu\n", key, (unsigned long long)count);
+		}
+	}
+}
+
+// corpus_benchmark [--all | module...]
+// Sizes and builds a trampoline for every function entry in .pdata of the given System32 DLLs, a common set by default.
+// Prints per-module CSV rows, then the distributions over all built trampolines.
+int main(int argc, char** argv) {
+	std::vector<std::string> modules(argv + 1, argv + argc);
+
+	if (modules.size() == 1 && modules[0] == "--all") {
+		modules = list_system_modules();
+	} else if (modules.empty()) {
+		modules.assign(std::begin(default_modules), std::end(default_modules));
+	}
+
+	// Measured once up front so the first module does not pay for it
+	SystemInfo::tsc_frequency();
+
+	std::vector<ModuleResult> results;
+	Distributions distributions;
+
+	for (const auto& name : modules) {
+		ModuleResult result;
+
+		if (process_module(name, result, distributions)) {
+			results.push_back(result);
+		}
+	}
+
+	ModuleResult total;
+	total.name = "total";
+
+	for (const auto& result : results) {
+		total.functions += result.functions;
+		total.built += result.built;
+		total.too_small += result.too_small;
+		total.inbound_branch += result.inbound_branch;
+		total.unsupported += result.unsupported;
+		total.other_failures += result.other_failures;
+		total.ticks += result.ticks;
+	}
+
+	std::printf("module,functions,built,too_small,inbound_branch,unsupported,other_failures,prologues_per_second\n");
+
+	for (const auto& result : results) {
+		print_result(result);
+	}
+
+	print_result(total);
+
+	print_distribution("stolen_size", distributions.stolen_sizes);
+	print_distribution("relocations", distributions.relocations);
+	print_distribution("spills", distributions.spills);
+	print_distribution("rule", distributions.rules);
+	print_distribution("unsupported_mnemonic", distributions.unsupported_mnemonics);
+
+	return 0;
+}
\ No newline at end of file
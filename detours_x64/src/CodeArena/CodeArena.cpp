@@ -0,0 +1,185 @@
+#include <cstdio>
+#include <algorithm>
+
+#include "CodeArena.h"
+#include "SystemInfo/SystemInfo.h"
+
+std::mutex CodeArena::mutex;
+std::map<uintptr_t, CodeArena::Arena> CodeArena::arenas;
+
+CodeBlock CodeArena::allocate(const void* near_address, size_t size) {
+	size = (size + block_alignment - 1) & ~(block_alignment - 1);
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	Arena* target = nullptr;
+	size_t offset = 0;
+
+	for (auto& [base, arena] : arenas) {
+		if (near_address != nullptr ? !is_within_reach(near_address, base, base + arena.size) : arena.is_placed) {
+			continue;
+		}
+
+		const auto it = arena.free_blocks.find(size);
+
+		if (it != arena.free_blocks.end()) {
+			target = &arena;
+			offset = it->second;
+			arena.free_blocks.erase(it);
+			break;
+		}
+
+		if (arena.size - arena.used >= size) {
+			target = &arena;
+			offset = arena.used;
+			arena.used += size;
+			break;
+		}
+	}
+
+	if (target == nullptr) {
+		target = create_arena(near_address, size);
+
+		if (target == nullptr) {
+			return { nullptr, nullptr, 0 };
+		}
+
+		offset = 0;
+		target->used = size;
+	}
+
+	target->blocks[offset] = size;
+
+	return { target->code + offset, target->writable + offset, size };
+}
+
+void CodeArena::free(const void* code) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	const auto address = reinterpret_cast<uintptr_t>(code);
+	const auto arena = find_arena(address);
+
+	if (arena == nullptr) {
+		std::printf("[error] %p is not code arena memory\n", code);
+		return;
+	}
+
+	const auto it = arena->blocks.find(address - reinterpret_cast<uintptr_t>(arena->code));
+
+	if (it == arena->blocks.end()) {
+		std::printf("[error] %p is not the start of a code block\n", code);
+		return;
+	}
+
+	arena->free_blocks.insert(std::make_pair(it->second, it->first));
+	arena->blocks.erase(it);
+
+	if (arena->blocks.empty()) {
+		UnmapViewOfFile(arena->code);
+		UnmapViewOfFile(arena->writable);
+		CloseHandle(arena->section);
+
+		arenas.erase(reinterpret_cast<uintptr_t>(arena->code));
+	}
+}
+
+uint8_t* CodeArena::writable(const void* code) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	const auto address = reinterpret_cast<uintptr_t>(code);
+	const auto arena = find_arena(address);
+
+	return arena != nullptr ? arena->writable + (address - reinterpret_cast<uintptr_t>(arena->code)) : nullptr;
+}
+
+CodeArena::Arena* CodeArena::create_arena(const void* near_address, size_t size) {
+	const size_t granularity = SystemInfo::allocation_granularity();
+	const auto mapping_size = std::max(arena_size, (size + granularity - 1) & ~(granularity - 1));
+
+	// The section allows both, each view only gets one of them
+	const auto section = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_EXECUTE_READWRITE | SEC_COMMIT,
+		static_cast<DWORD>(static_cast<uint64_t>(mapping_size) >> 32), static_cast<DWORD>(mapping_size), nullptr);
+
+	if (section == nullptr) {
+		std::printf("[error] failed to create a code section: %lu\n", GetLastError());
+		return nullptr;
+	}
+
+	const auto code = near_address != nullptr
+		? map_near(section, mapping_size, near_address)
+		: static_cast<uint8_t*>(MapViewOfFile(section, FILE_MAP_READ | FILE_MAP_EXECUTE, 0, 0, mapping_size));
+
+	if (code == nullptr) {
+		CloseHandle(section);
+		return nullptr;
+	}
+
+	const auto writable = static_cast<uint8_t*>(MapViewOfFile(section, FILE_MAP_WRITE, 0, 0, mapping_size));
+
+	if (writable == nullptr) {
+		std::printf("[error] failed to map the writable view of a code section: %lu\n", GetLastError());
+		UnmapViewOfFile(code);
+		CloseHandle(section);
+		return nullptr;
+	}
+
+	auto& arena = arenas[reinterpret_cast<uintptr_t>(code)];
+	arena.section = section;
+	arena.code = code;
+	arena.writable = writable;
+	arena.size = mapping_size;
+	arena.used = 0;
+	arena.is_placed = near_address != nullptr;
+
+	return &arena;
+}
+
+uint8_t* CodeArena::map_near(HANDLE section, size_t size, const void* near_address) {
+	const size_t granularity = SystemInfo::allocation_granularity();
+	const auto base = reinterpret_cast<uintptr_t>(near_address);
+	const auto base_aligned = base - (base % granularity);
+
+	// Upwards first, then downwards, the same order allocate_around_2gb searches in
+	for (const intptr_t step : { (intptr_t)granularity, -(intptr_t)granularity }) {
+		for (auto curr = base_aligned + step; is_within_reach(near_address, curr, curr + size); curr += step) {
+			MEMORY_BASIC_INFORMATION mbi;
+
+			if (VirtualQuery(reinterpret_cast<void*>(curr), &mbi, sizeof(mbi)) == 0 || !(mbi.State & MEM_FREE) || mbi.RegionSize < size) {
+				continue;
+			}
+
+			// Another thread may take the spot between the query and the mapping
+			const auto view = MapViewOfFileEx(section, FILE_MAP_READ | FILE_MAP_EXECUTE, 0, 0, size, reinterpret_cast<void*>(curr));
+
+			if (view != nullptr) {
+				return static_cast<uint8_t*>(view);
+			}
+		}
+	}
+
+	return nullptr;
+}
+
+bool CodeArena::is_within_reach(const void* near_address, uintptr_t begin, uintptr_t end) {
+	const auto base = reinterpret_cast<uintptr_t>(near_address);
+
+	const auto is_near = [=](uintptr_t address) {
+		const auto distance = static_cast<int64_t>(address - base);
+
+		return distance > -(1LL << 31) && distance < (1LL << 31);
+	};
+
+	return begin < end && is_near(begin) && is_near(end);
+}
+
+CodeArena::Arena* CodeArena::find_arena(uintptr_t address) {
+	auto it = arenas.upper_bound(address);
+
+	if (it == arenas.begin()) {
+		return nullptr;
+	}
+
+	it--;
+
+	return address < it->first + it->second.size ? &it->second : nullptr;
+}
\ No newline at end of file
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <Windows.h>
+#include <cstdint>
+#include <map>
+#include <mutex>
+
+struct CodeBlock {
+	// Executable view, the code runs here and relative branches are computed against it
+	uint8_t* code;
+
+	// Writable view of the same memory
+	uint8_t* writable;
+
+	size_t size;
+};
+
+// Trampoline memory that is never writable and executable at the same address. Every arena is a section object
+// mapped twice, RX where the code runs and RW at a fixed delta for writing, so building a trampoline or
+// retargeting one of its slots needs no protection change.
+class CodeArena {
+private:
+	static constexpr size_t arena_size = 0x100000;
+	static constexpr size_t block_alignment = 16;
+
+	struct Arena {
+		HANDLE section;
+		uint8_t* code;
+		uint8_t* writable;
+		size_t size;
+		size_t used;
+
+		// Mapped next to a function, allocations that may land anywhere skip those
+		bool is_placed;
+
+		// Freed blocks as (size, offset), reused before the arena grows
+		std::multimap<size_t, size_t> free_blocks;
+
+		// Live blocks as (offset, size)
+		std::map<size_t, size_t> blocks;
+	};
+
+	static std::mutex mutex;
+
+	// Keyed by the address of the executable view
+	static std::map<uintptr_t, Arena> arenas;
+
+public:
+	// Block whose executable view lies within +-2 GB of `near_address`, or anywhere if it is nullptr. Returns
+	// a null block if there is no room there.
+	static CodeBlock allocate(const void* near_address, size_t size);
+
+	// Unmaps the arena once its last block is gone
+	static void free(const void* code);
+
+	// Writable alias of an address inside a block, nullptr if it is not arena memory
+	static uint8_t* writable(const void* code);
+
+private:
+	static Arena* create_arena(const void* near_address, size_t size);
+
+	// Maps `section` executable at the first free spot within +-2 GB of `near_address`
+	static uint8_t* map_near(HANDLE section, size_t size, const void* near_address);
+
+	static bool is_within_reach(const void* near_address, uintptr_t begin, uintptr_t end);
+
+	static Arena* find_arena(uintptr_t address);
+};
\ No newline at end of file
@@ -0,0 +1,212 @@
+#include <algorithm>
+#include <set>
+
+#include "ControlFlowGraph.h"
+#include "PaddingIndex/PaddingIndex.h"
+
+std::unordered_map<HMODULE, ControlFlowGraph::ModuleGraphs> ControlFlowGraph::module_graphs;
+std::mutex ControlFlowGraph::graphs_mutex;
+
+uintptr_t FunctionGraph::find_inbound_target(uintptr_t begin, uintptr_t end) const {
+	const auto it = std::lower_bound(branch_targets.begin(), branch_targets.end(), begin);
+
+	if (it == branch_targets.end() || *it >= end) {
+		return 0;
+	}
+
+	return *it;
+}
+
+std::shared_ptr<const FunctionGraph> ControlFlowGraph::for_function(const void* function) {
+	HMODULE module = nullptr;
+
+	const auto entry = reinterpret_cast<uintptr_t>(function);
+
+	// The padding index already knows where the function ends
+	const auto build_graph = [&]() {
+		return std::make_shared<const FunctionGraph>(build(entry, PaddingIndex::lookup(function).end));
+	};
+
+	if (!GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+		static_cast<LPCSTR>(function), &module)) {
+		return build_graph();
+	}
+
+	const auto base = reinterpret_cast<uintptr_t>(module);
+	const auto dos_header = reinterpret_cast<PIMAGE_DOS_HEADER>(base);
+	const auto nt_headers = reinterpret_cast<PIMAGE_NT_HEADERS>(base + dos_header->e_lfanew);
+
+	const auto time_date_stamp = nt_headers->FileHeader.TimeDateStamp;
+	const auto image_size = nt_headers->OptionalHeader.SizeOfImage;
+
+	bool is_new_module = false;
+
+	{
+		std::lock_guard<std::mutex> lock(graphs_mutex);
+
+		auto it = module_graphs.find(module);
+
+		if (it != module_graphs.end() && (it->second.time_date_stamp != time_date_stamp || it->second.image_size != image_size)) {
+			module_graphs.erase(it);
+			it = module_graphs.end();
+		}
+
+		if (it == module_graphs.end()) {
+			module_graphs.insert(std::make_pair(module, ModuleGraphs{ time_date_stamp, image_size, { } }));
+			is_new_module = true;
+		} else {
+			const auto graph = it->second.graphs.find(entry);
+
+			if (graph != it->second.graphs.end()) {
+				return graph->second;
+			}
+		}
+	}
+
+	if (is_new_module) {
+		drop_unloaded();
+	}
+
+	auto graph = build_graph();
+
+	// A worker that built the same graph meanwhile got there first, its copy is kept. The module may have been
+	// replaced in between, the graph is then handed out without being cached.
+	std::lock_guard<std::mutex> lock(graphs_mutex);
+
+	const auto it = module_graphs.find(module);
+
+	if (it == module_graphs.end() || it->second.time_date_stamp != time_date_stamp || it->second.image_size != image_size) {
+		return graph;
+	}
+
+	return it->second.graphs.insert(std::make_pair(entry, std::move(graph))).first->second;
+}
+
+void ControlFlowGraph::drop_unloaded() {
+	std::vector<HMODULE> modules;
+
+	{
+		std::lock_guard<std::mutex> lock(graphs_mutex);
+
+		for (const auto& [module, graphs] : module_graphs) {
+			modules.push_back(module);
+		}
+	}
+
+	// Asked without the lock, the loader lock must never be taken while holding it
+	std::vector<HMODULE> unloaded;
+
+	for (const auto module : modules) {
+		HMODULE loaded = nullptr;
+
+		if (!GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+			reinterpret_cast<LPCSTR>(module), &loaded) || loaded != module) {
+			unloaded.push_back(module);
+		}
+	}
+
+	// A module loaded at the same base meanwhile loses its graphs too, they are rebuilt on demand
+	std::lock_guard<std::mutex> lock(graphs_mutex);
+
+	for (const auto module : unloaded) {
+		module_graphs.erase(module);
+	}
+}
+
+FunctionGraph ControlFlowGraph::build(uintptr_t entry, uintptr_t end) {
+	ZydisDecoder decoder;
+	ZydisDecoderInit(&decoder, ZYDIS_MACHINE_MODE_LONG_64, ZYDIS_STACK_WIDTH_64);
+
+	ZydisDecodedInstruction instruction;
+	ZydisDecodedOperand operands[ZYDIS_MAX_OPERAND_COUNT];
+
+	// (start, next) of every decoded instruction
+	std::set<std::pair<uintptr_t, uintptr_t>> instructions;
+	std::set<uintptr_t> visited;
+	std::set<uintptr_t> leaders = { entry };
+	std::set<uintptr_t> targets;
+	std::vector<uintptr_t> worklist = { entry };
+
+	// First pass: recursive descent from the entry, edges leaving [entry, end) are not followed
+	while (!worklist.empty()) {
+		auto address = worklist.back();
+		worklist.pop_back();
+
+		while (address >= entry && address < end && !visited.contains(address)) {
+			if (ZYAN_FAILED(ZydisDecoderDecodeFull(&decoder, reinterpret_cast<const void*>(address), end - address, &instruction, operands))) {
+				break;
+			}
+
+			visited.insert(address);
+
+			const auto next = address + instruction.length;
+			bool ends_block = is_terminator(instruction);
+
+			const bool is_branch = instruction.attributes & ZYDIS_ATTRIB_IS_RELATIVE
+				&& operands[0].type == ZYDIS_OPERAND_TYPE_IMMEDIATE
+				&& instruction.mnemonic != ZYDIS_MNEMONIC_CALL;
+
+			if (is_branch) {
+				ZyanU64 target = 0;
+				ZydisCalcAbsoluteAddress(&instruction, &operands[0], address, &target);
+
+				if (target >= entry && target < end) {
+					targets.insert(static_cast<uintptr_t>(target));
+					leaders.insert(static_cast<uintptr_t>(target));
+					worklist.push_back(static_cast<uintptr_t>(target));
+				}
+
+				// Conditional branches fall through into a new block
+				if (instruction.mnemonic != ZYDIS_MNEMONIC_JMP) {
+					leaders.insert(next);
+					worklist.push_back(next);
+				}
+
+				ends_block = true;
+			}
+
+			instructions.insert(std::make_pair(address, next));
+
+			if (ends_block) {
+				break;
+			}
+
+			address = next;
+		}
+	}
+
+	FunctionGraph graph;
+	graph.entry = entry;
+	graph.end = end;
+
+	// Fall-through edges start blocks too, but only taken branches can enter the middle of a patch
+	graph.branch_targets.assign(targets.begin(), targets.end());
+
+	// Second pass: cut the decoded instructions into blocks at leaders and gaps
+	for (const auto& [start, next] : instructions) {
+		const bool continues_block = !graph.blocks.empty()
+			&& graph.blocks.back().end == start
+			&& !leaders.contains(start);
+
+		if (continues_block) {
+			graph.blocks.back().end = next;
+		} else {
+			graph.blocks.push_back({ start, next });
+		}
+	}
+
+	return graph;
+}
+
+bool ControlFlowGraph::is_terminator(const ZydisDecodedInstruction& instruction) {
+	switch (instruction.mnemonic) {
+	case ZYDIS_MNEMONIC_RET:
+	case ZYDIS_MNEMONIC_JMP:
+	case ZYDIS_MNEMONIC_INT3:
+	case ZYDIS_MNEMONIC_UD2:
+	case ZYDIS_MNEMONIC_HLT:
+		return true;
+	default:
+		return false;
+	}
+}
\ No newline at end of file
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <Windows.h>
+#include <cstdint>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+
+#include "lib/Zydis/Zydis.h"
+
+struct BasicBlock {
+	uintptr_t start;
+	uintptr_t end;
+};
+
+struct FunctionGraph {
+	uintptr_t entry;
+	uintptr_t end;
+
+	// Both sorted by address
+	std::vector<BasicBlock> blocks;
+	std::vector<uintptr_t> branch_targets;
+
+	// Lowest address in [begin, end) that a branch of the function lands on, 0 if there is none
+	uintptr_t find_inbound_target(uintptr_t begin, uintptr_t end) const;
+};
+
+class ControlFlowGraph {
+private:
+	struct ModuleGraphs {
+		// Tells the image the graphs were built for from another one mapped at the same base after an unload
+		DWORD time_date_stamp;
+		DWORD image_size;
+
+		std::unordered_map<uintptr_t, std::shared_ptr<const FunctionGraph>> graphs;
+	};
+
+	static std::unordered_map<HMODULE, ModuleGraphs> module_graphs;
+
+	// Guards `module_graphs`, graphs are built without it
+	static std::mutex graphs_mutex;
+
+public:
+	// Built once per function and cached with its module, so batch installs only pay for the first lookup.
+	// Thread-safe, the bulk workers share the cache. The graphs of a module are dropped once a different image
+	// shows up at its base or it is unloaded, callers keep theirs alive through the pointer. Code outside of any
+	// image can be freed and reused without notice, its graphs are not cached.
+	static std::shared_ptr<const FunctionGraph> for_function(const void* function);
+
+	// Uncached, touches no shared state and can run on several threads at once
+	static FunctionGraph build(uintptr_t entry, uintptr_t end);
+
+private:
+	static bool is_terminator(const ZydisDecodedInstruction& instruction);
+
+	// Forgets the graphs of modules that are no longer loaded, runs whenever a module is seen for the first time
+	static void drop_unloaded();
+};
\ No newline at end of file
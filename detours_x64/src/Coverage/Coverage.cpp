@@ -0,0 +1,251 @@
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstring>
+#include <cstdio>
+
+#include "Coverage.h"
+#include "SignatureScanner/SignatureScanner.h"
+#include "CodeArena/CodeArena.h"
+
+// Qwords behind the stub code, in this order
+enum StubSlot : size_t {
+	trampoline_slot,
+	word_slot,
+	slot_count
+};
+
+// "DTCV", version 1
+static constexpr uint32_t dump_magic = 0x56435444;
+static constexpr uint32_t dump_version = 1;
+
+std::mutex Coverage::mutex;
+std::unordered_map<HMODULE, Coverage::ModuleBitmap> Coverage::module_bitmaps;
+std::unordered_map<void*, Coverage::LiveStub> Coverage::live_stubs;
+
+CoverageStub Coverage::create_stub(void* function) {
+	HMODULE module = nullptr;
+
+	if (!GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+		static_cast<LPCSTR>(function), &module)) {
+		return { nullptr, 0, nullptr };
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	const auto bitmap = for_module(module);
+	const auto rva = static_cast<DWORD>(reinterpret_cast<uintptr_t>(function) - reinterpret_cast<uintptr_t>(module));
+
+	const auto it = std::lower_bound(bitmap->functions, bitmap->functions + bitmap->count, rva, [](const RUNTIME_FUNCTION& entry, DWORD address) {
+		return entry.BeginAddress < address;
+	});
+
+	if (it == bitmap->functions + bitmap->count || it->BeginAddress != rva) {
+		std::printf("[error] %p has no .pdata entry to record coverage for\n", function);
+		return { nullptr, 0, nullptr };
+	}
+
+	const auto index = static_cast<size_t>(it - bitmap->functions);
+	const auto word = &bitmap->bits[index / 64];
+	const auto mask = 1ull << (index % 64);
+
+	// Covered before, a stub would never see a first hit
+	if (std::atomic_ref<uint64_t>(*word).load(std::memory_order_relaxed) & mask) {
+		return { nullptr, 0, nullptr };
+	}
+
+	const auto code = assemble_stub(static_cast<uint8_t>(index % 64));
+	const auto stub = CodeArena::allocate(nullptr, code.size() + slot_count * sizeof(uintptr_t));
+
+	if (stub.code == nullptr) {
+		std::printf("[error] failed to allocate memory for coverage stubs\n");
+		return { nullptr, 0, nullptr };
+	}
+
+	std::memcpy(stub.writable, code.data(), code.size());
+
+	// The stub reads its slots through the executable view, they are written through the other one
+	const auto slots = reinterpret_cast<uintptr_t*>(stub.writable + code.size());
+	slots[trampoline_slot] = 0;
+	slots[word_slot] = reinterpret_cast<uintptr_t>(word);
+
+	const CoverageStub result = { stub.code, code.size(), reinterpret_cast<void**>(&slots[trampoline_slot]) };
+	live_stubs[function] = { result, &bitmap->live[index / 64], mask };
+	bitmap->live[index / 64] |= mask;
+
+	return result;
+}
+
+CoverageStub Coverage::release_stub(void* function) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	const auto it = live_stubs.find(function);
+
+	if (it == live_stubs.end()) {
+		return { nullptr, 0, nullptr };
+	}
+
+	const auto stub = it->second.stub;
+	*it->second.live_word &= ~it->second.mask;
+	live_stubs.erase(it);
+
+	return stub;
+}
+
+std::vector<void*> Coverage::take_hits() {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	std::vector<void*> functions;
+
+	for (auto& [module, bitmap] : module_bitmaps) {
+		for (size_t i = 0; i < bitmap.live.size(); i++) {
+			auto hits = std::atomic_ref<uint64_t>(bitmap.bits[i]).load(std::memory_order_acquire) & bitmap.live[i];
+
+			while (hits != 0) {
+				const auto index = i * 64 + static_cast<size_t>(std::countr_zero(hits));
+				hits &= hits - 1;
+
+				functions.push_back(reinterpret_cast<uint8_t*>(module) + bitmap.functions[index].BeginAddress);
+			}
+		}
+	}
+
+	return functions;
+}
+
+bool Coverage::has_live_stubs() {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	return !live_stubs.empty();
+}
+
+const std::vector<uint64_t>* Coverage::bitmap(HMODULE module) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	// Nodes and their bit vectors never move, the pointer stays valid without the lock
+	const auto it = module_bitmaps.find(module);
+
+	return it != module_bitmaps.end() ? &it->second.bits : nullptr;
+}
+
+bool Coverage::dump(HMODULE module, const std::string& path) {
+	std::vector<uint64_t> bits;
+	size_t count = 0;
+
+	// Copied under the lock, the stubs keep setting bits and the file is written without holding anyone up
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		const auto it = module_bitmaps.find(module);
+
+		if (it == module_bitmaps.end()) {
+			return false;
+		}
+
+		for (auto& word : it->second.bits) {
+			bits.push_back(std::atomic_ref<uint64_t>(word).load(std::memory_order_relaxed));
+		}
+
+		count = it->second.count;
+	}
+
+	const auto file = CreateFileA(path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+	if (file == INVALID_HANDLE_VALUE) {
+		std::printf("[error] failed to create %s\n", path.c_str());
+		return false;
+	}
+
+	const auto build_id = SignatureScanner::build_id(module);
+
+	// magic, version, function count, build id length, build id, bitmap
+	const uint32_t header[] = {
+		dump_magic,
+		dump_version,
+		static_cast<uint32_t>(count),
+		static_cast<uint32_t>(build_id.size())
+	};
+
+	DWORD written;
+	bool is_written = WriteFile(file, header, sizeof(header), &written, nullptr)
+		&& WriteFile(file, build_id.data(), static_cast<DWORD>(build_id.size()), &written, nullptr)
+		&& WriteFile(file, bits.data(), static_cast<DWORD>(bits.size() * sizeof(uint64_t)), &written, nullptr);
+
+	CloseHandle(file);
+
+	return is_written;
+}
+
+Coverage::ModuleBitmap* Coverage::for_module(HMODULE module) {
+	auto it = module_bitmaps.find(module);
+
+	if (it != module_bitmaps.end()) {
+		return &it->second;
+	}
+
+	const auto base = reinterpret_cast<uintptr_t>(module);
+	const auto dos_header = reinterpret_cast<PIMAGE_DOS_HEADER>(base);
+	const auto nt_headers = reinterpret_cast<PIMAGE_NT_HEADERS>(base + dos_header->e_lfanew);
+	const auto& directory = nt_headers->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXCEPTION];
+
+	ModuleBitmap bitmap;
+	bitmap.functions = reinterpret_cast<const RUNTIME_FUNCTION*>(base + directory.VirtualAddress);
+	bitmap.count = directory.VirtualAddress != 0 ? directory.Size / sizeof(RUNTIME_FUNCTION) : 0;
+	bitmap.bits.resize((bitmap.count + 63) / 64);
+	bitmap.live.resize(bitmap.bits.size());
+
+	return &module_bitmaps.insert(std::make_pair(module, std::move(bitmap))).first->second;
+}
+
+std::vector<uint8_t> Coverage::assemble_stub(uint8_t bit) {
+	std::vector<uint8_t> code;
+
+	// (offset of a disp32, slot it addresses) and offsets of rel32s that go to the exit
+	std::vector<std::pair<size_t, size_t>> slot_fixups;
+	std::vector<size_t> exit_fixups;
+
+	const auto emit = [&](std::initializer_list<uint8_t> bytes) {
+		code.insert(code.end(), bytes);
+	};
+
+	const auto emit_slot_access = [&](std::initializer_list<uint8_t> opcode, size_t slot) {
+		emit(opcode);
+		slot_fixups.push_back(std::make_pair(code.size(), slot));
+		emit({ 0, 0, 0, 0 });
+	};
+
+	const auto emit_exit_branch = [&](std::initializer_list<uint8_t> opcode) {
+		emit(opcode);
+		exit_fixups.push_back(code.size());
+		emit({ 0, 0, 0, 0 });
+	};
+
+	// r11 is volatile and never carries an argument, it is free at any function entry.
+	// Once the bit is set callers only read it, the locked write happens until the first hit is seen.
+	emit_slot_access({ 0x4C, 0x8B, 0x1D }, word_slot);			// mov r11, [rip+word]
+	emit({ 0x49, 0x0F, 0xBA, 0x23, bit });						// bt qword ptr [r11], bit
+	emit_exit_branch({ 0x0F, 0x82 });							// jc exit
+	emit({ 0xF0, 0x49, 0x0F, 0xBA, 0x2B, bit });				// lock bts qword ptr [r11], bit
+
+	// exit: the stolen bytes and the rest of the function
+	const auto exit = code.size();
+	emit_slot_access({ 0xFF, 0x25 }, trampoline_slot);			// jmp [rip+trampoline]
+
+	while (code.size() % sizeof(uintptr_t) != 0) {
+		code.push_back(0xCC);
+	}
+
+	const auto slots_offset = code.size();
+
+	for (const auto& [offset, slot] : slot_fixups) {
+		const auto disp = static_cast<int32_t>(slots_offset + slot * sizeof(uintptr_t) - (offset + 4));
+		std::memcpy(&code[offset], &disp, sizeof(disp));
+	}
+
+	for (const auto offset : exit_fixups) {
+		const auto disp = static_cast<int32_t>(exit - (offset + 4));
+		std::memcpy(&code[offset], &disp, sizeof(disp));
+	}
+
+	return code;
+}
\ No newline at end of file
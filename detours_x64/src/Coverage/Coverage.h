@@ -0,0 +1,70 @@
+#pragma once
+
+#include <Windows.h>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+struct CoverageStub {
+	void* code;
+	size_t size;
+
+	// Where the stub continues, every call runs the original through the trampoline until the hook is gone. Has
+	// to be filled in before the patch is written. Points into the writable view of the stub's CodeArena block.
+	void** trampoline_slot;
+};
+
+class Coverage {
+private:
+	struct ModuleBitmap {
+		const RUNTIME_FUNCTION* functions;
+		size_t count;
+
+		// Bit `i` is set once .pdata entry `i` has run, never reallocated after creation
+		std::vector<uint64_t> bits;
+
+		// Bit `i` is set while entry `i` has a stub
+		std::vector<uint64_t> live;
+	};
+
+	struct LiveStub {
+		CoverageStub stub;
+		uint64_t* live_word;
+		uint64_t mask;
+	};
+
+	// Guards both maps, HookLib changes them under its own lock while dump and bitmap may come from anywhere
+	static std::mutex mutex;
+
+	static std::unordered_map<HMODULE, ModuleBitmap> module_bitmaps;
+
+	// Keyed by the function, from creation until release_stub
+	static std::unordered_map<void*, LiveStub> live_stubs;
+
+public:
+	// Stub that sets the bit of `function` on the first hit. It never blocks, never calls out and never patches,
+	// putting the function back is up to whoever polls take_hits. Returns a null stub if the function has no .pdata
+	// entry or its bit is set already.
+	static CoverageStub create_stub(void* function);
+
+	// Forgets the stub of `function` and returns it, the caller frees its code once no thread can be in there
+	static CoverageStub release_stub(void* function);
+
+	// Functions whose stub is still live although their bit is set, one pass over the bitmaps
+	static std::vector<void*> take_hits();
+
+	// Whether any stub was created and not released yet
+	static bool has_live_stubs();
+
+	static const std::vector<uint64_t>* bitmap(HMODULE module);
+
+	// Writes the build id and a snapshot of the bitmap, bits are in .pdata order
+	static bool dump(HMODULE module, const std::string& path);
+
+private:
+	static ModuleBitmap* for_module(HMODULE module);
+
+	static std::vector<uint8_t> assemble_stub(uint8_t bit);
+};
\ No newline at end of file
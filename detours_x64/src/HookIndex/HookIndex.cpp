@@ -0,0 +1,187 @@
+#include <algorithm>
+
+#include "HookIndex.h"
+
+std::mutex HookIndex::writer_mutex;
+std::unordered_map<void*, HookSpans> HookIndex::spans_by_function;
+
+std::atomic<HookIndex::Generation*> HookIndex::current{ nullptr };
+
+std::atomic<uint64_t> HookIndex::epoch{ 0 };
+std::atomic<uint32_t> HookIndex::readers[2];
+
+void HookIndex::insert(const std::vector<HookSpans>& spans) {
+	std::lock_guard<std::mutex> lock(writer_mutex);
+
+	for (const auto& entry : spans) {
+		spans_by_function[entry.function] = entry;
+	}
+
+	publish();
+}
+
+void HookIndex::attach_stubs(const std::vector<std::tuple<void*, void*, size_t>>& stubs) {
+	std::lock_guard<std::mutex> lock(writer_mutex);
+
+	for (const auto& [function, stub, stub_size] : stubs) {
+		const auto it = spans_by_function.find(function);
+
+		if (it != spans_by_function.end()) {
+			it->second.stub_address = (uintptr_t)stub;
+			it->second.stub_size = stub_size;
+		}
+	}
+
+	publish();
+}
+
+void HookIndex::erase(const std::vector<void*>& functions, std::vector<HookSpans>& erased) {
+	std::lock_guard<std::mutex> lock(writer_mutex);
+
+	erased.assign(functions.size(), HookSpans{ });
+
+	for (size_t i = 0; i < functions.size(); i++) {
+		const auto it = spans_by_function.find(functions[i]);
+
+		if (it != spans_by_function.end()) {
+			erased[i] = std::move(it->second);
+			spans_by_function.erase(it);
+		}
+	}
+
+	publish();
+}
+
+bool HookIndex::lookup(uintptr_t address, HookLocation& location) {
+	const auto entered_epoch = enter();
+
+	bool is_found = false;
+	const auto generation = current.load();
+
+	if (generation != nullptr) {
+		const auto& regions = generation->regions;
+
+		// Last region starting at or before `address`
+		const auto it = std::upper_bound(regions.begin(), regions.end(), address, [](uintptr_t value, const Region& region) {
+			return value < region.begin;
+		});
+
+		if (it != regions.begin() && address < std::prev(it)->end) {
+			const auto& region = *std::prev(it);
+
+			location.kind = region.kind;
+			location.function = region.spans->function;
+			location.trampoline = region.spans->trampoline;
+			fill_offsets(region, address, location);
+
+			is_found = true;
+		}
+	}
+
+	leave(entered_epoch);
+
+	return is_found;
+}
+
+bool HookIndex::overlaps(uintptr_t begin, uintptr_t end) {
+	const auto entered_epoch = enter();
+
+	bool is_overlapping = false;
+	const auto generation = current.load();
+
+	if (generation != nullptr) {
+		const auto& regions = generation->regions;
+
+		// First region ending after `begin`, regions do not overlap so their ends are sorted as well
+		const auto it = std::upper_bound(regions.begin(), regions.end(), begin, [](uintptr_t value, const Region& region) {
+			return value < region.end;
+		});
+
+		is_overlapping = it != regions.end() && it->begin < end;
+	}
+
+	leave(entered_epoch);
+
+	return is_overlapping;
+}
+
+uint64_t HookIndex::enter() {
+	// Re-checking the epoch after announcing closes the window in which a writer could have waited for this
+	// counter before it was raised
+	for (;;) {
+		const auto entered_epoch = epoch.load();
+		readers[entered_epoch & 1].fetch_add(1);
+
+		if (epoch.load() == entered_epoch) {
+			return entered_epoch;
+		}
+
+		readers[entered_epoch & 1].fetch_sub(1);
+	}
+}
+
+void HookIndex::leave(uint64_t entered_epoch) {
+	readers[entered_epoch & 1].fetch_sub(1);
+}
+
+void HookIndex::publish() {
+	const auto generation = new Generation();
+	generation->spans.reserve(spans_by_function.size());
+
+	// `regions` points into `spans`, which must not reallocate from here on
+	for (const auto& [function, spans] : spans_by_function) {
+		generation->spans.push_back(spans);
+	}
+
+	for (const auto& spans : generation->spans) {
+		add_region(*generation, (uintptr_t)spans.function, spans.stolen_size, HookRegionKind::stolen_bytes, spans);
+		add_region(*generation, spans.padding_address, spans.padding_size, HookRegionKind::padding, spans);
+		add_region(*generation, (uintptr_t)spans.trampoline, spans.code_size, HookRegionKind::trampoline_code, spans);
+		add_region(*generation, (uintptr_t)spans.trampoline + spans.code_size, spans.trampoline_size - spans.code_size,
+			HookRegionKind::trampoline_tables, spans);
+		add_region(*generation, spans.stub_address, spans.stub_size, HookRegionKind::stub, spans);
+	}
+
+	std::sort(generation->regions.begin(), generation->regions.end(), [](const Region& left, const Region& right) {
+		return left.begin < right.begin;
+	});
+
+	const auto retired = current.exchange(generation);
+	const auto retired_epoch = epoch.fetch_add(1);
+
+	// Lookups are a binary search, waiting for them is short
+	while (readers[retired_epoch & 1].load() != 0) {
+		YieldProcessor();
+	}
+
+	delete retired;
+}
+
+void HookIndex::add_region(Generation& generation, uintptr_t begin, size_t size, HookRegionKind kind, const HookSpans& spans) {
+	if (size != 0) {
+		generation.regions.push_back({ begin, begin + size, kind, &spans });
+	}
+}
+
+void HookIndex::fill_offsets(const Region& region, uintptr_t address, HookLocation& location) {
+	location.original_offset = SIZE_MAX;
+	location.relocated_offset = SIZE_MAX;
+
+	const bool is_original = region.kind == HookRegionKind::stolen_bytes;
+
+	if (!is_original && region.kind != HookRegionKind::trampoline_code) {
+		return;
+	}
+
+	const auto offset = address - region.begin;
+
+	// Both columns ascend, the last instruction starting at or before `offset` holds it
+	for (const auto& [original_offset, relocated_offset] : region.spans->instruction_offsets) {
+		if ((is_original ? original_offset : relocated_offset) > offset) {
+			break;
+		}
+
+		location.original_offset = original_offset;
+		location.relocated_offset = relocated_offset;
+	}
+}
\ No newline at end of file
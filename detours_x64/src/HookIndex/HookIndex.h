@@ -0,0 +1,108 @@
+#pragma once
+
+#include <Windows.h>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <tuple>
+#include <vector>
+#include <unordered_map>
+
+enum class HookRegionKind : uint8_t {
+	stolen_bytes,		// The patched start of the function
+	padding,			// Long jump or target slot in the padding next to the function
+	trampoline_code,	// Rewritten instructions plus the jump back
+	trampoline_tables,	// Jump table, address slots and unwind info behind the code
+	stub				// Coverage stub in front of the trampoline
+};
+
+// Everything one code hook put into memory, import and vtable hooks patch data and are not indexed
+struct HookSpans {
+	void* function;
+	size_t stolen_size;
+
+	uintptr_t padding_address;
+	size_t padding_size;
+
+	void* trampoline;
+	size_t code_size;
+	size_t trampoline_size;
+
+	uintptr_t stub_address = 0;
+	size_t stub_size = 0;
+
+	// See TrampolineBuilder::get_instruction_offsets
+	std::vector<std::pair<size_t, size_t>> instruction_offsets;
+};
+
+struct HookLocation {
+	HookRegionKind kind;
+
+	// Key of the hook record in HookRegistry
+	void* function;
+	void* trampoline;
+
+	// Instruction holding the address, from the start of the stolen bytes and of the trampoline. SIZE_MAX
+	// outside stolen bytes and trampoline code. A thread at function + original_offset can be moved to
+	// trampoline + relocated_offset and the other way round.
+	size_t original_offset;
+	size_t relocated_offset;
+};
+
+// Maps any address a code hook owns back to its hook. Lookups neither lock nor allocate, so exception
+// handlers, profilers sampling suspended threads and the unwinder can use them.
+class HookIndex {
+private:
+	struct Region {
+		uintptr_t begin;
+		uintptr_t end;
+		HookRegionKind kind;
+		const HookSpans* spans;
+	};
+
+	// Immutable once published, replaced as a whole on every change
+	struct Generation {
+		std::vector<HookSpans> spans;
+
+		// Sorted by `begin`, no two overlap
+		std::vector<Region> regions;
+	};
+
+	static std::mutex writer_mutex;
+	static std::unordered_map<void*, HookSpans> spans_by_function;
+
+	static std::atomic<Generation*> current;
+
+	// Readers announce themselves in the counter of the epoch they entered in, a writer retires a generation
+	// once the counter of the epoch it was current in drains
+	static std::atomic<uint64_t> epoch;
+	static std::atomic<uint32_t> readers[2];
+
+public:
+	static void insert(const std::vector<HookSpans>& spans);
+
+	// Adds the coverage stub of every (function, stub, stub size) to the spans of its already indexed hook
+	static void attach_stubs(const std::vector<std::tuple<void*, void*, size_t>>& stubs);
+
+	// Returns once no lookup can still see the hooks, with what `functions[i]` covered in `erased[i]`. Its
+	// `function` is nullptr if it was not indexed. One publish for the whole batch.
+	static void erase(const std::vector<void*>& functions, std::vector<HookSpans>& erased);
+
+	// Lock-free and allocation-free
+	static bool lookup(uintptr_t address, HookLocation& location);
+
+	// Whether any indexed hook owns an address in [begin, end), lock-free
+	static bool overlaps(uintptr_t begin, uintptr_t end);
+
+private:
+	// Announces a reader and returns the epoch to leave with
+	static uint64_t enter();
+
+	static void leave(uint64_t entered_epoch);
+
+	static void publish();
+
+	static void add_region(Generation& generation, uintptr_t begin, size_t size, HookRegionKind kind, const HookSpans& spans);
+
+	static void fill_offsets(const Region& region, uintptr_t address, HookLocation& location);
+};
\ No newline at end of file
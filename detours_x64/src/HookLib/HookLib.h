@@ -3,8 +3,15 @@
 #include <cstdlib>
 #include <iostream>
 #include <cstring>
+#include <string>
 #include <vector>
 #include <unordered_map>
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <thread>
 #include <Windows.h>
 
 #include "lib/Zydis/Zydis.h"
@@ -12,15 +19,93 @@
 #include "SystemInfo/SystemInfo.h"
 #include "EnumMappings/EnumMappings.h"
 #include "TrampolineBuilder/TrampolineBuilder.h"
+#include "PatchSite/PatchSite.h"
+#include "ControlFlowGraph/ControlFlowGraph.h"
+#include "PaddingIndex/PaddingIndex.h"
+#include "SymbolIndex/SymbolIndex.h"
+#include "SignatureScanner/SignatureScanner.h"
+#include "ImportTable/ImportTable.h"
+#include "VirtualTable/VirtualTable.h"
+#include "Coverage/Coverage.h"
+#include "LatencyHistogram/LatencyHistogram.h"
+#include "PerfMap/PerfMap.h"
+#include "UnwindInfo/UnwindInfo.h"
+#include "HookRegistry/HookRegistry.h"
+#include "HookIndex/HookIndex.h"
+#include "PageProtection/PageProtection.h"
+#include "CodeArena/CodeArena.h"
+#include "PatchWriter/PatchWriter.h"
+#include "RetiredCode/RetiredCode.h"
+
+struct hook_latency {
+	void* function;
+	LatencySummary detour;
+	LatencySummary original;
+};
 
-struct hook {
+struct pending_patch {
+	void* function;
 	void* trampoline;
-	std::vector<byte> original_bytes;
+	void* jump_to_hook;
+	size_t size;
+	PatchPlan plan;
+	size_t code_size;
+	size_t jump_table_size;
+	PRUNTIME_FUNCTION unwind_table;
+	size_t used_size;
+	std::vector<std::pair<size_t, size_t>> instruction_offsets;
+	bool is_ready;
+};
+
+struct trampoline_arena {
+	uint8_t* base;
+	uint8_t* writable;
+	size_t used;
+	size_t size;
+};
+
+struct arena_block {
+	size_t size;
+
+	// Bulk hooks with their trampoline in the block, it is freed when the last one is removed
+	size_t live_hooks;
+};
+
+struct cloned_vtable {
+	void** original;
+
+	// Private copy of the object's vtable, element 0 is the RTTI locator
+	std::vector<void*> entries;
 };
 
 class HookLib {
 private:
-	std::unordered_map<void*, hook> active_hooks;
+	static constexpr size_t near_trampoline_size = 0x500;
+	static constexpr size_t far_trampoline_size = 0x1000;
+
+	// Per-worker trampoline memory for bulk hooking and the number of functions a worker takes at once
+	static constexpr size_t arena_size = 0x100000;
+	static constexpr size_t bulk_batch_size = 64;
+
+	// How often the coverage worker looks for stubs that had their first hit
+	static constexpr DWORD coverage_poll_interval = 10;
+
+	// Protection changes and the analysis caches are process-wide, so every instance patches under this lock.
+	// Hook records live in HookRegistry, which can be read without it.
+	static inline std::recursive_mutex patch_mutex;
+
+	// Keyed by object address, nothing sees the object die. An entry whose object no longer points at its copy
+	// belongs to a destroyed object and is dropped the next time that address comes by.
+	static inline std::unordered_map<void*, cloned_vtable> cloned_vtables;
+
+	// Arenas of the bulk workers keyed by their executable view, see arena_block
+	static inline std::map<uintptr_t, arena_block> arena_blocks;
+
+	// Guarded by `patch_mutex`, the worker exits once no stub is live and nothing waits to be retired
+	static inline bool is_coverage_worker_running = false;
+
+	bool is_perf_map_enabled = false;
+	bool is_far_forced = false;
 
 public:
 	template <typename Fn>
@@ -39,101 +124,403 @@ public:
 
 		relocate(trampoline, original_function, size);
 
-		ensure_protection(original_function, size, PAGE_EXECUTE_READWRITE, [=]() {
+		ensure_writable(original_function, size, [=]() {
 			place_jump(original_function, target_function);
 			std::memset((uint8_t*)original_function + size, 0x90, size - 5);
 		});
 	}
 
+	// Lists every trampoline, jump table and stub created from now on in %TEMP%\perf-<pid>.map
+	void enable_perf_map(bool enabled = true) {
+		is_perf_map_enabled = enabled;
+	}
+
+	// Skips the search for a cave within +-2 GB, every hook then takes the far path. Meant for measuring it.
+	void force_far_trampolines(bool enabled = true) {
+		is_far_forced = enabled;
+	}
+
+	// How code is patched from now on, import and vtable slots always go through PageProtection.
+	// The backend of the writes of one call does not change while it runs.
+	static void set_patch_backend(PatchBackend backend) {
+		std::lock_guard<std::recursive_mutex> lock(patch_mutex);
+		PatchWriter::set_backend(backend);
+	}
+
+	// Lock-free, covers hooks of every HookLib instance
+	static bool is_hooked(const void* address) {
+		return HookRegistry::contains(address);
+	}
+
+	// Which hook owns `address` if it lies in stolen bytes, padding, a trampoline or a coverage stub.
+	// Lock-free and allocation-free, usable from exception handlers.
+	static bool locate(const void* address, HookLocation& location) {
+		return HookIndex::lookup((uintptr_t)address, location);
+	}
+
 	template <typename Fn>
 	Fn apply_hook_x64(void* original_function, void* target_function) {
-		bool use_far_jump = false;
-		size_t size = 0;
+		return reinterpret_cast<Fn>(install_hook(original_function, target_function, HookKind::code, nullptr));
+	}
 
-		void* trampoline = allocate_around_2gb(original_function);
+	// Target given as "module!symbol" or "module!#ordinal", e.g. "user32.dll!MessageBoxA"
+	template <typename Fn>
+	Fn apply_hook_x64(const std::string& target_name, void* target_function) {
+		void* original_function = SymbolIndex::resolve(target_name);
 
-		if (trampoline == nullptr) {
-			trampoline = VirtualAlloc(nullptr, 0x1000, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
-			use_far_jump = true;
+		if (original_function == nullptr) {
+			std::printf("[error] failed to resolve %s\n", target_name.c_str());
+			return nullptr;
 		}
 
-		if (trampoline == nullptr) {
-			std::wcout << L"[error] failed to allocate memory for trampoline: " << SystemInfo::last_error_string() << std::endl;
-			return nullptr;
+		return apply_hook_x64<Fn>(original_function, target_function);
+	}
+
+	// Hooks every function found by `signatures[i]` in `module` with `target_functions[i]`, using a single scan.
+	// A signature has to match exactly once, its trampoline is nullptr otherwise.
+	std::vector<void*> apply_hooks_x64(HMODULE module, const std::vector<std::string>& signatures, const std::vector<void*>& target_functions) {
+		std::vector<void*> trampolines(signatures.size(), nullptr);
+
+		if (signatures.size() != target_functions.size()) {
+			std::printf("[error] got %zu signatures but %zu hooks\n", signatures.size(), target_functions.size());
+			return trampolines;
 		}
 
-		if (use_far_jump) {
-			size = compute_hook_size(original_function, 14);
+		const auto matches = SignatureScanner::scan(module, signatures);
 
-			TrampolineBuilder trampoline_builder(original_function, size, trampoline);
-			trampoline_builder.build(target_function);
+		for (size_t i = 0; i < signatures.size(); i++) {
+			if (matches[i].size() != 1) {
+				std::printf("[error] signature %s matched %zu times\n", signatures[i].c_str(), matches[i].size());
+				continue;
+			}
 
-			const auto jump_back_ptr = trampoline_builder.get_jump_back_ptr();
-			const auto jump_to_hook_ptr = trampoline_builder.get_jump_to_hook_ptr();
+			trampolines[i] = apply_hook_x64<void*>(matches[i][0], target_functions[i]);
+		}
 
-			// Far jump to jump_back_ptr
-			// FF25 00000000 0000A7B90C020000 - jmp 20CB9A70000
-			const uint8_t far_jump[] = { 0xFF, 0x25,
-										 0x00, 0x00, 0x00, 0x00,
-										 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+		return trampolines;
+	}
 
-			*(uintptr_t*)(far_jump + 6) = (uintptr_t)jump_to_hook_ptr;
+	// Hooks every function in the .pdata of `module` with `target_for(function)`. Trampolines are built on a
+	// worker pool into per-thread arenas, then all patches are written with one protection change per region.
+	// Returns (function, trampoline) for every function that got hooked.
+	std::vector<std::pair<void*, void*>> instrument_module(HMODULE module, const std::function<void*(void*)>& target_for) {
+		return instrument(module, target_for, HookKind::code, nullptr);
+	}
 
-			ensure_protection(original_function, size, PAGE_EXECUTE_READWRITE, [=]() {
-				std::memcpy(original_function, far_jump, sizeof(far_jump));
-				std::memset(original_function, 0x90, size - sizeof(far_jump));
-			});
+	// One-shot hook: the first call sets the function's bit in its module's coverage bitmap, a worker thread then
+	// removes the hook within a few milliseconds. See Coverage::bitmap and Coverage::dump.
+	bool apply_coverage_hook(void* function) {
+		std::lock_guard<std::recursive_mutex> lock(patch_mutex);
+		ProtectionBatch batch;
 
-		} else {
-			size = compute_hook_size(original_function, 5);
+		const auto stub = Coverage::create_stub(function);
 
-			std::memcpy(trampoline, original_function, size);
-			place_jump((byte*)trampoline + size, (byte*)original_function + size);
-			place_qword_jump((byte*)trampoline + size + 5, (byte*)trampoline + 0x50);
-			*(uintptr_t*)((byte*)trampoline + 0x50) = (uintptr_t)target_function;
+		if (stub.code == nullptr) {
+			return false;
+		}
 
-			relocate(trampoline, original_function, size);
+		// Queued before the install so that its single flush covers the stub as well
+		if (is_perf_map_enabled) {
+			PerfMap::add(function, stub.code, stub.size, "coverage_stub:" + SymbolIndex::name_of(function));
+		}
 
-			ensure_protection(original_function, size, PAGE_EXECUTE_READWRITE, [=]() {
-				place_jump(original_function, (byte*)trampoline + size + 5);
-				std::memset((byte*)original_function + 5, 0x90, size - 5);
-			});
+		if (install_hook(function, stub.code, HookKind::coverage, stub.trampoline_slot) == nullptr) {
+			CodeArena::free(Coverage::release_stub(function).code);
+			PerfMap::remove(function);
+			return false;
 		}
 
-		active_hooks.insert(std::make_pair(original_function, create_hook_entry(trampoline, size)));
+		HookIndex::attach_stubs({ std::make_tuple(function, stub.code, stub.size) });
+		start_coverage_worker();
 
-		return reinterpret_cast<Fn>(trampoline);
+		return true;
 	}
 
-	void remove_hook(void* original_function) {
-		auto it = active_hooks.find(original_function);
+	// Coverage hooks on every function of `module`, installed like instrument_module
+	size_t apply_coverage_hooks(HMODULE module) {
+		std::lock_guard<std::recursive_mutex> lock(patch_mutex);
+		ProtectionBatch batch;
+
+		std::unordered_map<void*, CoverageStub> stubs;
+		std::vector<std::tuple<void*, void*, size_t>> indexed_stubs;
+
+		const auto installed = instrument(module, [&](void* function) {
+			const auto stub = Coverage::create_stub(function);
+
+			if (stub.code != nullptr) {
+				stubs[function] = stub;
+			}
+
+			return stub.code;
+		}, HookKind::coverage, [&](void* function, void* trampoline) {
+			*stubs[function].trampoline_slot = trampoline;
+		});
+
+		for (const auto& [function, trampoline] : installed) {
+			const auto& stub = stubs[function];
+			indexed_stubs.push_back(std::make_tuple(function, stub.code, stub.size));
+
+			if (is_perf_map_enabled) {
+				PerfMap::add(function, stub.code, stub.size, "coverage_stub:" + SymbolIndex::name_of(function));
+			}
+
+			stubs.erase(function);
+		}
+
+		// Functions that were not hooked never ran through their stub
+		for (const auto& [function, stub] : stubs) {
+			CodeArena::free(Coverage::release_stub(function).code);
+		}
+
+		HookIndex::attach_stubs(indexed_stubs);
+
+		if (is_perf_map_enabled) {
+			PerfMap::flush();
+		}
 
-		if (it != active_hooks.end()) {
-			const auto& hook = it->second;
-			const auto address = it->first;
+		if (!installed.empty()) {
+			start_coverage_worker();
+		}
+
+		return installed.size();
+	}
+
+	// Gives the hook on `function` a latency histogram and returns its id. The handler times itself and the
+	// original call with LatencyScope(id, LatencyKind::detour) and LatencyScope(id, LatencyKind::original).
+	uint32_t enable_latency(void* function) {
+		uint32_t latency_id = UINT32_MAX;
 
-			size_t num_bytes = hook.original_bytes.size();
+		HookRegistry::update(function, [&](hook& entry) {
+			if (entry.latency_id == UINT32_MAX) {
+				entry.latency_id = LatencyHistogram::allocate();
+			}
+
+			latency_id = entry.latency_id;
+		});
 
-			ensure_protection(address, num_bytes, PAGE_EXECUTE_READWRITE, [=]() {
-				memcpy(address, hook.original_bytes.data(), num_bytes);
+		return latency_id;
+	}
+
+	// p50/p99/p999 of every active hook with a histogram, taken while the handlers keep recording
+	std::vector<hook_latency> latency_snapshot() const {
+		std::vector<hook_latency> snapshot;
+
+		HookRegistry::for_each([&](const hook& entry) {
+			if (entry.latency_id == UINT32_MAX) {
+				return;
+			}
+
+			snapshot.push_back({
+				entry.address,
+				LatencyHistogram::summarize(entry.latency_id, LatencyKind::detour),
+				LatencyHistogram::summarize(entry.latency_id, LatencyKind::original)
 			});
+		});
 
-			if (!VirtualFree(hook.trampoline, 0, MEM_RELEASE)) {
-				std::wcout << "[error] failed to deallocate trampoline at " << std::hex << hook.trampoline << std::endl;
+		return snapshot;
+	}
+
+	// Redirects the import slots bound to `target_name` ("kernel32.dll!CreateFileW") in `importing_module`,
+	// or in every loaded module if it is nullptr. Nothing is rewritten, the original is the function itself.
+	template <typename Fn>
+	Fn apply_import_hook(const std::string& target_name, void* target_function, HMODULE importing_module = nullptr) {
+		return reinterpret_cast<Fn>(apply_import_hooks({ target_name }, { target_function }, importing_module)[0]);
+	}
+
+	// Batch version of apply_import_hook, all slots are written with one protection change per page run
+	std::vector<void*> apply_import_hooks(const std::vector<std::string>& target_names, const std::vector<void*>& target_functions,
+		HMODULE importing_module = nullptr) {
+		std::lock_guard<std::recursive_mutex> lock(patch_mutex);
+		ProtectionBatch batch;
+
+		std::vector<void*> originals(target_names.size(), nullptr);
+
+		if (target_names.size() != target_functions.size()) {
+			std::printf("[error] got %zu import names but %zu hooks\n", target_names.size(), target_functions.size());
+			return originals;
+		}
+
+		for (size_t i = 0; i < target_names.size(); i++) {
+			originals[i] = SymbolIndex::resolve(target_names[i]);
+
+			if (originals[i] == nullptr) {
+				std::printf("[error] failed to resolve %s\n", target_names[i].c_str());
 			}
+		}
+
+		const auto slots = importing_module != nullptr
+			? ImportTable::find_slots(importing_module, originals)
+			: ImportTable::find_slots(originals);
+
+		std::vector<std::pair<void**, void*>> writes;
 
-			active_hooks.erase(it);
+		for (const auto& slot : slots) {
+			if (originals[slot.function_index] == nullptr || HookRegistry::contains(slot.slot)) {
+				continue;
+			}
+
+			HookRegistry::insert(create_slot_entry(slot.slot, HookKind::import_slot));
+			writes.push_back(std::make_pair(slot.slot, target_functions[slot.function_index]));
+		}
+
+		// Slots that kept their old value are not hooked
+		for (const auto slot : ImportTable::write_slots(writes)) {
+			HookRegistry::erase(slot);
 		}
+
+		return originals;
 	}
 
-private:
-	static hook create_hook_entry(void* trampoline, size_t size) {
-		std::vector<byte> original_bytes(size);
-		std::memcpy(original_bytes.data(), trampoline, size);
+	// Restores every import slot that was bound to `target_name` before it got hooked
+	void remove_import_hook(const std::string& target_name) {
+		void* original_function = SymbolIndex::resolve(target_name);
+
+		if (original_function == nullptr) {
+			return;
+		}
+
+		std::lock_guard<std::recursive_mutex> lock(patch_mutex);
+		ProtectionBatch batch;
+
+		// Vtable slots may hold the same function, they are left alone
+		const auto removed = HookRegistry::extract_if([&](const hook& entry) {
+			return entry.kind == HookKind::import_slot && std::memcmp(entry.original_bytes(), &original_function, sizeof(void*)) == 0;
+		});
+
+		std::vector<std::pair<void**, void*>> writes;
 
-		return { trampoline, original_bytes };
+		for (const auto& entry : removed) {
+			writes.push_back(std::make_pair((void**)entry.address, original_function));
+			LatencyHistogram::release(entry.latency_id);
+		}
+
+		ImportTable::write_slots(writes);
+	}
+
+	// Replaces entry `index` of the vtable `object` points to, which every object of its class shares
+	template <typename Fn>
+	Fn apply_vtable_hook(void* object, size_t index, void* target_function) {
+		std::lock_guard<std::recursive_mutex> lock(patch_mutex);
+		ProtectionBatch batch;
+
+		const auto vtable = VirtualTable::get(object);
+		const auto count = VirtualTable::count_entries(vtable);
+
+		// Whatever follows the table in .rdata is not ours to patch
+		if (index >= count) {
+			std::printf("[error] vtable of %p has only %zu entries\n", object, count);
+			return nullptr;
+		}
+
+		return reinterpret_cast<Fn>(hook_slot(vtable + index, target_function));
+	}
+
+	// Gives `object` a private copy of its vtable first, other objects of the class keep calling the original.
+	// Call remove_object_hooks before the object is destroyed, the copy would otherwise outlive it.
+	template <typename Fn>
+	Fn apply_object_hook(void* object, size_t index, void* target_function) {
+		std::lock_guard<std::recursive_mutex> lock(patch_mutex);
+		ProtectionBatch batch;
+
+		auto it = cloned_vtables.find(object);
+
+		// A new object at the address of one that was destroyed with its hooks still on
+		if (it != cloned_vtables.end() && VirtualTable::get(object) != it->second.entries.data() + 1) {
+			std::printf("[error] %p no longer uses its vtable copy, dropping the stale hooks\n", object);
+
+			forget_clone(it);
+			it = cloned_vtables.end();
+		}
+
+		// Checked before cloning, an invalid index must not leave the object on a copy without hooks
+		const auto count = it != cloned_vtables.end() ? it->second.entries.size() - 1 : VirtualTable::count_entries(VirtualTable::get(object));
+
+		if (index >= count) {
+			std::printf("[error] vtable of %p has only %zu entries\n", object, count);
+			return nullptr;
+		}
+
+		if (it == cloned_vtables.end()) {
+			const auto original = VirtualTable::get(object);
+			it = cloned_vtables.insert(std::make_pair(object, cloned_vtable{ original, VirtualTable::clone(original) })).first;
+
+			VirtualTable::set(object, it->second.entries.data() + 1);
+		}
+
+		auto& entries = it->second.entries;
+
+		return reinterpret_cast<Fn>(hook_slot(&entries[index + 1], target_function));
 	}
 
+	// Points `object` back at its class vtable and drops every hook in its copy
+	void remove_object_hooks(void* object) {
+		std::lock_guard<std::recursive_mutex> lock(patch_mutex);
+		ProtectionBatch batch;
+
+		auto it = cloned_vtables.find(object);
+
+		if (it == cloned_vtables.end()) {
+			return;
+		}
+
+		// The vptr of another object must not be overwritten
+		if (VirtualTable::get(object) == it->second.entries.data() + 1) {
+			VirtualTable::set(object, it->second.original);
+		}
+
+		forget_clone(it);
+	}
+
+	void remove_hook(const std::string& target_name) {
+		void* original_function = SymbolIndex::resolve(target_name);
+
+		if (original_function != nullptr) {
+			remove_hook(original_function);
+		}
+	}
+
+	void remove_hook(void* original_function) {
+		remove_hooks({ original_function });
+	}
+
+	// Batch version of remove_hook, one protection change per page run and a single perf map rewrite
+	void remove_hooks(const std::vector<void*>& original_functions) {
+		std::lock_guard<std::recursive_mutex> lock(patch_mutex);
+		ProtectionBatch batch;
+
+		remove_hooks_locked(original_functions);
+
+		PerfMap::flush();
+		RetiredCode::collect();
+	}
+
+	// Primary .pdata entries, chained entries describe cold parts of a function and are skipped
+	static std::vector<void*> enumerate_functions(HMODULE module) {
+		std::vector<void*> functions;
+
+		const auto base = reinterpret_cast<uintptr_t>(module);
+		const auto dos_header = reinterpret_cast<PIMAGE_DOS_HEADER>(base);
+		const auto nt_headers = reinterpret_cast<PIMAGE_NT_HEADERS>(base + dos_header->e_lfanew);
+		const auto& directory = nt_headers->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXCEPTION];
+
+		const auto runtime_functions = reinterpret_cast<PRUNTIME_FUNCTION>(base + directory.VirtualAddress);
+		const size_t count = directory.Size / sizeof(RUNTIME_FUNCTION);
+
+		for (size_t i = 0; i < count; i++) {
+			// UNWIND_INFO starts with version:3 and flags:5
+			const auto unwind_flags = *reinterpret_cast<const uint8_t*>(base + (runtime_functions[i].UnwindData & ~1u)) >> 3;
+
+			if ((runtime_functions[i].UnwindData & 1) || (unwind_flags & UNW_FLAG_CHAININFO)) {
+				continue;
+			}
+
+			functions.push_back(reinterpret_cast<void*>(base + runtime_functions[i].BeginAddress));
+		}
+
+		return functions;
+	}
+
+	// Whole instructions covering at least `needed_size` bytes at `address`
 	static size_t compute_hook_size(const void* address, size_t needed_size) {
 		ZyanUSize offset = 0;
 		ZydisDisassembledInstruction instruction;
@@ -155,20 +542,6 @@ private:
 		return offset;
 	}
 
-	static void place_jump(void* from, void* to) {
-		*reinterpret_cast<byte*>(from) = 0xE9;
-		*reinterpret_cast<uint32_t*>(reinterpret_cast<byte*>(from) + 1) = static_cast<uint32_t>(reinterpret_cast<byte*>(to) - (reinterpret_cast<byte*>(from) + 5));
-	}
-
-	static void place_qword_jump(void* from, void* to) {
-		byte jump_qword[] = { 0xFF, 0x25, 0x00, 0x00, 0x00, 0x00 };
-		size_t disp = (size_t)to - ((size_t)from + sizeof(jump_qword));
-
-		*(uint32_t*)(jump_qword + 2) = static_cast<uint32_t>(disp);
-
-		std::memcpy(from, jump_qword, sizeof(jump_qword));
-	}
-
 	static void* allocate_around_2gb(const void* base_address, const size_t size = 0x500) {
 		const auto base = reinterpret_cast<uintptr_t>(base_address);
 		const auto num_pages_required = static_cast<size_t>(std::ceil((double)size / SystemInfo::page_size()));
@@ -232,6 +605,577 @@ private:
 			MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
 	}
 
+private:
+	// Everything apply_hook_x64 does. `trampoline_slot` is for targets that continue into the trampoline, it gets
+	// the trampoline's address before the patch can send the first call there.
+	void* install_hook(void* original_function, void* target_function, HookKind kind, void** trampoline_slot) {
+		std::lock_guard<std::recursive_mutex> lock(patch_mutex);
+		ProtectionBatch batch;
+
+		if (HookRegistry::contains(original_function)) {
+			std::printf("[error] %p is already hooked\n", original_function);
+			return nullptr;
+		}
+
+		size_t trampoline_size = near_trampoline_size;
+
+		// Runs from the RX view and is written through the RW one, see CodeArena
+		auto block = is_far_forced ? CodeBlock{ nullptr, nullptr, 0 } : CodeArena::allocate(original_function, trampoline_size);
+
+		if (block.code == nullptr) {
+			trampoline_size = far_trampoline_size;
+			block = CodeArena::allocate(nullptr, trampoline_size);
+		}
+
+		if (block.code == nullptr) {
+			std::printf("[error] failed to allocate memory for trampoline\n");
+			return nullptr;
+		}
+
+		void* trampoline = block.code;
+
+		// The jump-to-hook stub ends up somewhere inside the cave, so the whole cave has to be reachable
+		const auto plan = PatchSite::plan(original_function, (uintptr_t)trampoline, (uintptr_t)trampoline + trampoline_size);
+		const size_t size = compute_hook_size(original_function, plan.entry_size);
+
+		// Zydis stopped decoding before the entry was covered
+		if (size < plan.entry_size) {
+			std::printf("[error] failed to decode %zu bytes at %p\n", plan.entry_size, original_function);
+			CodeArena::free(trampoline);
+			return nullptr;
+		}
+
+		// Tiny functions would get their neighbour's first instructions stolen as well
+		const auto padding = PaddingIndex::lookup(original_function);
+
+		if ((uintptr_t)original_function + size > padding.end) {
+			std::printf("[error] %p is shorter than the %zu bytes a hook has to steal\n", original_function, size);
+			CodeArena::free(trampoline);
+			return nullptr;
+		}
+
+		// A branch back into the stolen bytes would land in the middle of the patch
+		const auto graph = ControlFlowGraph::for_function(original_function);
+		const auto inbound_target = graph->find_inbound_target((uintptr_t)original_function + 1, (uintptr_t)original_function + size);
+
+		if (inbound_target != 0) {
+			std::wcout << L"[error] branch target " << std::hex << (void*)inbound_target << L" lies inside the stolen bytes of " << original_function << std::endl;
+			CodeArena::free(trampoline);
+			return nullptr;
+		}
+
+		TrampolineBuilder trampoline_builder(original_function, size, trampoline, trampoline_size, block.writable);
+
+		if (!trampoline_builder.build(target_function)) {
+			CodeArena::free(trampoline);
+			return nullptr;
+		}
+
+		const auto jump_to_hook_ptr = trampoline_builder.get_jump_to_hook_ptr();
+		const auto entry = create_hook_entry(original_function, trampoline, size, plan, trampoline_builder.get_unwind_table(), kind);
+
+		if (trampoline_slot != nullptr) {
+			*trampoline_slot = trampoline;
+		}
+
+		if (!PatchSite::write(plan, original_function, size, jump_to_hook_ptr)) {
+			UnwindInfo::unregister(entry.unwind_table());
+			CodeArena::free(trampoline);
+			return nullptr;
+		}
+
+		HookRegistry::insert(entry);
+		HookIndex::insert({ create_hook_spans(original_function, size, plan, trampoline, trampoline_builder.get_code_size(),
+			trampoline_builder.get_used_size(), trampoline_builder.get_instruction_offsets()) });
+
+		if (is_perf_map_enabled) {
+			map_trampoline(original_function, trampoline, trampoline_builder.get_code_size(), trampoline_builder.get_jump_table_size());
+			PerfMap::flush();
+		}
+
+		return trampoline;
+	}
+
+	// instrument_module for hooks of `kind`. `publish(function, trampoline)` runs for every patch right before it is written.
+	std::vector<std::pair<void*, void*>> instrument(HMODULE module, const std::function<void*(void*)>& target_for, HookKind kind,
+		const std::function<void(void*, void*)>& publish) {
+		std::lock_guard<std::recursive_mutex> lock(patch_mutex);
+		ProtectionBatch batch;
+
+		const auto functions = enumerate_functions(module);
+
+		// `target_for` runs here so it does not have to be thread-safe
+		std::vector<void*> target_functions(functions.size());
+
+		for (size_t i = 0; i < functions.size(); i++) {
+			target_functions[i] = target_for(functions[i]);
+		}
+
+		// Build the module's padding index up front, the workers only read it
+		PaddingIndex::for_module(module);
+
+		std::vector<pending_patch> patches(functions.size());
+		std::atomic<size_t> next_function = 0;
+		std::mutex arena_mutex;
+
+		const auto worker = [&]() {
+			trampoline_arena arena = { nullptr, nullptr, 0, 0 };
+
+			for (;;) {
+				const size_t first = next_function.fetch_add(bulk_batch_size);
+
+				if (first >= functions.size()) {
+					break;
+				}
+
+				const size_t last = std::min(first + bulk_batch_size, functions.size());
+
+				for (size_t i = first; i < last; i++) {
+					patches[i].is_ready = target_functions[i] != nullptr && prepare_patch(functions[i], target_functions[i], arena, arena_mutex, patches[i]);
+				}
+			}
+		};
+
+		std::vector<std::thread> workers;
+		const auto thread_count = std::max(1u, std::thread::hardware_concurrency());
+
+		for (unsigned int i = 0; i < thread_count; i++) {
+			workers.emplace_back(worker);
+		}
+
+		for (auto& thread : workers) {
+			thread.join();
+		}
+
+		return commit_patches(patches, kind, publish);
+	}
+
+	// Runs on the workers: everything it touches is either local, read-only, guarded by `arena_mutex` or guarded by
+	// its own cache lock
+	static bool prepare_patch(void* function, void* target_function, trampoline_arena& arena, std::mutex& arena_mutex, pending_patch& patch) {
+		if (arena.size - arena.used < near_trampoline_size) {
+			std::lock_guard<std::mutex> lock(arena_mutex);
+
+			auto block = CodeArena::allocate(function, arena_size);
+
+			if (block.code == nullptr) {
+				block = CodeArena::allocate(nullptr, arena_size);
+			}
+
+			arena.base = block.code;
+			arena.writable = block.writable;
+
+			if (block.code != nullptr) {
+				arena_blocks[(uintptr_t)block.code] = { arena_size, 0 };
+			}
+
+			arena.used = 0;
+			arena.size = arena.base != nullptr ? arena_size : 0;
+
+			if (arena.base == nullptr) {
+				return false;
+			}
+		}
+
+		const auto cave = arena.base + arena.used;
+		const auto plan = PatchSite::plan(function, (uintptr_t)cave, (uintptr_t)cave + near_trampoline_size);
+		const size_t size = compute_hook_size(function, plan.entry_size);
+
+		if (size < plan.entry_size) {
+			return false;
+		}
+
+		// Tiny functions would get their neighbour's first instructions stolen as well
+		const auto padding = PaddingIndex::lookup(function);
+
+		if ((uintptr_t)function + size > padding.end) {
+			return false;
+		}
+
+		const auto graph = ControlFlowGraph::for_function(function);
+
+		if (graph->find_inbound_target((uintptr_t)function + 1, (uintptr_t)function + size) != 0) {
+			return false;
+		}
+
+		TrampolineBuilder trampoline_builder(function, size, cave, near_trampoline_size, arena.writable + arena.used);
+
+		if (!trampoline_builder.build(target_function)) {
+			return false;
+		}
+
+		arena.used += (trampoline_builder.get_used_size() + 15) & ~(size_t)15;
+		patch = { function, cave, trampoline_builder.get_jump_to_hook_ptr(), size, plan,
+			trampoline_builder.get_code_size(), trampoline_builder.get_jump_table_size(), trampoline_builder.get_unwind_table(),
+			trampoline_builder.get_used_size(), trampoline_builder.get_instruction_offsets(), true };
+
+		return true;
+	}
+
+	std::vector<std::pair<void*, void*>> commit_patches(const std::vector<pending_patch>& patches, HookKind kind,
+		const std::function<void(void*, void*)>& publish) {
+		std::vector<std::pair<void*, void*>> installed;
+		std::vector<const pending_patch*> accepted;
+		std::vector<HookSpans> spans;
+
+		// Neighbours may have planned a short hop into the same padding, the first one keeps it
+		std::map<uintptr_t, uintptr_t> claimed;
+
+		const auto overlaps_claimed = [&](uintptr_t begin, uintptr_t end) {
+			const auto it = claimed.upper_bound(begin);
+
+			return (it != claimed.begin() && std::prev(it)->second > begin) || (it != claimed.end() && it->first < end);
+		};
+
+		for (const auto& patch : patches) {
+			if (!patch.is_ready) {
+				continue;
+			}
+
+			if (HookRegistry::contains(patch.function)) {
+				UnwindInfo::unregister(patch.unwind_table);
+				continue;
+			}
+
+			const auto begin = (uintptr_t)patch.function;
+			const auto end = begin + patch.size;
+			const auto padding_end = patch.plan.padding_address + patch.plan.padding_size;
+
+			if (overlaps_claimed(begin, end) || (patch.plan.padding_size != 0 && overlaps_claimed(patch.plan.padding_address, padding_end))) {
+				UnwindInfo::unregister(patch.unwind_table);
+				continue;
+			}
+
+			claimed[begin] = end;
+
+			if (patch.plan.padding_size != 0) {
+				claimed[patch.plan.padding_address] = padding_end;
+			}
+
+			accepted.push_back(&patch);
+		}
+
+		// Patches come sorted by address, so each memory region is one run with one protection change
+		std::vector<bool> is_written(accepted.size(), false);
+		size_t first = 0;
+
+		while (first < accepted.size()) {
+			MEMORY_BASIC_INFORMATION mbi;
+			VirtualQuery(accepted[first]->function, &mbi, sizeof(mbi));
+
+			const auto region_begin = (uintptr_t)mbi.BaseAddress;
+			const auto region_end = region_begin + mbi.RegionSize;
+
+			auto run_begin = (uintptr_t)accepted[first]->function;
+			auto run_end = run_begin;
+			size_t last = first;
+
+			for (; last < accepted.size(); last++) {
+				const auto& patch = *accepted[last];
+
+				auto patch_begin = (uintptr_t)patch.function;
+				auto patch_end = patch_begin + patch.size;
+
+				if (patch.plan.padding_size != 0) {
+					patch_begin = std::min(patch_begin, patch.plan.padding_address);
+					patch_end = std::max(patch_end, patch.plan.padding_address + patch.plan.padding_size);
+				}
+
+				// A patch straddling two regions still gets a run of its own
+				if (last > first && (patch_begin < region_begin || patch_end > region_end)) {
+					break;
+				}
+
+				run_begin = std::min(run_begin, patch_begin);
+				run_end = std::max(run_end, patch_end);
+			}
+
+			// The batch keeps the pages of the run writable between the patches
+			for (size_t i = first; i < last; i++) {
+				if (publish) {
+					publish(accepted[i]->function, accepted[i]->trampoline);
+				}
+
+				is_written[i] = PatchSite::write(accepted[i]->plan, accepted[i]->function, accepted[i]->size, accepted[i]->jump_to_hook, false);
+			}
+
+			FlushInstructionCache(GetCurrentProcess(), (void*)run_begin, run_end - run_begin);
+
+			for (size_t i = first; i < last; i++) {
+				const auto& patch = *accepted[i];
+
+				// Nothing was redirected, the trampoline goes with its arena
+				if (!is_written[i]) {
+					UnwindInfo::unregister(patch.unwind_table);
+					continue;
+				}
+
+				auto entry = create_hook_entry(patch.function, patch.trampoline, patch.size, patch.plan, patch.unwind_table, kind);
+				entry.owns_trampoline = false;
+
+				HookRegistry::insert(entry);
+				spans.push_back(create_hook_spans(patch.function, patch.size, patch.plan, patch.trampoline, patch.code_size,
+					patch.used_size, patch.instruction_offsets));
+
+				std::prev(arena_blocks.upper_bound((uintptr_t)patch.trampoline))->second.live_hooks++;
+				installed.push_back(std::make_pair(patch.function, patch.trampoline));
+
+				if (is_perf_map_enabled) {
+					map_trampoline(patch.function, patch.trampoline, patch.code_size, patch.jump_table_size);
+				}
+			}
+
+			first = last;
+		}
+
+		HookIndex::insert(spans);
+
+		// Arenas that did not get a single hook, no thread has run their code
+		for (auto it = arena_blocks.begin(); it != arena_blocks.end();) {
+			if (it->second.live_hooks == 0) {
+				CodeArena::free((void*)it->first);
+				it = arena_blocks.erase(it);
+			} else {
+				it++;
+			}
+		}
+
+		// One write for the whole batch
+		if (is_perf_map_enabled) {
+			PerfMap::flush();
+		}
+
+		return installed;
+	}
+
+	// Called with `patch_mutex` held, the caller flushes the perf map
+	static void remove_hooks_locked(std::vector<void*> original_functions) {
+		// A function listed twice would have its trampoline retired twice
+		std::sort(original_functions.begin(), original_functions.end());
+		original_functions.erase(std::unique(original_functions.begin(), original_functions.end()), original_functions.end());
+
+		// A record is a single cache line, the copies keep everything below independent of the pool
+		std::vector<hook> removed;
+		std::vector<void*> addresses;
+
+		for (const auto function : original_functions) {
+			hook entry;
+
+			if (!HookRegistry::find(function, entry)) {
+				continue;
+			}
+
+			if (entry.is_slot()) {
+				void* bound_address;
+				std::memcpy(&bound_address, entry.original_bytes(), sizeof(void*));
+
+				ImportTable::write_slots({ std::make_pair((void**)entry.address, bound_address) });
+				erase_record(entry.address);
+				continue;
+			}
+
+			// Other threads may be calling the function right now. The padding stays as it is, a thread may have
+			// taken the short hop and not yet the jump behind it, retire_trampoline puts it back later.
+			PatchWriter::write_live(entry.address, entry.original_bytes(), entry.original_size);
+			FlushInstructionCache(GetCurrentProcess(), entry.address, entry.original_size);
+
+			removed.push_back(entry);
+			addresses.push_back(entry.address);
+		}
+
+		// Waits out lookups that may still hand out the trampolines, one index rebuild for the whole batch
+		std::vector<HookSpans> spans;
+		HookIndex::erase(addresses, spans);
+
+		for (size_t i = 0; i < removed.size(); i++) {
+			const auto& entry = removed[i];
+			const auto stub = entry.kind == HookKind::coverage ? Coverage::release_stub(entry.address) : CoverageStub{ nullptr, 0, nullptr };
+
+			retire_trampoline(entry, spans[i], stub);
+
+			PerfMap::remove(entry.address);
+			erase_record(entry.address);
+		}
+	}
+
+	// Drops a vtable copy and the records of its slots, the object is not touched
+	static void forget_clone(std::unordered_map<void*, cloned_vtable>::iterator it) {
+		for (auto& slot : it->second.entries) {
+			erase_record(&slot);
+		}
+
+		cloned_vtables.erase(it);
+	}
+
+	// Drops the record of `address` and gives its latency histogram back
+	static void erase_record(void* address) {
+		hook entry;
+
+		if (HookRegistry::find(address, entry)) {
+			LatencyHistogram::release(entry.latency_id);
+			HookRegistry::erase(address);
+		}
+	}
+
+	// Threads may still run in the padding, the trampoline or the coverage stub, or hold a pointer to them, so the
+	// padding is put back and both are freed once they are out
+	static void retire_trampoline(const hook& entry, const HookSpans& spans, const CoverageStub& stub) {
+		const auto trampoline = (uintptr_t)entry.trampoline;
+		const auto unwind_table = entry.unwind_table();
+		const bool owns_trampoline = entry.owns_trampoline;
+
+		std::vector<std::pair<uintptr_t, uintptr_t>> ranges = { std::make_pair(trampoline, trampoline + spans.trampoline_size) };
+
+		std::pair<uintptr_t, uintptr_t> padding_range = { 0, 0 };
+
+		if (entry.padding_size != 0) {
+			padding_range = std::make_pair((uintptr_t)entry.padding(), (uintptr_t)entry.padding() + entry.padding_size);
+			ranges.push_back(padding_range);
+		}
+
+		if (stub.code != nullptr) {
+			ranges.push_back(std::make_pair((uintptr_t)stub.code, (uintptr_t)stub.code + stub.size));
+		}
+
+		// The last bulk hook of an arena takes the whole arena with it. Trampolines retired before may still be
+		// waiting for their threads, so the wait covers all of it.
+		uintptr_t arena = 0;
+
+		if (!owns_trampoline) {
+			const auto block = std::prev(arena_blocks.upper_bound(trampoline));
+
+			if (--block->second.live_hooks == 0) {
+				arena = block->first;
+				ranges.push_back(std::make_pair(arena, arena + block->second.size));
+				arena_blocks.erase(block);
+			}
+		}
+
+		RetiredCode::retire(ranges, [=]() {
+			if (entry.padding_size != 0) {
+				PatchWriter::write(entry.padding(), entry.padding_bytes(), entry.padding_size);
+				FlushInstructionCache(GetCurrentProcess(), entry.padding(), entry.padding_size);
+			}
+
+			UnwindInfo::unregister(unwind_table);
+
+			if (owns_trampoline) {
+				CodeArena::free((void*)trampoline);
+			}
+
+			if (arena != 0) {
+				CodeArena::free((void*)arena);
+			}
+
+			if (stub.code != nullptr) {
+				CodeArena::free(stub.code);
+			}
+		}, padding_range);
+	}
+
+	// Called with `patch_mutex` held
+	static void start_coverage_worker() {
+		if (!is_coverage_worker_running) {
+			is_coverage_worker_running = true;
+			std::thread(coverage_worker).detach();
+		}
+	}
+
+	// Puts functions back after their first hit. The stubs only set a bit, so nothing a hooked thread does ever
+	// waits for `patch_mutex`. Exits once there is nothing left to poll, the next coverage hook starts it again.
+	static void coverage_worker() {
+		for (;;) {
+			Sleep(coverage_poll_interval);
+
+			std::lock_guard<std::recursive_mutex> lock(patch_mutex);
+			ProtectionBatch batch;
+
+			const auto hits = Coverage::take_hits();
+
+			if (!hits.empty()) {
+				remove_hooks_locked(hits);
+				PerfMap::flush();
+			}
+
+			RetiredCode::collect();
+
+			if (!Coverage::has_live_stubs() && RetiredCode::get_pending() == 0) {
+				is_coverage_worker_running = false;
+				return;
+			}
+		}
+	}
+
+	// Queues the perf map entries of one trampoline, the caller flushes
+	static void map_trampoline(void* function, void* trampoline, size_t code_size, size_t jump_table_size) {
+		const auto name = SymbolIndex::name_of(function);
+
+		PerfMap::add(function, trampoline, code_size, "trampoline:" + name);
+		PerfMap::add(function, (uint8_t*)trampoline + code_size, jump_table_size, "jump_table:" + name);
+	}
+
+	// Points a vtable slot at `target_function` and records it like an import hook
+	void* hook_slot(void** slot, void* target_function) {
+		if (HookRegistry::contains(slot)) {
+			std::printf("[error] slot %p is already hooked\n", (void*)slot);
+			return nullptr;
+		}
+
+		void* original_function = *slot;
+
+		HookRegistry::insert(create_slot_entry(slot, HookKind::vtable_slot));
+
+		if (!ImportTable::write_slots({ std::make_pair(slot, target_function) }).empty()) {
+			HookRegistry::erase(slot);
+			return nullptr;
+		}
+
+		return original_function;
+	}
+
+	static_assert(PatchSite::max_saved_size <= hook::max_saved_bytes);
+
+	// Must run before the patch is written, the trampoline only holds rewritten instructions. Whole instructions
+	// covering the entry plus the padding stay within hook::max_saved_bytes for every PatchSite encoding.
+	static hook create_hook_entry(void* original_function, void* trampoline, size_t size, const PatchPlan& plan, PRUNTIME_FUNCTION unwind_table,
+		HookKind kind) {
+		hook entry;
+		entry.address = original_function;
+		entry.trampoline = trampoline;
+		entry.kind = kind;
+		entry.padding_offset = plan.padding_size != 0 ? static_cast<int32_t>(plan.padding_address - (uintptr_t)original_function) : 0;
+		entry.unwind_offset = unwind_table != nullptr ? static_cast<uint16_t>((uintptr_t)unwind_table - (uintptr_t)trampoline) : 0;
+		entry.original_size = static_cast<uint8_t>(size);
+		entry.padding_size = static_cast<uint8_t>(plan.padding_size);
+
+		std::memcpy(entry.saved_bytes, original_function, size);
+		std::memcpy(entry.saved_bytes + size, (const void*)plan.padding_address, plan.padding_size);
+
+		return entry;
+	}
+
+	static hook create_slot_entry(void** slot, HookKind kind) {
+		hook entry;
+		entry.address = slot;
+		entry.original_size = sizeof(void*);
+		entry.kind = kind;
+		entry.owns_trampoline = false;
+
+		std::memcpy(entry.saved_bytes, slot, sizeof(void*));
+
+		return entry;
+	}
+
+	static HookSpans create_hook_spans(void* function, size_t size, const PatchPlan& plan, void* trampoline, size_t code_size,
+		size_t trampoline_size, const std::vector<std::pair<size_t, size_t>>& instruction_offsets) {
+		return { function, size, plan.padding_address, plan.padding_size, trampoline, code_size, trampoline_size, 0, 0, instruction_offsets };
+	}
+
+	static void place_jump(void* from, void* to) {
+		*reinterpret_cast<byte*>(from) = 0xE9;
+		*reinterpret_cast<uint32_t*>(reinterpret_cast<byte*>(from) + 1) = static_cast<uint32_t>(reinterpret_cast<byte*>(to) - (reinterpret_cast<byte*>(from) + 5));
+	}
+
 	static bool relocate(void* trampoline_base, void* original_base, size_t size) {
 		const auto delta = (uintptr_t)original_base - (uintptr_t)trampoline_base;
 		const auto abs_delta = std::abs((long long)original_base - (long long)trampoline_base);
@@ -289,12 +1233,16 @@ private:
 		return true;
 	}
 
+	// Goes through PageProtection, writable pages are not touched and the way back may be deferred to the batch
 	template <typename Lambda>
-	static void ensure_protection(void* address, size_t size, uint32_t new_protection, Lambda action) {
-		DWORD old_protection;
+	static bool ensure_writable(void* address, size_t size, Lambda action) {
+		if (!PageProtection::acquire(address, size)) {
+			return false;
+		}
 
-		VirtualProtect(address, size, new_protection, &old_protection);
 		action();
-		VirtualProtect(address, size, old_protection, &old_protection);
+		PageProtection::release(address, size);
+
+		return true;
 	}
 };
\ No newline at end of file
@@ -0,0 +1,290 @@
+#include <cstdio>
+
+#include "HookRegistry.h"
+
+HookRegistry::Shard HookRegistry::shards[HookRegistry::shard_count];
+
+bool HookRegistry::contains(const void* address) {
+	const auto& shard = shard_of(address);
+	const auto key = reinterpret_cast<uintptr_t>(address);
+
+	for (;;) {
+		const auto sequence = shard.sequence.load(std::memory_order_acquire);
+		const auto table = shard.table.load(std::memory_order_acquire);
+
+		if (table == nullptr) {
+			return false;
+		}
+
+		const auto mask = table->capacity - 1;
+
+		// Writers keep at least half of the slots empty, so every probe ends at one
+		for (auto index = mix(key) & mask;; index = (index + 1) & mask) {
+			const auto value = table->slots[index].load(std::memory_order_acquire);
+
+			if (value == key) {
+				return true;
+			}
+
+			if (value == empty_slot) {
+				break;
+			}
+		}
+
+		// A compaction may have moved the address behind the probe
+		std::atomic_thread_fence(std::memory_order_acquire);
+
+		if (sequence % 2 == 0 && shard.sequence.load(std::memory_order_relaxed) == sequence) {
+			return false;
+		}
+	}
+}
+
+bool HookRegistry::insert(const hook& entry) {
+	auto& shard = shard_of(entry.address);
+	AcquireSRWLockExclusive(&shard.lock);
+
+	bool is_inserted = false;
+
+	if (!shard.hooks.contains(entry.address)) {
+		const auto record = allocate_record(shard);
+
+		if (record != nullptr) {
+			*record = entry;
+			record->state = HookState::active;
+
+			shard.hooks.insert(std::make_pair(entry.address, record));
+			insert_address(shard, reinterpret_cast<uintptr_t>(entry.address));
+
+			is_inserted = true;
+		}
+	}
+
+	ReleaseSRWLockExclusive(&shard.lock);
+
+	return is_inserted;
+}
+
+bool HookRegistry::erase(void* address) {
+	auto& shard = shard_of(address);
+	AcquireSRWLockExclusive(&shard.lock);
+
+	const auto it = shard.hooks.find(address);
+	const bool is_erased = it != shard.hooks.end();
+
+	if (is_erased) {
+		free_record(shard, it->second);
+		shard.hooks.erase(it);
+		erase_address(shard, reinterpret_cast<uintptr_t>(address));
+	}
+
+	ReleaseSRWLockExclusive(&shard.lock);
+
+	return is_erased;
+}
+
+std::vector<hook> HookRegistry::extract_if(const std::function<bool(const hook& entry)>& predicate) {
+	std::vector<hook> extracted;
+
+	for (auto& shard : shards) {
+		AcquireSRWLockExclusive(&shard.lock);
+
+		for (uint32_t i = 0; i < shard.pool_size; i++) {
+			const auto record = &shard.pool[i];
+
+			if (record->state != HookState::active || !predicate(*record)) {
+				continue;
+			}
+
+			extracted.push_back(*record);
+
+			shard.hooks.erase(record->address);
+			erase_address(shard, reinterpret_cast<uintptr_t>(record->address));
+			free_record(shard, record);
+		}
+
+		ReleaseSRWLockExclusive(&shard.lock);
+	}
+
+	return extracted;
+}
+
+bool HookRegistry::update(void* address, const std::function<void(hook& entry)>& action) {
+	auto& shard = shard_of(address);
+	AcquireSRWLockExclusive(&shard.lock);
+
+	const auto it = shard.hooks.find(address);
+
+	if (it != shard.hooks.end()) {
+		action(*it->second);
+	}
+
+	ReleaseSRWLockExclusive(&shard.lock);
+
+	return it != shard.hooks.end();
+}
+
+void HookRegistry::for_each(const std::function<void(const hook& entry)>& action) {
+	for (auto& shard : shards) {
+		AcquireSRWLockShared(&shard.lock);
+
+		for (uint32_t i = 0; i < shard.pool_size; i++) {
+			if (shard.pool[i].state == HookState::active) {
+				action(shard.pool[i]);
+			}
+		}
+
+		ReleaseSRWLockShared(&shard.lock);
+	}
+}
+
+bool HookRegistry::find(void* address, hook& entry) {
+	auto& shard = shard_of(address);
+	AcquireSRWLockShared(&shard.lock);
+
+	const auto it = shard.hooks.find(address);
+	const bool is_found = it != shard.hooks.end();
+
+	if (is_found) {
+		entry = *it->second;
+	}
+
+	ReleaseSRWLockShared(&shard.lock);
+
+	return is_found;
+}
+
+uint64_t HookRegistry::mix(uintptr_t address) {
+	// Fibonacci hashing, code addresses share their low bits far too often to be used directly
+	return (static_cast<uint64_t>(address) * 0x9E3779B97F4A7C15ull) >> 16;
+}
+
+HookRegistry::Shard& HookRegistry::shard_of(const void* address) {
+	return shards[(static_cast<uint64_t>(reinterpret_cast<uintptr_t>(address)) * 0x9E3779B97F4A7C15ull) >> (64 - shard_bits)];
+}
+
+hook* HookRegistry::allocate_record(Shard& shard) {
+	if (!shard.free_records.empty()) {
+		const auto index = shard.free_records.back();
+		shard.free_records.pop_back();
+
+		return &shard.pool[index];
+	}
+
+	if (shard.pool == nullptr) {
+		shard.pool = static_cast<hook*>(VirtualAlloc(nullptr, pool_capacity * sizeof(hook), MEM_RESERVE, PAGE_READWRITE));
+
+		if (shard.pool == nullptr) {
+			std::printf("[error] failed to reserve the hook record pool\n");
+			return nullptr;
+		}
+	}
+
+	if (shard.pool_size == shard.pool_committed) {
+		if (shard.pool_committed == pool_capacity) {
+			std::printf("[error] hook record pool is full\n");
+			return nullptr;
+		}
+
+		if (VirtualAlloc(shard.pool + shard.pool_committed, pool_commit_size * sizeof(hook), MEM_COMMIT, PAGE_READWRITE) == nullptr) {
+			std::printf("[error] failed to commit hook records\n");
+			return nullptr;
+		}
+
+		shard.pool_committed += pool_commit_size;
+	}
+
+	return &shard.pool[shard.pool_size++];
+}
+
+void HookRegistry::free_record(Shard& shard, hook* entry) {
+	entry->state = HookState::free;
+	shard.free_records.push_back(static_cast<uint32_t>(entry - shard.pool));
+}
+
+void HookRegistry::insert_address(Shard& shard, uintptr_t address) {
+	auto table = shard.table.load(std::memory_order_relaxed);
+
+	if (table == nullptr || (shard.used + 1) * 2 > table->capacity) {
+		rebuild_table(shard, shard.hooks.size());
+		return;
+	}
+
+	const auto mask = table->capacity - 1;
+
+	// Erased slots on the way are taken over, so hooking the same functions over and over does not fill the table
+	for (auto index = mix(address) & mask;; index = (index + 1) & mask) {
+		const auto value = table->slots[index].load(std::memory_order_relaxed);
+
+		if (value == empty_slot || value == erased_slot) {
+			shard.used += value == empty_slot ? 1 : 0;
+			table->slots[index].store(address, std::memory_order_release);
+			return;
+		}
+	}
+}
+
+void HookRegistry::erase_address(Shard& shard, uintptr_t address) {
+	const auto table = shard.table.load(std::memory_order_relaxed);
+	const auto mask = table->capacity - 1;
+
+	for (auto index = mix(address) & mask;; index = (index + 1) & mask) {
+		const auto value = table->slots[index].load(std::memory_order_relaxed);
+
+		if (value == address) {
+			table->slots[index].store(erased_slot, std::memory_order_release);
+			return;
+		}
+
+		if (value == empty_slot) {
+			return;
+		}
+	}
+}
+
+void HookRegistry::rebuild_table(Shard& shard, size_t live_count) {
+	size_t capacity = min_table_capacity;
+
+	while (capacity < live_count * 4) {
+		capacity *= 2;
+	}
+
+	const auto current = shard.table.load(std::memory_order_relaxed);
+	shard.used = shard.hooks.size();
+
+	if (current != nullptr && capacity <= current->capacity) {
+		shard.sequence.store(shard.sequence.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+
+		fill_table(shard, *current);
+
+		shard.sequence.store(shard.sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		return;
+	}
+
+	const auto table = new AddressTable{ capacity, new std::atomic<uintptr_t>[capacity] };
+	fill_table(shard, *table);
+
+	// Readers may still be probing the old table and nothing tells when they are done, so it is never freed.
+	// Only growth allocates and each new table is at least twice the old one, so the retired ones add up to
+	// less than the live one.
+	shard.table.store(table, std::memory_order_release);
+}
+
+void HookRegistry::fill_table(const Shard& shard, AddressTable& table) {
+	const auto mask = table.capacity - 1;
+
+	for (size_t i = 0; i < table.capacity; i++) {
+		table.slots[i].store(empty_slot, std::memory_order_relaxed);
+	}
+
+	for (const auto& [address, entry] : shard.hooks) {
+		auto index = mix(reinterpret_cast<uintptr_t>(address)) & mask;
+
+		while (table.slots[index].load(std::memory_order_relaxed) != empty_slot) {
+			index = (index + 1) & mask;
+		}
+
+		table.slots[index].store(reinterpret_cast<uintptr_t>(address), std::memory_order_relaxed);
+	}
+}
\ No newline at end of file
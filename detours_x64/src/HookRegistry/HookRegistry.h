@@ -0,0 +1,158 @@
+#pragma once
+
+#include <Windows.h>
+#include <cstdint>
+#include <atomic>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+
+enum class HookState : uint8_t {
+	free,
+	active
+};
+
+enum class HookKind : uint8_t {
+	code,		// Patched function entry with a trampoline
+	coverage,	// Code hook whose target is a Coverage stub, removed again after the first hit
+	import_slot,	// IAT slot pointing elsewhere, nothing is rewritten
+	vtable_slot		// Entry of a shared or cloned vtable, likewise
+};
+
+// One cache line per hook. Stolen bytes and the padding they spill into add up to PatchSite::max_saved_size (30) bytes at most.
+struct alignas(64) hook {
+	static constexpr size_t max_saved_bytes = 33;
+
+	// Patched function, or the pointer slot of import and vtable hooks
+	void* address = nullptr;
+
+	// nullptr for import and vtable hooks, `original_bytes()` is then the slot's old value
+	void* trampoline = nullptr;
+
+	// Padding around the function that holds the long jump or its target slot, relative to `address`
+	int32_t padding_offset = 0;
+
+	// LatencyHistogram id, UINT32_MAX while latency tracking is off for this hook
+	uint32_t latency_id = UINT32_MAX;
+
+	// Function table of the trampoline relative to it, 0 if it has none. See TrampolineBuilder::get_unwind_table.
+	uint16_t unwind_offset = 0;
+
+	uint8_t original_size = 0;
+	uint8_t padding_size = 0;
+
+	HookState state = HookState::free;
+	HookKind kind = HookKind::code;
+
+	// Bulk hooks carve their trampolines out of a shared arena, which goes once its last hook is removed
+	bool owns_trampoline = true;
+
+	// Original bytes followed by the padding bytes, both taken before the patch was written
+	byte saved_bytes[max_saved_bytes] = { };
+
+	const byte* original_bytes() const {
+		return saved_bytes;
+	}
+
+	const byte* padding_bytes() const {
+		return saved_bytes + original_size;
+	}
+
+	void* padding() const {
+		return static_cast<byte*>(address) + padding_offset;
+	}
+
+	bool is_slot() const {
+		return kind == HookKind::import_slot || kind == HookKind::vtable_slot;
+	}
+
+	PRUNTIME_FUNCTION unwind_table() const {
+		return unwind_offset != 0 ? reinterpret_cast<PRUNTIME_FUNCTION>(static_cast<byte*>(trampoline) + unwind_offset) : nullptr;
+	}
+};
+
+static_assert(sizeof(hook) == 64);
+
+// Every hook of the process, whichever HookLib instance installed it. Lookups never lock, so dispatchers and
+// handlers may ask on every call. Mutations lock one of the shards the addresses are spread over.
+class HookRegistry {
+private:
+	static constexpr size_t shard_bits = 6;
+	static constexpr size_t shard_count = 1 << shard_bits;
+	static constexpr size_t min_table_capacity = 64;
+
+	// Records per shard, the pool reserves 16 MiB of address space for them and commits a page at a time
+	static constexpr uint32_t pool_capacity = 1 << 18;
+	static constexpr uint32_t pool_commit_size = 64;
+
+	static constexpr uintptr_t empty_slot = 0;
+	static constexpr uintptr_t erased_slot = 1;
+
+	// Open-addressing set of the hooked addresses, probed linearly
+	struct AddressTable {
+		size_t capacity;
+		std::atomic<uintptr_t>* slots;
+	};
+
+	struct alignas(64) Shard {
+		SRWLOCK lock = SRWLOCK_INIT;
+
+		// Records never move, so scans are linear and pointers stay valid until the record is erased
+		hook* pool = nullptr;
+		uint32_t pool_size = 0;
+		uint32_t pool_committed = 0;
+		std::vector<uint32_t> free_records;
+
+		std::unordered_map<void*, hook*> hooks;
+
+		std::atomic<AddressTable*> table{ nullptr };
+
+		// Odd while `table` is compacted in place, readers that miss retry once it is even and unchanged again
+		std::atomic<uint32_t> sequence{ 0 };
+
+		// Live plus erased slots of `table`
+		size_t used = 0;
+	};
+
+	static Shard shards[shard_count];
+
+public:
+	// Lock-free
+	static bool contains(const void* address);
+
+	// False if `entry.address` is hooked already or its shard's pool is full
+	static bool insert(const hook& entry);
+
+	static bool erase(void* address);
+
+	// Removes every record `predicate` accepts and returns them
+	static std::vector<hook> extract_if(const std::function<bool(const hook& entry)>& predicate);
+
+	// Runs `action` on the record with its shard locked exclusively, false if `address` is not hooked
+	static bool update(void* address, const std::function<void(hook& entry)>& action);
+
+	// Scans the pools one shard at a time, so the records seen are not a snapshot of a single moment
+	static void for_each(const std::function<void(const hook& entry)>& action);
+
+	// Copies the record out under the shard's lock, false if `address` is not hooked
+	static bool find(void* address, hook& entry);
+
+private:
+	static uint64_t mix(uintptr_t address);
+
+	static Shard& shard_of(const void* address);
+
+	static hook* allocate_record(Shard& shard);
+
+	static void free_record(Shard& shard, hook* entry);
+
+	static void insert_address(Shard& shard, uintptr_t address);
+
+	static void erase_address(Shard& shard, uintptr_t address);
+
+	// Drops the erased slots. Publishes a larger table if `live_count` could not grow fourfold in the current one,
+	// otherwise rewrites the current one in place.
+	static void rebuild_table(Shard& shard, size_t live_count);
+
+	static void fill_table(const Shard& shard, AddressTable& table);
+};
\ No newline at end of file
@@ -0,0 +1,106 @@
+#include <Psapi.h>
+#include <algorithm>
+#include <cstdio>
+#include <unordered_map>
+
+#include "ImportTable.h"
+#include "SystemInfo/SystemInfo.h"
+#include "PageProtection/PageProtection.h"
+
+std::vector<ImportSlot> ImportTable::find_slots(HMODULE module, const std::vector<void*>& functions) {
+	std::vector<ImportSlot> slots;
+
+	const auto base = reinterpret_cast<uintptr_t>(module);
+	const auto dos_header = reinterpret_cast<PIMAGE_DOS_HEADER>(base);
+	const auto nt_headers = reinterpret_cast<PIMAGE_NT_HEADERS>(base + dos_header->e_lfanew);
+	const auto& directory = nt_headers->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT];
+
+	if (directory.VirtualAddress == 0 || directory.Size == 0) {
+		return slots;
+	}
+
+	std::unordered_map<uintptr_t, size_t> function_indices;
+
+	for (size_t i = 0; i < functions.size(); i++) {
+		function_indices.insert(std::make_pair(reinterpret_cast<uintptr_t>(functions[i]), i));
+	}
+
+	// One walk over all thunks, whatever the number of functions
+	for (auto descriptor = reinterpret_cast<PIMAGE_IMPORT_DESCRIPTOR>(base + directory.VirtualAddress); descriptor->Name != 0; descriptor++) {
+		for (auto thunk = reinterpret_cast<uintptr_t*>(base + descriptor->FirstThunk); *thunk != 0; thunk++) {
+			const auto it = function_indices.find(*thunk);
+
+			if (it != function_indices.end()) {
+				slots.push_back({ reinterpret_cast<void**>(thunk), it->second });
+			}
+		}
+	}
+
+	return slots;
+}
+
+std::vector<ImportSlot> ImportTable::find_slots(const std::vector<void*>& functions) {
+	std::vector<HMODULE> modules(256);
+	DWORD needed = 0;
+
+	while (EnumProcessModules(GetCurrentProcess(), modules.data(), (DWORD)(modules.size() * sizeof(HMODULE)), &needed)
+		&& needed > modules.size() * sizeof(HMODULE)) {
+		modules.resize(needed / sizeof(HMODULE));
+	}
+
+	modules.resize(needed / sizeof(HMODULE));
+
+	std::vector<ImportSlot> slots;
+
+	for (const auto module : modules) {
+		const auto module_slots = find_slots(module, functions);
+		slots.insert(slots.end(), module_slots.begin(), module_slots.end());
+	}
+
+	return slots;
+}
+
+std::vector<void**> ImportTable::write_slots(std::vector<std::pair<void**, void*>> writes) {
+	std::vector<void**> failed;
+
+	if (writes.empty()) {
+		return failed;
+	}
+
+	std::sort(writes.begin(), writes.end());
+
+	const uintptr_t page_size = SystemInfo::page_size();
+	size_t first = 0;
+
+	while (first < writes.size()) {
+		const auto run_begin = reinterpret_cast<uintptr_t>(writes[first].first) & ~(page_size - 1);
+		auto run_end = (reinterpret_cast<uintptr_t>(writes[first].first + 1) + page_size - 1) & ~(page_size - 1);
+		size_t last = first + 1;
+
+		// Extend the run while the next slot sits on the same or the directly following page
+		while (last < writes.size() && reinterpret_cast<uintptr_t>(writes[last].first) < run_end + page_size) {
+			run_end = (reinterpret_cast<uintptr_t>(writes[last].first + 1) + page_size - 1) & ~(page_size - 1);
+			last++;
+		}
+
+		if (!PageProtection::acquire(reinterpret_cast<void*>(run_begin), run_end - run_begin)) {
+			std::printf("[error] failed to unprotect import slots at %p\n", (void*)run_begin);
+
+			for (size_t i = first; i < last; i++) {
+				failed.push_back(writes[i].first);
+			}
+
+			first = last;
+			continue;
+		}
+
+		for (size_t i = first; i < last; i++) {
+			*writes[i].first = writes[i].second;
+		}
+
+		PageProtection::release(reinterpret_cast<void*>(run_begin), run_end - run_begin);
+		first = last;
+	}
+
+	return failed;
+}
\ No newline at end of file
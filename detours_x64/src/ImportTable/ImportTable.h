@@ -0,0 +1,27 @@
+#pragma once
+
+#include <Windows.h>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+struct ImportSlot {
+	void** slot;
+
+	// Index into the function list the slot was matched against
+	size_t function_index;
+};
+
+class ImportTable {
+public:
+	// Every IAT slot of `module` that currently holds one of `functions`. Slots are matched by the
+	// address the loader bound, so imports through forwarders and API sets are found too.
+	static std::vector<ImportSlot> find_slots(HMODULE module, const std::vector<void*>& functions);
+
+	// Same as above for every module loaded in the process
+	static std::vector<ImportSlot> find_slots(const std::vector<void*>& functions);
+
+	// Writes all (slot, value) pairs, changing the protection once per run of adjacent pages.
+	// Returns the slots that were left as they were because their page could not be unprotected.
+	static std::vector<void**> write_slots(std::vector<std::pair<void**, void*>> writes);
+};
\ No newline at end of file
@@ -0,0 +1,228 @@
+#include <Windows.h>
+#include <algorithm>
+#include <vector>
+#include <cstdio>
+
+#include "LatencyHistogram.h"
+#include "SystemInfo/SystemInfo.h"
+
+uint32_t* LatencyHistogram::counters = nullptr;
+size_t LatencyHistogram::max_histograms = 0;
+size_t LatencyHistogram::max_shards = 0;
+
+std::atomic<size_t> LatencyHistogram::next_histogram = 0;
+std::atomic<size_t> LatencyHistogram::next_shard = 0;
+std::unique_ptr<std::atomic<bool>[]> LatencyHistogram::shard_claimed;
+
+std::mutex LatencyHistogram::free_mutex;
+std::vector<uint32_t> LatencyHistogram::free_ids;
+
+thread_local uint32_t* LatencyHistogram::current_shard = nullptr;
+thread_local LatencyHistogram::ShardLease LatencyHistogram::lease;
+
+bool LatencyHistogram::configure(size_t histogram_count, size_t thread_count) {
+	if (counters != nullptr) {
+		std::printf("[error] latency histograms are already configured\n");
+		return false;
+	}
+
+	const auto size = histogram_count * thread_count * kind_count * bucket_count * sizeof(uint32_t);
+
+	// Committed but untouched pages cost nothing until a thread records into them
+	counters = static_cast<uint32_t*>(VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+
+	if (counters == nullptr) {
+		std::printf("[error] failed to allocate 0x%zx bytes for latency histograms\n", size);
+		return false;
+	}
+
+	shard_claimed = std::make_unique<std::atomic<bool>[]>(thread_count);
+
+	max_histograms = histogram_count;
+	max_shards = thread_count;
+
+	return true;
+}
+
+uint32_t LatencyHistogram::allocate() {
+	{
+		std::lock_guard<std::mutex> lock(free_mutex);
+
+		if (!free_ids.empty()) {
+			const auto id = free_ids.back();
+			free_ids.pop_back();
+
+			clear(id);
+			return id;
+		}
+	}
+
+	const auto id = next_histogram.fetch_add(1);
+
+	return id < max_histograms ? static_cast<uint32_t>(id) : UINT32_MAX;
+}
+
+void LatencyHistogram::release(uint32_t id) {
+	if (id >= max_histograms) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(free_mutex);
+
+	free_ids.push_back(id);
+}
+
+void LatencyHistogram::record(uint32_t id, LatencyKind kind, uint64_t ticks) {
+	if (id >= max_histograms) {
+		return;
+	}
+
+	auto shard = current_shard;
+
+	if (shard == nullptr) {
+		shard = claim_shard();
+
+		if (shard == nullptr) {
+			return;
+		}
+	}
+
+	// Only this thread writes the counter, the atomic store just keeps concurrent readers tear-free
+	auto& counter = shard[(id * kind_count + static_cast<size_t>(kind)) * bucket_count + bucket_index(ticks)];
+	std::atomic_ref<uint32_t>(counter).store(counter + 1, std::memory_order_relaxed);
+}
+
+LatencySummary LatencyHistogram::summarize(uint32_t id, LatencyKind kind) {
+	LatencySummary summary = { 0, 0.0, 0.0, 0.0, 0.0 };
+
+	if (id >= max_histograms) {
+		return summary;
+	}
+
+	std::vector<uint64_t> merged(bucket_count);
+	const auto shards = std::min(next_shard.load(), max_shards);
+
+	for (size_t shard = 0; shard < shards; shard++) {
+		const auto histogram = counters + ((shard * max_histograms + id) * kind_count + static_cast<size_t>(kind)) * bucket_count;
+
+		for (size_t i = 0; i < bucket_count; i++) {
+			merged[i] += std::atomic_ref<uint32_t>(histogram[i]).load(std::memory_order_relaxed);
+		}
+	}
+
+	for (const auto count : merged) {
+		summary.count += count;
+	}
+
+	if (summary.count == 0) {
+		return summary;
+	}
+
+	const double nanoseconds_per_tick = 1e9 / SystemInfo::tsc_frequency();
+
+	const auto percentile = [&](double quantile) {
+		const auto rank = std::max<uint64_t>(1, static_cast<uint64_t>(quantile * summary.count + 0.5));
+		uint64_t seen = 0;
+
+		for (size_t i = 0; i < bucket_count; i++) {
+			seen += merged[i];
+
+			if (seen >= rank) {
+				return bucket_upper_bound(i) * nanoseconds_per_tick;
+			}
+		}
+
+		return bucket_upper_bound(bucket_count - 1) * nanoseconds_per_tick;
+	};
+
+	summary.p50 = percentile(0.5);
+	summary.p99 = percentile(0.99);
+	summary.p999 = percentile(0.999);
+	summary.max = percentile(1.0);
+
+	return summary;
+}
+
+uint32_t* LatencyHistogram::claim_shard() {
+	if (counters == nullptr) {
+		return nullptr;
+	}
+
+	// A single fetch_add while fresh shards are left
+	auto index = next_shard.fetch_add(1, std::memory_order_relaxed);
+	auto expected = false;
+
+	if (index >= max_shards || !shard_claimed[index].compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+		index = SIZE_MAX;
+	}
+
+	// Otherwise one an exited thread gave back, only among the handed out ones summarize already merges
+	const auto handed_out = std::min(next_shard.load(std::memory_order_relaxed), max_shards);
+
+	for (size_t i = 0; index == SIZE_MAX && i < handed_out; i++) {
+		expected = false;
+
+		if (shard_claimed[i].compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+			index = i;
+		}
+	}
+
+	if (index == SIZE_MAX) {
+		return nullptr;
+	}
+
+	current_shard = counters + index * max_histograms * kind_count * bucket_count;
+	lease.index = index;
+
+	return current_shard;
+}
+
+LatencyHistogram::ShardLease::~ShardLease() {
+	if (index == SIZE_MAX) {
+		return;
+	}
+
+	current_shard = nullptr;
+	shard_claimed[index].store(false, std::memory_order_release);
+}
+
+void LatencyHistogram::clear(uint32_t id) {
+	const auto shards = std::min(next_shard.load(), max_shards);
+
+	// Cleared on reuse rather than on release, a handler of the removed hook that is still running
+	// records into the old counters as long as possible
+	for (size_t shard = 0; shard < shards; shard++) {
+		const auto histogram = counters + (shard * max_histograms + id) * kind_count * bucket_count;
+
+		for (size_t i = 0; i < kind_count * bucket_count; i++) {
+			std::atomic_ref<uint32_t>(histogram[i]).store(0, std::memory_order_relaxed);
+		}
+	}
+}
+
+size_t LatencyHistogram::bucket_index(uint64_t ticks) {
+	ticks = std::min<uint64_t>(ticks, (1ULL << max_value_bits) - 1);
+
+	// The first two powers of two are exact
+	if (ticks < 2 * sub_bucket_count) {
+		return static_cast<size_t>(ticks);
+	}
+
+	unsigned long msb;
+	_BitScanReverse64(&msb, ticks);
+
+	const auto shift = msb - sub_bucket_bits;
+
+	return (shift + 1) * sub_bucket_count + static_cast<size_t>(ticks >> shift) - sub_bucket_count;
+}
+
+uint64_t LatencyHistogram::bucket_upper_bound(size_t index) {
+	if (index < 2 * sub_bucket_count) {
+		return index;
+	}
+
+	const auto shift = index / sub_bucket_count - 1;
+	const auto sub_bucket = index % sub_bucket_count + sub_bucket_count;
+
+	return ((sub_bucket + 1) << shift) - 1;
+}
\ No newline at end of file
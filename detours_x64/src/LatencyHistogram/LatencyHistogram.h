@@ -0,0 +1,106 @@
+#pragma once
+
+#include <intrin.h>
+#include <cstdint>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+enum class LatencyKind {
+	detour,		// The hook handler as a whole
+	original,	// The call through the trampoline
+	count
+};
+
+struct LatencySummary {
+	uint64_t count;
+
+	// Nanoseconds, each the upper bound of the bucket the percentile falls into
+	double p50;
+	double p99;
+	double p999;
+	double max;
+};
+
+class LatencyHistogram {
+private:
+	// 32 linear sub-buckets per power of two keep the error of a bucket below 1/32 of its value
+	static constexpr uint32_t sub_bucket_bits = 5;
+	static constexpr uint32_t sub_bucket_count = 1 << sub_bucket_bits;
+
+	// Durations are clamped to 2^36 ticks, about 20 seconds at 3 GHz
+	static constexpr uint32_t max_value_bits = 36;
+	static constexpr uint32_t bucket_count = (max_value_bits - sub_bucket_bits + 1) * sub_bucket_count;
+
+	static constexpr size_t kind_count = static_cast<size_t>(LatencyKind::count);
+
+	// [shard][histogram][kind][bucket], every thread writes to its own shard only
+	static uint32_t* counters;
+	static size_t max_histograms;
+	static size_t max_shards;
+
+	static std::atomic<size_t> next_histogram;
+	static std::atomic<size_t> next_shard;
+
+	// One flag per shard, set while a thread records into it. The counters of a released shard stay, its next owner
+	// adds to them and summarize keeps merging them.
+	static std::unique_ptr<std::atomic<bool>[]> shard_claimed;
+
+	// Ids of removed hooks, handed out again before new ones
+	static std::mutex free_mutex;
+	static std::vector<uint32_t> free_ids;
+
+	// Gives the thread's shard back when the thread exits, only touched on the claim path so record() keeps
+	// reading a plain pointer
+	struct ShardLease {
+		size_t index = SIZE_MAX;
+
+		~ShardLease();
+	};
+
+	static thread_local uint32_t* current_shard;
+	static thread_local ShardLease lease;
+
+public:
+	// Sets aside histogram_count * thread_count * 8 KiB, must run before the first histogram is allocated
+	static bool configure(size_t histogram_count, size_t thread_count);
+
+	// Next free histogram id, UINT32_MAX once all configured histograms are in use.
+	// A reused id starts from empty counters.
+	static uint32_t allocate();
+
+	// Gives `id` back for reuse, UINT32_MAX is ignored
+	static void release(uint32_t id);
+
+	// Wait-free once the thread has a shard. Dropped while more threads than the configured thread count record
+	// at the same time, shards of exited threads are reused.
+	static void record(uint32_t id, LatencyKind kind, uint64_t ticks);
+
+	// Merges all shards on the fly, writers keep going
+	static LatencySummary summarize(uint32_t id, LatencyKind kind);
+
+private:
+	static uint32_t* claim_shard();
+
+	static void clear(uint32_t id);
+
+	static size_t bucket_index(uint64_t ticks);
+
+	static uint64_t bucket_upper_bound(size_t index);
+};
+
+// Records the time between its construction and destruction, e.g. around a handler body or the original call
+class LatencyScope {
+private:
+	uint32_t id;
+	LatencyKind kind;
+	uint64_t begin;
+
+public:
+	LatencyScope(uint32_t id, LatencyKind kind) : id(id), kind(kind), begin(__rdtsc()) { }
+
+	~LatencyScope() {
+		LatencyHistogram::record(id, kind, __rdtsc() - begin);
+	}
+};
\ No newline at end of file
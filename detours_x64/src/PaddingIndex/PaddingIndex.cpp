@@ -0,0 +1,203 @@
+#include <algorithm>
+#include <cstring>
+
+#include "PaddingIndex.h"
+
+// Anything further away than a jmp rel8 can reach is of no use to the patcher
+static constexpr uint32_t max_padding_scan = 126;
+
+// Upper bound for functions without unwind info, those are leaf functions and usually tiny
+static constexpr size_t max_leaf_function_size = 0x1000;
+
+std::unordered_map<HMODULE, std::shared_ptr<const PaddingIndex>> PaddingIndex::module_indices;
+std::mutex PaddingIndex::index_mutex;
+
+FunctionPadding PaddingIndex::lookup(const void* function) {
+	HMODULE module = nullptr;
+
+	if (GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+		static_cast<LPCSTR>(function), &module)) {
+		const auto entry = for_module(module)->find(reinterpret_cast<uintptr_t>(function));
+
+		if (entry != nullptr) {
+			return *entry;
+		}
+	}
+
+	return analyze(function);
+}
+
+std::shared_ptr<const PaddingIndex> PaddingIndex::for_module(HMODULE module) {
+	const auto base = reinterpret_cast<uintptr_t>(module);
+	const auto dos_header = reinterpret_cast<PIMAGE_DOS_HEADER>(base);
+	const auto nt_headers = reinterpret_cast<PIMAGE_NT_HEADERS>(base + dos_header->e_lfanew);
+
+	std::lock_guard<std::mutex> lock(index_mutex);
+
+	auto& index = module_indices[module];
+
+	if (index == nullptr || index->time_date_stamp != nt_headers->FileHeader.TimeDateStamp
+		|| index->image_size != nt_headers->OptionalHeader.SizeOfImage) {
+		// Lookups that still hold the old index finish with it
+		const auto fresh = std::make_shared<PaddingIndex>();
+		fresh->build(module);
+
+		index = fresh;
+	}
+
+	return index;
+}
+
+const FunctionPadding* PaddingIndex::find(uintptr_t function) const {
+	const auto it = std::lower_bound(functions.begin(), functions.end(), function, [](const FunctionPadding& entry, uintptr_t address) {
+		return entry.function < address;
+	});
+
+	if (it == functions.end() || it->function != function) {
+		return nullptr;
+	}
+
+	return &*it;
+}
+
+void PaddingIndex::build(HMODULE module) {
+	const auto base = reinterpret_cast<uintptr_t>(module);
+	const auto dos_header = reinterpret_cast<PIMAGE_DOS_HEADER>(base);
+	const auto nt_headers = reinterpret_cast<PIMAGE_NT_HEADERS>(base + dos_header->e_lfanew);
+	const auto& directory = nt_headers->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXCEPTION];
+
+	time_date_stamp = nt_headers->FileHeader.TimeDateStamp;
+	image_size = nt_headers->OptionalHeader.SizeOfImage;
+
+	if (directory.VirtualAddress == 0 || directory.Size == 0) {
+		return;
+	}
+
+	const auto runtime_functions = reinterpret_cast<PRUNTIME_FUNCTION>(base + directory.VirtualAddress);
+	const size_t count = directory.Size / sizeof(RUNTIME_FUNCTION);
+
+	ZydisDecoder decoder;
+	ZydisDecoderInit(&decoder, ZYDIS_MACHINE_MODE_LONG_64, ZYDIS_STACK_WIDTH_64);
+
+	functions.reserve(count);
+
+	// .pdata is sorted by BeginAddress, neighbouring entries bound each other's padding
+	for (size_t i = 0; i < count; i++) {
+		const auto& runtime_function = runtime_functions[i];
+
+		const auto begin = base + runtime_function.BeginAddress;
+		const auto end = base + runtime_function.EndAddress;
+		const auto lower_bound = i > 0 ? base + runtime_functions[i - 1].EndAddress : begin - max_padding_scan;
+		const auto upper_bound = i + 1 < count ? base + runtime_functions[i + 1].BeginAddress : end + max_padding_scan;
+
+		FunctionPadding entry;
+		entry.function = begin;
+		entry.end = end;
+		entry.before = count_padding_before(begin, std::max(lower_bound, begin - max_padding_scan));
+		entry.after = count_padding_after(decoder, end, std::min(upper_bound, end + max_padding_scan));
+
+		functions.push_back(entry);
+	}
+}
+
+FunctionPadding PaddingIndex::analyze(const void* function) {
+	const auto begin = reinterpret_cast<uintptr_t>(function);
+
+	ZydisDecoder decoder;
+	ZydisDecoderInit(&decoder, ZYDIS_MACHINE_MODE_LONG_64, ZYDIS_STACK_WIDTH_64);
+
+	FunctionPadding entry;
+	std::memset(&entry, 0, sizeof(entry));
+	entry.function = begin;
+	entry.end = find_function_end(decoder, begin, begin + max_leaf_function_size);
+
+	// Outside of a .pdata table nothing guarantees that the bytes around the function are mapped
+	MEMORY_BASIC_INFORMATION mbi;
+	std::memset(&mbi, 0, sizeof(mbi));
+
+	if (VirtualQuery(reinterpret_cast<void*>(begin - max_padding_scan), &mbi, sizeof(mbi)) && (mbi.State & MEM_COMMIT)
+		&& !(mbi.Protect & (PAGE_NOACCESS | PAGE_GUARD))) {
+		entry.before = count_padding_before(begin, begin - max_padding_scan);
+	}
+
+	std::memset(&mbi, 0, sizeof(mbi));
+
+	if (VirtualQuery(reinterpret_cast<void*>(entry.end + max_padding_scan), &mbi, sizeof(mbi)) && (mbi.State & MEM_COMMIT)
+		&& !(mbi.Protect & (PAGE_NOACCESS | PAGE_GUARD))) {
+		entry.after = count_padding_after(decoder, entry.end, entry.end + max_padding_scan);
+	}
+
+	return entry;
+}
+
+uintptr_t PaddingIndex::find_function_end(const ZydisDecoder& decoder, uintptr_t function, uintptr_t limit) {
+	ZydisDecodedInstruction instruction;
+	ZydisDecodedOperand operands[ZYDIS_MAX_OPERAND_COUNT];
+
+	uintptr_t address = function;
+	uintptr_t furthest_target = function;
+
+	while (address < limit && ZYAN_SUCCESS(ZydisDecoderDecodeFull(&decoder, reinterpret_cast<const void*>(address), limit - address, &instruction, operands))) {
+		const auto next = address + instruction.length;
+
+		// Conditional branches keep the function alive past an early ret, calls and tail jumps leave it
+		const bool is_conditional_branch = instruction.attributes & ZYDIS_ATTRIB_IS_RELATIVE
+			&& operands[0].type == ZYDIS_OPERAND_TYPE_IMMEDIATE
+			&& instruction.mnemonic != ZYDIS_MNEMONIC_CALL
+			&& instruction.mnemonic != ZYDIS_MNEMONIC_JMP;
+
+		if (is_conditional_branch) {
+			ZyanU64 target = 0;
+
+			if (ZYAN_SUCCESS(ZydisCalcAbsoluteAddress(&instruction, &operands[0], address, &target)) && target < limit) {
+				furthest_target = std::max(furthest_target, static_cast<uintptr_t>(target));
+			}
+		}
+
+		const bool is_terminator = instruction.mnemonic == ZYDIS_MNEMONIC_RET
+			|| instruction.mnemonic == ZYDIS_MNEMONIC_JMP
+			|| instruction.mnemonic == ZYDIS_MNEMONIC_INT3;
+
+		if (is_terminator && next > furthest_target) {
+			return instruction.mnemonic == ZYDIS_MNEMONIC_INT3 ? address : next;
+		}
+
+		address = next;
+	}
+
+	return address;
+}
+
+uint32_t PaddingIndex::count_padding_before(uintptr_t address, uintptr_t lower_bound) {
+	const auto bytes = reinterpret_cast<const uint8_t*>(address);
+	uint32_t size = 0;
+
+	// Multi-byte nops cannot be decoded backwards, so only single-byte fillers count here
+	while (address - size > lower_bound && (bytes[-1 - (ptrdiff_t)size] == 0xCC || bytes[-1 - (ptrdiff_t)size] == 0x90)) {
+		size++;
+	}
+
+	return size;
+}
+
+uint32_t PaddingIndex::count_padding_after(const ZydisDecoder& decoder, uintptr_t address, uintptr_t upper_bound) {
+	ZydisDecodedInstruction instruction;
+	uintptr_t current = address;
+
+	while (current < upper_bound) {
+		if (*reinterpret_cast<const uint8_t*>(current) == 0xCC) {
+			current++;
+			continue;
+		}
+
+		// nop, xchg ax, ax and the 0F 1F /0 family used for alignment
+		if (ZYAN_FAILED(ZydisDecoderDecodeInstruction(&decoder, nullptr, reinterpret_cast<const void*>(current), upper_bound - current, &instruction))
+			|| instruction.mnemonic != ZYDIS_MNEMONIC_NOP) {
+			break;
+		}
+
+		current += instruction.length;
+	}
+
+	return static_cast<uint32_t>(current - address);
+}
\ No newline at end of file
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <Windows.h>
+#include <cstdint>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+
+#include "lib/Zydis/Zydis.h"
+
+struct FunctionPadding {
+	uintptr_t function;
+	uintptr_t end;
+
+	// Usable int3/nop bytes directly in front of the entry and directly behind the end
+	uint32_t before;
+	uint32_t after;
+};
+
+class PaddingIndex {
+private:
+	static std::unordered_map<HMODULE, std::shared_ptr<const PaddingIndex>> module_indices;
+
+	// Guards `module_indices`, published indices are immutable
+	static std::mutex index_mutex;
+
+	// Tells the image the index was built for from another one mapped at the same base after an unload
+	DWORD time_date_stamp = 0;
+	DWORD image_size = 0;
+
+	// Sorted by `function`
+	std::vector<FunctionPadding> functions;
+
+public:
+	// Uses the module's cached index if `function` starts a .pdata entry, analyzes it on the spot otherwise
+	static FunctionPadding lookup(const void* function);
+
+	// Rebuilt if a different image got loaded at `module` since the last call. Thread-safe.
+	static std::shared_ptr<const PaddingIndex> for_module(HMODULE module);
+
+	const FunctionPadding* find(uintptr_t function) const;
+
+private:
+	void build(HMODULE module);
+
+	static FunctionPadding analyze(const void* function);
+
+	static uintptr_t find_function_end(const ZydisDecoder& decoder, uintptr_t function, uintptr_t limit);
+
+	static uint32_t count_padding_before(uintptr_t address, uintptr_t lower_bound);
+
+	static uint32_t count_padding_after(const ZydisDecoder& decoder, uintptr_t address, uintptr_t upper_bound);
+};
\ No newline at end of file
@@ -0,0 +1,231 @@
+#include <cstdio>
+#include <algorithm>
+#include <iterator>
+
+#include "PageProtection.h"
+#include "SystemInfo/SystemInfo.h"
+
+std::mutex PageProtection::mutex;
+std::map<uintptr_t, PageProtection::PageState> PageProtection::pages;
+
+uint32_t PageProtection::batch_depth = 0;
+std::vector<uintptr_t> PageProtection::deferred_pages;
+
+std::atomic<uint64_t> PageProtection::protect_calls{ 0 };
+
+bool PageProtection::acquire(const void* address, size_t size) {
+	const uintptr_t page_size = SystemInfo::page_size();
+	const auto first_page = reinterpret_cast<uintptr_t>(address) & ~(page_size - 1);
+	const auto end_page = (reinterpret_cast<uintptr_t>(address) + size + page_size - 1) & ~(page_size - 1);
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (!query(first_page, end_page)) {
+		return false;
+	}
+
+	std::vector<uintptr_t> to_change;
+	std::vector<uintptr_t> range;
+
+	for (auto page = first_page; page < end_page; page += page_size) {
+		const auto& state = pages[page];
+
+		if (state.writers == 0 && !is_writable(state.protection)) {
+			to_change.push_back(page);
+		}
+
+		range.push_back(page);
+	}
+
+	if (!protect_runs(to_change, false)) {
+		std::printf("[error] failed to unprotect %p\n", address);
+
+		// Runs before the failing one went through already
+		std::erase_if(to_change, [](uintptr_t page) {
+			return !pages[page].is_changed;
+		});
+
+		restore(to_change);
+		forget_idle(range);
+		return false;
+	}
+
+	for (auto page = first_page; page < end_page; page += page_size) {
+		pages[page].writers++;
+	}
+
+	return true;
+}
+
+void PageProtection::release(const void* address, size_t size) {
+	const uintptr_t page_size = SystemInfo::page_size();
+	const auto first_page = reinterpret_cast<uintptr_t>(address) & ~(page_size - 1);
+	const auto end_page = (reinterpret_cast<uintptr_t>(address) + size + page_size - 1) & ~(page_size - 1);
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	std::vector<uintptr_t> released;
+
+	for (auto page = first_page; page < end_page; page += page_size) {
+		const auto it = pages.find(page);
+
+		if (it == pages.end() || it->second.writers == 0 || --it->second.writers != 0) {
+			continue;
+		}
+
+		if (batch_depth != 0) {
+			deferred_pages.push_back(page);
+		} else if (it->second.is_changed) {
+			released.push_back(page);
+		} else {
+			pages.erase(it);
+		}
+	}
+
+	restore(released);
+}
+
+void PageProtection::begin_batch() {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	batch_depth++;
+}
+
+void PageProtection::end_batch() {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (--batch_depth != 0) {
+		return;
+	}
+
+	std::vector<uintptr_t> released;
+	released.swap(deferred_pages);
+
+	std::sort(released.begin(), released.end());
+	released.erase(std::unique(released.begin(), released.end()), released.end());
+
+	// Pages that got a new writer after they were deferred are restored by its release
+	std::vector<uintptr_t> to_restore;
+
+	std::copy_if(released.begin(), released.end(), std::back_inserter(to_restore), [](uintptr_t page) {
+		const auto it = pages.find(page);
+
+		return it != pages.end() && it->second.writers == 0 && it->second.is_changed;
+	});
+
+	restore(to_restore);
+	forget_idle(released);
+}
+
+uint64_t PageProtection::get_protect_calls() {
+	return protect_calls.load(std::memory_order_relaxed);
+}
+
+bool PageProtection::query(uintptr_t first_page, uintptr_t end_page) {
+	auto page = first_page;
+
+	while (page < end_page) {
+		if (pages.contains(page)) {
+			page += SystemInfo::page_size();
+			continue;
+		}
+
+		MEMORY_BASIC_INFORMATION mbi;
+
+		if (VirtualQuery(reinterpret_cast<void*>(page), &mbi, sizeof(mbi)) == 0 || mbi.State != MEM_COMMIT) {
+			std::printf("[error] %p is not committed memory\n", (void*)page);
+			return false;
+		}
+
+		const auto region_end = std::min<uintptr_t>(end_page, reinterpret_cast<uintptr_t>(mbi.BaseAddress) + mbi.RegionSize);
+
+		for (; page < region_end; page += SystemInfo::page_size()) {
+			pages.insert(std::make_pair(page, PageState{ mbi.Protect, mbi.Protect, 0, false }));
+		}
+	}
+
+	return true;
+}
+
+bool PageProtection::protect_runs(const std::vector<uintptr_t>& sorted_pages, bool is_restoring) {
+	const uintptr_t page_size = SystemInfo::page_size();
+
+	const auto target_of = [=](const PageState& state) {
+		return is_restoring ? state.restore_protection : writable_protection(state.protection);
+	};
+
+	size_t first = 0;
+
+	while (first < sorted_pages.size()) {
+		const auto& first_state = pages[sorted_pages[first]];
+		size_t last = first + 1;
+
+		// A run is contiguous and goes from one protection to one other
+		while (last < sorted_pages.size() && sorted_pages[last] == sorted_pages[last - 1] + page_size
+			&& pages[sorted_pages[last]].protection == first_state.protection && target_of(pages[sorted_pages[last]]) == target_of(first_state)) {
+			last++;
+		}
+
+		DWORD old_protection;
+		protect_calls.fetch_add(1, std::memory_order_relaxed);
+
+		if (!VirtualProtect(reinterpret_cast<void*>(sorted_pages[first]), (last - first) * page_size, target_of(first_state), &old_protection)) {
+			return false;
+		}
+
+		for (size_t i = first; i < last; i++) {
+			auto& state = pages[sorted_pages[i]];
+
+			if (!is_restoring) {
+				state.restore_protection = old_protection;
+			}
+
+			state.protection = target_of(state);
+			state.is_changed = !is_restoring;
+		}
+
+		first = last;
+	}
+
+	return true;
+}
+
+void PageProtection::restore(const std::vector<uintptr_t>& sorted_pages) {
+	if (!protect_runs(sorted_pages, true)) {
+		std::printf("[error] failed to restore the protection of %p\n", (void*)sorted_pages.front());
+	}
+
+	// Pages whose restore failed stay changed and are tried again by the next release
+	forget_idle(sorted_pages);
+}
+
+void PageProtection::forget_idle(const std::vector<uintptr_t>& sorted_pages) {
+	if (batch_depth != 0) {
+		deferred_pages.insert(deferred_pages.end(), sorted_pages.begin(), sorted_pages.end());
+		return;
+	}
+
+	for (const auto page : sorted_pages) {
+		const auto it = pages.find(page);
+
+		if (it != pages.end() && it->second.writers == 0 && !it->second.is_changed) {
+			pages.erase(it);
+		}
+	}
+}
+
+bool PageProtection::is_writable(DWORD protection) {
+	const auto base = protection & 0xFF;
+
+	return base == PAGE_READWRITE || base == PAGE_WRITECOPY || base == PAGE_EXECUTE_READWRITE || base == PAGE_EXECUTE_WRITECOPY;
+}
+
+DWORD PageProtection::writable_protection(DWORD protection) {
+	const auto base = protection & 0xFF;
+
+	if (base == PAGE_EXECUTE || base == PAGE_EXECUTE_READ || base == PAGE_EXECUTE_READWRITE || base == PAGE_EXECUTE_WRITECOPY) {
+		return PAGE_EXECUTE_READWRITE;
+	}
+
+	return PAGE_READWRITE;
+}
\ No newline at end of file
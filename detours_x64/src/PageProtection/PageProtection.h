@@ -0,0 +1,85 @@
+#pragma once
+
+#include <Windows.h>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <map>
+#include <vector>
+
+// Tracks the protection of every page the library writes to. Pages that are writable already are left alone,
+// overlapping writers share one transition, and while a batch is open the way back is deferred so that several
+// patches on a page cost one change and one restore.
+class PageProtection {
+private:
+	struct PageState {
+		// Protection the page is at right now
+		DWORD protection;
+
+		// Protection to go back to, valid while `is_changed`
+		DWORD restore_protection;
+
+		uint32_t writers;
+		bool is_changed;
+	};
+
+	static std::mutex mutex;
+
+	// Only pages that are held, changed or touched by the open batch. Outside a batch a page is forgotten as soon
+	// as nobody holds it and its protection is back, memory may be freed and come back with another protection, so
+	// the next acquire queries it again. Inside one it is kept until the outermost batch ends, so later writes to
+	// the same page skip the VirtualQuery.
+	static std::map<uintptr_t, PageState> pages;
+
+	static uint32_t batch_depth;
+
+	// Pages released while a batch is open, restored or forgotten when it ends
+	static std::vector<uintptr_t> deferred_pages;
+
+	static std::atomic<uint64_t> protect_calls;
+
+public:
+	// Makes [address, address + size) writable, pages with execute access keep it. False if a page is not
+	// committed or cannot be unprotected, nothing is held then.
+	static bool acquire(const void* address, size_t size);
+
+	// Drops the writers `acquire` took, the last one restores the old protection unless a batch is open
+	static void release(const void* address, size_t size);
+
+	static void begin_batch();
+
+	// The outermost batch restores every page nobody holds anymore and forgets the idle ones
+	static void end_batch();
+
+	// VirtualProtect calls made so far
+	static uint64_t get_protect_calls();
+
+private:
+	// Fills in `pages` for [first_page, end_page) from VirtualQuery, one call per region
+	static bool query(uintptr_t first_page, uintptr_t end_page);
+
+	// Makes the pages writable or puts their old protection back, one VirtualProtect per run of adjacent pages
+	static bool protect_runs(const std::vector<uintptr_t>& sorted_pages, bool is_restoring);
+
+	static void restore(const std::vector<uintptr_t>& sorted_pages);
+
+	// Drops the pages nobody holds whose protection is the one they had at rest, or defers that to the end of
+	// the open batch
+	static void forget_idle(const std::vector<uintptr_t>& sorted_pages);
+
+	static bool is_writable(DWORD protection);
+
+	static DWORD writable_protection(DWORD protection);
+};
+
+// Holds a PageProtection batch open for its lifetime, e.g. around a whole install or removal
+class ProtectionBatch {
+public:
+	ProtectionBatch() {
+		PageProtection::begin_batch();
+	}
+
+	~ProtectionBatch() {
+		PageProtection::end_batch();
+	}
+};
\ No newline at end of file
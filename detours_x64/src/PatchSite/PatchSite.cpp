@@ -0,0 +1,165 @@
+#include <Windows.h>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <vector>
+
+#include "PatchSite.h"
+#include "PaddingIndex/PaddingIndex.h"
+#include "PatchWriter/PatchWriter.h"
+#include "HookIndex/HookIndex.h"
+#include "RetiredCode/RetiredCode.h"
+
+// jmp rel8 reaches [entry + 2 - 128, entry + 2 + 127]
+static constexpr uintptr_t max_short_hop_forward = 127;
+
+PatchPlan PatchSite::plan(const void* function, uintptr_t destination_begin, uintptr_t destination_end) {
+	const auto entry = reinterpret_cast<uintptr_t>(function);
+	const auto padding = PaddingIndex::lookup(function);
+
+	const auto is_reachable_from = [=](uintptr_t from, size_t instruction_size) {
+		return is_reachable_rel32(from, instruction_size, destination_begin)
+			&& is_reachable_rel32(from, instruction_size, destination_end);
+	};
+
+	// Neighbours share the padding between them, what another hook already wrote there is off limits. So is
+	// padding of a removed hook that is only put back once its grace period is over.
+	const auto is_unclaimed = [](uintptr_t address, size_t size) {
+		return !HookIndex::overlaps(address, address + size) && !RetiredCode::is_reserved(address, address + size);
+	};
+
+	// Padding behind the function is only usable if the hop itself does not reach into it
+	const bool can_hop_forward = padding.end >= entry + short_hop_size
+		&& padding.end - (entry + short_hop_size) <= max_short_hop_forward;
+
+	// 2 bytes at the entry, the long jump lives in the padding in front of or behind the function
+	if (padding.before >= near_jump_size && is_reachable_from(entry - near_jump_size, near_jump_size)
+		&& is_unclaimed(entry - near_jump_size, near_jump_size)) {
+		return { PatchEncoding::short_hop, short_hop_size, entry - near_jump_size, near_jump_size };
+	}
+
+	if (can_hop_forward && padding.after >= near_jump_size && is_reachable_from(padding.end, near_jump_size)
+		&& is_unclaimed(padding.end, near_jump_size)) {
+		return { PatchEncoding::short_hop, short_hop_size, padding.end, near_jump_size };
+	}
+
+	if (padding.before >= absolute_size && is_unclaimed(entry - absolute_size, absolute_size)) {
+		return { PatchEncoding::short_hop, short_hop_size, entry - absolute_size, absolute_size };
+	}
+
+	if (can_hop_forward && padding.after >= absolute_size && is_unclaimed(padding.end, absolute_size)) {
+		return { PatchEncoding::short_hop, short_hop_size, padding.end, absolute_size };
+	}
+
+	if (is_reachable_from(entry, near_jump_size)) {
+		return { PatchEncoding::near_jump, near_jump_size, 0, 0 };
+	}
+
+	// Qword-aligned slot in the padding so it can later be retargeted with a single store
+	const auto slot_before = (entry - sizeof(uintptr_t)) & ~(sizeof(uintptr_t) - 1);
+	const auto slot_after = (padding.end + sizeof(uintptr_t) - 1) & ~(sizeof(uintptr_t) - 1);
+
+	if (entry - slot_before <= padding.before && is_unclaimed(slot_before, sizeof(uintptr_t))) {
+		return { PatchEncoding::rip_indirect, rip_indirect_size, slot_before, sizeof(uintptr_t) };
+	}
+
+	// The stolen bytes stay inside the function as long as it is at least as long as the jump
+	if (padding.end - entry >= rip_indirect_size && slot_after + sizeof(uintptr_t) <= padding.end + padding.after
+		&& is_unclaimed(slot_after, sizeof(uintptr_t))) {
+		return { PatchEncoding::rip_indirect, rip_indirect_size, slot_after, sizeof(uintptr_t) };
+	}
+
+	return { PatchEncoding::absolute, absolute_size, 0, 0 };
+}
+
+bool PatchSite::write(const PatchPlan& plan, void* function, size_t stolen_size, const void* destination, bool flush_cache) {
+	// Anything shorter than the entry encoding would cut an instruction behind the stolen bytes in half
+	if (stolen_size < plan.entry_size) {
+		std::printf("[error] %zu stolen bytes at %p cannot hold a %zu byte entry\n", stolen_size, function, plan.entry_size);
+		return false;
+	}
+
+	const auto entry = reinterpret_cast<uintptr_t>(function);
+	const auto padding = reinterpret_cast<void*>(plan.padding_address);
+
+	uint8_t padding_bytes[absolute_size];
+	uint8_t saved_padding[absolute_size];
+	std::vector<uint8_t> entry_bytes(std::max(stolen_size, plan.entry_size), 0x90);
+
+	std::memcpy(saved_padding, padding, plan.padding_size);
+
+	switch (plan.encoding) {
+	case PatchEncoding::short_hop: {
+		if (plan.padding_size == near_jump_size) {
+			place_jump(padding_bytes, plan.padding_address, destination);
+		} else {
+			place_absolute_jump(padding_bytes, destination);
+		}
+
+		const auto disp = static_cast<int8_t>(plan.padding_address - (entry + short_hop_size));
+
+		entry_bytes[0] = 0xEB;
+		entry_bytes[1] = static_cast<uint8_t>(disp);
+		break;
+	}
+	case PatchEncoding::near_jump:
+		place_jump(entry_bytes.data(), entry, destination);
+		break;
+	case PatchEncoding::rip_indirect:
+		std::memcpy(padding_bytes, &destination, sizeof(destination));
+		place_rip_indirect(entry_bytes.data(), entry, padding);
+		break;
+	case PatchEncoding::absolute:
+		place_absolute_jump(entry_bytes.data(), destination);
+		break;
+	}
+
+	if (plan.padding_size != 0 && !PatchWriter::write(padding, padding_bytes, plan.padding_size)) {
+		return false;
+	}
+
+	// Other threads may be calling the function, they must never fetch a half-written jump
+	if (!PatchWriter::write_live(function, entry_bytes.data(), stolen_size)) {
+		// Nothing jumps into the padding yet, so it can simply be put back
+		if (plan.padding_size != 0) {
+			PatchWriter::write(padding, saved_padding, plan.padding_size);
+		}
+
+		return false;
+	}
+
+	if (flush_cache) {
+		FlushInstructionCache(GetCurrentProcess(), function, stolen_size);
+	}
+
+	return true;
+}
+
+bool PatchSite::is_reachable_rel32(uintptr_t from, size_t instruction_size, uintptr_t to) {
+	const auto disp = (long long)to - (long long)(from + instruction_size);
+
+	return disp >= INT32_MIN && disp <= INT32_MAX;
+}
+
+void PatchSite::place_jump(uint8_t* buffer, uintptr_t from, const void* to) {
+	buffer[0] = 0xE9;
+	*reinterpret_cast<uint32_t*>(buffer + 1) = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(to) - (from + near_jump_size));
+}
+
+void PatchSite::place_rip_indirect(uint8_t* buffer, uintptr_t from, const void* slot) {
+	uint8_t jump_qword[] = { 0xFF, 0x25, 0x00, 0x00, 0x00, 0x00 };
+	*reinterpret_cast<uint32_t*>(jump_qword + 2) = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(slot) - (from + sizeof(jump_qword)));
+
+	std::memcpy(buffer, jump_qword, sizeof(jump_qword));
+}
+
+void PatchSite::place_absolute_jump(uint8_t* buffer, const void* to) {
+	// FF25 00000000 0000A7B90C020000 - jmp 20CB9A70000
+	uint8_t far_jump[] = { 0xFF, 0x25,
+						   0x00, 0x00, 0x00, 0x00,
+						   0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+
+	*reinterpret_cast<uintptr_t*>(far_jump + 6) = reinterpret_cast<uintptr_t>(to);
+
+	std::memcpy(buffer, far_jump, sizeof(far_jump));
+}
\ No newline at end of file
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+enum class PatchEncoding {
+	short_hop,		// EB rel8 into padding around the function that holds the long jump
+	near_jump,		// E9 rel32
+	rip_indirect,	// FF25 disp32 through a qword slot in the padding
+	absolute		// FF25 00000000 followed by the qword target
+};
+
+struct PatchPlan {
+	PatchEncoding encoding;
+
+	// Bytes written at the function entry, the trampoline has to steal at least these
+	size_t entry_size;
+
+	// Bytes written outside the function, `padding_size` is 0 if the padding is not touched
+	uintptr_t padding_address;
+	size_t padding_size;
+};
+
+class PatchSite {
+public:
+	static constexpr size_t short_hop_size = 2;
+	static constexpr size_t near_jump_size = 5;
+	static constexpr size_t rip_indirect_size = 6;
+	static constexpr size_t absolute_size = 14;
+	static constexpr size_t max_instruction_size = 15;
+
+	// Whole instructions covering the entry end at most max_instruction_size - 1 bytes past it. The worst case is
+	// a short hop with an absolute jump in the padding, a rip_indirect entry with its qword slot comes second.
+	static constexpr size_t max_saved_size = short_hop_size - 1 + max_instruction_size + absolute_size;
+	static_assert(max_saved_size >= rip_indirect_size - 1 + max_instruction_size + sizeof(uint64_t));
+	static_assert(max_saved_size >= absolute_size - 1 + max_instruction_size);
+
+	// Picks the smallest entry encoding that can reach everything in [destination_begin, destination_end).
+	// Padding that HookIndex already gives to another hook, or that RetiredCode holds back, is never planned for.
+	static PatchPlan plan(const void* function, uintptr_t destination_begin, uintptr_t destination_end);
+
+	// Fills the padding first so the entry is only redirected once everything behind it is in place. Both go
+	// through PatchWriter, the entry with write_live. Batch writers pass `flush_cache = false` and flush the whole
+	// range once at the end.
+	static bool write(const PatchPlan& plan, void* function, size_t stolen_size, const void* destination, bool flush_cache = true);
+
+	static bool is_reachable_rel32(uintptr_t from, size_t instruction_size, uintptr_t to);
+
+private:
+	// Encode into `buffer` for an instruction that will sit at `from`
+	static void place_jump(uint8_t* buffer, uintptr_t from, const void* to);
+
+	static void place_rip_indirect(uint8_t* buffer, uintptr_t from, const void* slot);
+
+	static void place_absolute_jump(uint8_t* buffer, const void* to);
+};
\ No newline at end of file
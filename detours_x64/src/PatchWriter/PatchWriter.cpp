@@ -0,0 +1,126 @@
+#include <cstdio>
+#include <cstring>
+
+#include "PatchWriter.h"
+#include "PageProtection/PageProtection.h"
+
+std::atomic<PatchBackend> PatchWriter::backend{ PatchBackend::protect };
+std::atomic<uint64_t> PatchWriter::write_calls{ 0 };
+
+void PatchWriter::set_backend(PatchBackend backend) {
+	PatchWriter::backend.store(backend);
+}
+
+PatchBackend PatchWriter::get_backend() {
+	return backend.load();
+}
+
+bool PatchWriter::write(void* address, const void* bytes, size_t size) {
+	if (backend.load() == PatchBackend::protect) {
+		if (!PageProtection::acquire(address, size)) {
+			return false;
+		}
+
+		std::memcpy(address, bytes, size);
+		PageProtection::release(address, size);
+
+		return true;
+	}
+
+	// The system makes the page writable on its own for the copy, an image page becomes a private copy-on-write copy
+	// just like it does when it is reprotected
+	SIZE_T written = 0;
+	write_calls.fetch_add(1, std::memory_order_relaxed);
+
+	if (!WriteProcessMemory(GetCurrentProcess(), address, bytes, size, &written) || written != size) {
+		std::printf("[error] failed to write %zu bytes to %p: %lu\n", size, address, GetLastError());
+		return false;
+	}
+
+	return true;
+}
+
+bool PatchWriter::write_live(void* address, const void* bytes, size_t size) {
+	if (size < sizeof(uint16_t)) {
+		return write(address, bytes, size);
+	}
+
+	if (reinterpret_cast<uintptr_t>(address) % sizeof(uint64_t) == sizeof(uint64_t) - 1) {
+		std::printf("[error] the first two bytes at %p straddle a qword and cannot be swapped in one store\n", address);
+		return false;
+	}
+
+	const auto source = static_cast<const uint8_t*>(bytes);
+
+	uint16_t head;
+	std::memcpy(&head, source, sizeof(head));
+
+	// EB FE - jmp $
+	uint16_t previous;
+
+	if (!exchange_head(address, 0xFEEB, previous)) {
+		return false;
+	}
+
+	const bool is_written = size == sizeof(uint16_t) || write(static_cast<uint8_t*>(address) + sizeof(uint16_t), source + sizeof(uint16_t), size - sizeof(uint16_t));
+
+	// A failed tail leaves the old code behind the park, so the old head is what belongs in front of it
+	uint16_t parked;
+
+	if (!exchange_head(address, is_written ? head : previous, parked)) {
+		std::printf("[error] threads stay parked at %p\n", address);
+		return false;
+	}
+
+	return is_written;
+}
+
+bool PatchWriter::exchange_head(void* address, uint16_t value, uint16_t& previous) {
+	const auto qword = reinterpret_cast<uintptr_t>(address) & ~(sizeof(uint64_t) - 1);
+	const auto shift = (reinterpret_cast<uintptr_t>(address) - qword) * 8;
+	const auto mask = 0xFFFFull << shift;
+	const auto target = reinterpret_cast<volatile LONG64*>(qword);
+
+	uint64_t old_value = *target;
+	uint64_t new_value;
+
+	if (backend.load() == PatchBackend::protect) {
+		if (!PageProtection::acquire(reinterpret_cast<void*>(qword), sizeof(uint64_t))) {
+			return false;
+		}
+
+		for (;;) {
+			new_value = (old_value & ~mask) | (static_cast<uint64_t>(value) << shift);
+
+			const auto seen = static_cast<uint64_t>(InterlockedCompareExchange64(target, new_value, old_value));
+
+			if (seen == old_value) {
+				break;
+			}
+
+			old_value = seen;
+		}
+
+		PageProtection::release(reinterpret_cast<void*>(qword), sizeof(uint64_t));
+	} else {
+		// An aligned qword is copied with a single store, and the page is made writable by the system, not by us
+		new_value = (old_value & ~mask) | (static_cast<uint64_t>(value) << shift);
+
+		SIZE_T written = 0;
+		write_calls.fetch_add(1, std::memory_order_relaxed);
+
+		if (!WriteProcessMemory(GetCurrentProcess(), reinterpret_cast<void*>(qword), &new_value, sizeof(new_value), &written)
+			|| written != sizeof(new_value)) {
+			std::printf("[error] failed to write 8 bytes to %p: %lu\n", reinterpret_cast<void*>(qword), GetLastError());
+			return false;
+		}
+	}
+
+	previous = static_cast<uint16_t>(old_value >> shift);
+
+	return true;
+}
+
+uint64_t PatchWriter::get_write_calls() {
+	return write_calls.load(std::memory_order_relaxed);
+}
\ No newline at end of file
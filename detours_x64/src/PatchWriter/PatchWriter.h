@@ -0,0 +1,38 @@
+#pragma once
+
+#include <Windows.h>
+#include <cstdint>
+#include <atomic>
+
+enum class PatchBackend {
+	protect,				// PageProtection makes the pages writable, the bytes are plain stores
+	write_process_memory	// WriteProcessMemory on the own process, the library keeps no protection state
+};
+
+// Every write into existing code goes through here. Import and vtable slots do not, they have to be swapped with
+// one aligned store and stay on PageProtection.
+class PatchWriter {
+private:
+	static std::atomic<PatchBackend> backend;
+	static std::atomic<uint64_t> write_calls;
+
+public:
+	// Process-wide, switch it while no patch is being written
+	static void set_backend(PatchBackend backend);
+
+	static PatchBackend get_backend();
+
+	static bool write(void* address, const void* bytes, size_t size);
+
+	// For code other threads may be running: parks them on a jmp $ at `address` while the rest is written, then
+	// releases them with the first two bytes of `bytes`. Both swaps rewrite the aligned qword holding the two bytes
+	// through the selected backend, so an `address` whose two bytes straddle a qword is rejected.
+	static bool write_live(void* address, const void* bytes, size_t size);
+
+	// WriteProcessMemory calls made so far
+	static uint64_t get_write_calls();
+
+private:
+	// Replaces the two bytes at `address` with `value` in one store to their aligned qword, the old ones go to `previous`
+	static bool exchange_head(void* address, uint16_t value, uint16_t& previous);
+};
\ No newline at end of file
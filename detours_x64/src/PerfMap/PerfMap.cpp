@@ -0,0 +1,75 @@
+#include <cstdio>
+
+#include "PerfMap.h"
+
+std::unordered_map<const void*, std::vector<PerfMap::Entry>> PerfMap::entries;
+
+std::string PerfMap::pending_lines;
+bool PerfMap::needs_rewrite = false;
+
+void PerfMap::add(const void* owner, const void* start, size_t size, const std::string& name) {
+	if (size == 0) {
+		return;
+	}
+
+	Entry entry = { reinterpret_cast<uintptr_t>(start), size, name };
+
+	pending_lines += format(entry);
+	entries[owner].push_back(std::move(entry));
+}
+
+void PerfMap::remove(const void* owner) {
+	if (entries.erase(owner) != 0) {
+		needs_rewrite = true;
+	}
+}
+
+void PerfMap::flush() {
+	if (!needs_rewrite && pending_lines.empty()) {
+		return;
+	}
+
+	std::string contents;
+
+	if (needs_rewrite) {
+		for (const auto& [owner, owner_entries] : entries) {
+			for (const auto& entry : owner_entries) {
+				contents += format(entry);
+			}
+		}
+	} else {
+		contents = std::move(pending_lines);
+	}
+
+	const auto file = CreateFileA(path().c_str(), needs_rewrite ? GENERIC_WRITE : FILE_APPEND_DATA, FILE_SHARE_READ, nullptr,
+		needs_rewrite ? CREATE_ALWAYS : OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+	if (file == INVALID_HANDLE_VALUE) {
+		std::printf("[error] failed to open %s\n", path().c_str());
+		return;
+	}
+
+	DWORD written;
+	WriteFile(file, contents.data(), static_cast<DWORD>(contents.size()), &written, nullptr);
+	CloseHandle(file);
+
+	pending_lines.clear();
+	needs_rewrite = false;
+}
+
+std::string PerfMap::path() {
+	char directory[MAX_PATH + 1] = { 0 };
+	GetTempPathA(MAX_PATH + 1, directory);
+
+	char name[32];
+	std::snprintf(name, sizeof(name), "perf-%lu.map", GetCurrentProcessId());
+
+	return std::string(directory) + name;
+}
+
+std::string PerfMap::format(const Entry& entry) {
+	char prefix[48];
+	std::snprintf(prefix, sizeof(prefix), "%llx %zx ", static_cast<unsigned long long>(entry.start), entry.size);
+
+	return prefix + entry.name + "\n";
+}
\ No newline at end of file
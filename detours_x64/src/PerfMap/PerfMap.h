@@ -0,0 +1,39 @@
+#pragma once
+
+#include <Windows.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+// Writes %TEMP%\perf-<pid>.map, one "<start> <size> <name>" line per generated code range.
+// Profilers that read perf maps then attribute samples in trampolines and stubs to the hooked symbol.
+class PerfMap {
+private:
+	struct Entry {
+		uintptr_t start;
+		size_t size;
+		std::string name;
+	};
+
+	// Keyed by the hooked function the code was generated for
+	static std::unordered_map<const void*, std::vector<Entry>> entries;
+
+	static std::string pending_lines;
+	static bool needs_rewrite;
+
+public:
+	// Queues an entry, nothing is written before the next flush
+	static void add(const void* owner, const void* start, size_t size, const std::string& name);
+
+	// Retires every entry of `owner`, the next flush rewrites the map without them
+	static void remove(const void* owner);
+
+	// One write per call: appends the queued lines, or rewrites the whole map after removals
+	static void flush();
+
+	static std::string path();
+
+private:
+	static std::string format(const Entry& entry);
+};
\ No newline at end of file
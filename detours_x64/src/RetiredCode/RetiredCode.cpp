@@ -0,0 +1,211 @@
+#include <Windows.h>
+#include <TlHelp32.h>
+#include <intrin.h>
+#include <algorithm>
+#include <iterator>
+
+#include "RetiredCode.h"
+
+std::mutex RetiredCode::mutex;
+std::vector<RetiredCode::Retired> RetiredCode::retired;
+std::map<uintptr_t, uintptr_t> RetiredCode::reserved_ranges;
+uint64_t RetiredCode::last_check = 0;
+
+void RetiredCode::retire(std::vector<std::pair<uintptr_t, uintptr_t>> ranges, std::function<void()> release,
+	std::pair<uintptr_t, uintptr_t> reserved) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (reserved.first != reserved.second) {
+		reserved_ranges[reserved.first] = reserved.second;
+	}
+
+	retired.push_back({ GetTickCount64(), std::move(ranges), std::move(release), reserved });
+}
+
+bool RetiredCode::is_reserved(uintptr_t begin, uintptr_t end) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	const auto it = reserved_ranges.upper_bound(begin);
+
+	return (it != reserved_ranges.begin() && std::prev(it)->second > begin) || (it != reserved_ranges.end() && it->first < end);
+}
+
+void RetiredCode::collect() {
+	std::vector<Retired> due;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		const auto now = GetTickCount64();
+
+		if (now - last_check < grace_period_ms) {
+			return;
+		}
+
+		const auto first_young = std::find_if(retired.begin(), retired.end(), [=](const Retired& entry) {
+			return now - entry.retired_at < grace_period_ms;
+		});
+
+		if (first_young == retired.begin()) {
+			return;
+		}
+
+		due.assign(std::make_move_iterator(retired.begin()), std::make_move_iterator(first_young));
+		retired.erase(retired.begin(), first_young);
+		last_check = now;
+	}
+
+	std::vector<bool> is_idle(due.size(), true);
+	check_threads(due, is_idle);
+
+	std::vector<Retired> busy;
+	std::vector<uintptr_t> released_reservations;
+
+	for (size_t i = 0; i < due.size(); i++) {
+		if (is_idle[i]) {
+			due[i].release();
+
+			if (due[i].reserved.first != due[i].reserved.second) {
+				released_reservations.push_back(due[i].reserved.first);
+			}
+		} else {
+			busy.push_back(std::move(due[i]));
+		}
+	}
+
+	// Still due, the next collect looks at them again
+	std::lock_guard<std::mutex> lock(mutex);
+	retired.insert(retired.begin(), std::make_move_iterator(busy.begin()), std::make_move_iterator(busy.end()));
+
+	// The bytes are back, new hooks may claim them again
+	for (const auto begin : released_reservations) {
+		reserved_ranges.erase(begin);
+	}
+}
+
+size_t RetiredCode::get_pending() {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	return retired.size();
+}
+
+void RetiredCode::check_threads(const std::vector<Retired>& candidates, std::vector<bool>& is_idle) {
+	// Built before any thread is suspended
+	std::vector<Range> ranges;
+
+	for (size_t i = 0; i < candidates.size(); i++) {
+		for (const auto& [begin, end] : candidates[i].ranges) {
+			ranges.push_back({ begin, end, i });
+		}
+	}
+
+	std::sort(ranges.begin(), ranges.end(), [](const Range& left, const Range& right) {
+		return left.begin < right.begin;
+	});
+
+	std::vector<uintptr_t> reach(ranges.size());
+
+	for (size_t i = 0; i < ranges.size(); i++) {
+		reach[i] = i != 0 ? std::max(reach[i - 1], ranges[i].end) : ranges[i].end;
+	}
+
+	// The collecting thread may itself have been called from a trampoline, e.g. by a handler removing its own hook.
+	// Only the frames of its callers count, this one holds copies of the ranges.
+	const auto caller_frames = reinterpret_cast<uintptr_t>(_AddressOfReturnAddress());
+
+	if (!check_stack(caller_frames, ranges, reach, is_idle)) {
+		std::fill(is_idle.begin(), is_idle.end(), false);
+		return;
+	}
+
+	const auto snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+
+	if (snapshot == INVALID_HANDLE_VALUE) {
+		std::fill(is_idle.begin(), is_idle.end(), false);
+		return;
+	}
+
+	const auto process_id = GetCurrentProcessId();
+	const auto current_thread_id = GetCurrentThreadId();
+	std::vector<DWORD> thread_ids;
+
+	THREADENTRY32 entry;
+	entry.dwSize = sizeof(entry);
+
+	for (auto has_entry = Thread32First(snapshot, &entry); has_entry; has_entry = Thread32Next(snapshot, &entry)) {
+		if (entry.th32OwnerProcessID == process_id && entry.th32ThreadID != current_thread_id) {
+			thread_ids.push_back(entry.th32ThreadID);
+		}
+	}
+
+	CloseHandle(snapshot);
+
+	for (const auto thread_id : thread_ids) {
+		const auto thread = OpenThread(THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT, FALSE, thread_id);
+
+		// Gone since the snapshot
+		if (thread == nullptr) {
+			continue;
+		}
+
+		// Exiting, it runs no user code anymore
+		if (SuspendThread(thread) == static_cast<DWORD>(-1)) {
+			CloseHandle(thread);
+			continue;
+		}
+
+		CONTEXT context;
+		context.ContextFlags = CONTEXT_CONTROL;
+
+		// Nothing here may allocate while the thread is suspended, it could be holding the heap lock. The stack
+		// is read before the resume, a return address could otherwise be popped between the two checks.
+		bool is_inspected = GetThreadContext(thread, &context);
+
+		if (is_inspected) {
+			mark_busy(context.Rip, ranges, reach, is_idle);
+			is_inspected = check_stack(context.Rsp, ranges, reach, is_idle);
+		}
+
+		ResumeThread(thread);
+		CloseHandle(thread);
+
+		if (!is_inspected) {
+			std::fill(is_idle.begin(), is_idle.end(), false);
+			return;
+		}
+	}
+}
+
+bool RetiredCode::check_stack(uintptr_t stack_pointer, const std::vector<Range>& ranges, const std::vector<uintptr_t>& reach,
+	std::vector<bool>& is_idle) {
+	MEMORY_BASIC_INFORMATION mbi;
+
+	// The committed part of a stack is one region from the guard page up to its base
+	if (VirtualQuery(reinterpret_cast<void*>(stack_pointer), &mbi, sizeof(mbi)) == 0 || mbi.State != MEM_COMMIT) {
+		return false;
+	}
+
+	const auto stack_end = reinterpret_cast<uintptr_t>(mbi.BaseAddress) + mbi.RegionSize;
+
+	for (auto slot = stack_pointer & ~(sizeof(uintptr_t) - 1); slot < stack_end; slot += sizeof(uintptr_t)) {
+		mark_busy(*reinterpret_cast<const uintptr_t*>(slot), ranges, reach, is_idle);
+	}
+
+	return true;
+}
+
+void RetiredCode::mark_busy(uintptr_t address, const std::vector<Range>& ranges, const std::vector<uintptr_t>& reach,
+	std::vector<bool>& is_idle) {
+	// First range starting after `address`, everything before it that still reaches past `address` may hold it
+	auto i = static_cast<size_t>(std::upper_bound(ranges.begin(), ranges.end(), address, [](uintptr_t value, const Range& range) {
+		return value < range.begin;
+	}) - ranges.begin());
+
+	while (i != 0 && reach[i - 1] > address) {
+		i--;
+
+		if (address < ranges[i].end) {
+			is_idle[ranges[i].candidate] = false;
+		}
+	}
+}
\ No newline at end of file
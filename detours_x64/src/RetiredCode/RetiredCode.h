@@ -0,0 +1,77 @@
+#pragma once
+
+#include <Windows.h>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Code that is unhooked but may still be running: trampolines, coverage stubs and their unwind info. A release runs
+// once the grace period is over, no thread's instruction pointer lies in the retired ranges and no thread's stack
+// holds an address in them. That is checked by suspending the other threads one at a time.
+class RetiredCode {
+private:
+	// Covers threads that loaded a trampoline pointer right before the hook went away and have yet to call it
+	static constexpr uint64_t grace_period_ms = 100;
+
+	struct Retired {
+		uint64_t retired_at;
+
+		// [begin, end) of everything the release frees
+		std::vector<std::pair<uintptr_t, uintptr_t>> ranges;
+		std::function<void()> release;
+
+		// Bytes the release puts back, [0, 0) if none
+		std::pair<uintptr_t, uintptr_t> reserved;
+	};
+
+	static std::mutex mutex;
+
+	// Oldest first
+	static std::vector<Retired> retired;
+
+	// Reserved ranges of everything retired, begin to end. They never overlap, each was claimed by a single hook.
+	static std::map<uintptr_t, uintptr_t> reserved_ranges;
+
+	// One retired range with the candidate it belongs to, see check_threads
+	struct Range {
+		uintptr_t begin;
+		uintptr_t end;
+		size_t candidate;
+	};
+
+	// Threads are inspected at most once per grace period, everything due by then is checked in one go
+	static uint64_t last_check;
+
+public:
+	// `reserved` is code the release writes back, e.g. the padding of a short hop. It is off limits to new hooks
+	// until then, see is_reserved.
+	static void retire(std::vector<std::pair<uintptr_t, uintptr_t>> ranges, std::function<void()> release,
+		std::pair<uintptr_t, uintptr_t> reserved = { 0, 0 });
+
+	// Whether [begin, end) overlaps a reserved range whose release has not run yet
+	static bool is_reserved(uintptr_t begin, uintptr_t end);
+
+	// Runs the releases that are due, cheap while nothing has outlived the grace period
+	static void collect();
+
+	static size_t get_pending();
+
+private:
+	// Clears `is_idle[i]` if a thread of the process is inside `candidates[i]` or may return into it, or for all of
+	// them if a thread could not be inspected
+	static void check_threads(const std::vector<Retired>& candidates, std::vector<bool>& is_idle);
+
+	// Every qword between `stack_pointer` and the top of its stack counts as a possible return address. Unwinding
+	// could take locks the suspended thread holds, a false hit only delays the release to the next collect.
+	// False if the stack could not be queried.
+	static bool check_stack(uintptr_t stack_pointer, const std::vector<Range>& ranges, const std::vector<uintptr_t>& reach,
+		std::vector<bool>& is_idle);
+
+	// Clears `is_idle` for every range holding `address`. `ranges` is sorted by begin, `reach[i]` is the largest end of
+	// ranges[0..i], ranges may overlap since an arena holds the trampolines retired before it.
+	static void mark_busy(uintptr_t address, const std::vector<Range>& ranges, const std::vector<uintptr_t>& reach,
+		std::vector<bool>& is_idle);
+};
\ No newline at end of file
@@ -0,0 +1,383 @@
+#include <intrin.h>
+#include <immintrin.h>
+#include <cctype>
+#include <cstring>
+#include <cstdio>
+#include <limits>
+
+#include "SignatureScanner.h"
+
+std::unordered_map<std::string, std::vector<uint32_t>> SignatureScanner::cached_matches;
+std::mutex SignatureScanner::cache_mutex;
+
+// Bytes that show up everywhere in x64 code make for poor anchors
+static uint32_t byte_commonness(uint8_t value) {
+	switch (value) {
+	case 0x00: case 0xFF: case 0xCC: case 0x90:
+		return 4;
+	case 0x48: case 0x89: case 0x8B: case 0x4C: case 0x24:
+		return 3;
+	case 0xE8: case 0x0F: case 0x83: case 0x85: case 0xC0: case 0x44: case 0x8D:
+		return 2;
+	default:
+		return 0;
+	}
+}
+
+std::vector<std::vector<void*>> SignatureScanner::scan(HMODULE module, const std::vector<std::string>& patterns) {
+	const auto base = reinterpret_cast<uintptr_t>(module);
+	const auto id = build_id(module);
+
+	std::vector<std::vector<void*>> results(patterns.size());
+
+	// Only patterns this build has not seen yet take part in the scan
+	std::vector<Pattern> pending;
+	std::vector<size_t> pending_ids;
+
+	std::unique_lock<std::mutex> lock(cache_mutex);
+
+	for (size_t i = 0; i < patterns.size(); i++) {
+		if (cached_matches.contains(id + "|" + patterns[i])) {
+			continue;
+		}
+
+		Pattern pattern;
+
+		if (!parse(patterns[i], pattern)) {
+			std::printf("[error] invalid signature, expected hex bytes and ?? with two adjacent fixed bytes: %s\n", patterns[i].c_str());
+			cached_matches[id + "|" + patterns[i]] = { };
+			continue;
+		}
+
+		pending.push_back(pattern);
+		pending_ids.push_back(i);
+	}
+
+	// Two threads scanning for the same new pattern both store the same matches
+	lock.unlock();
+
+	std::vector<std::vector<uint32_t>> matches(pending.size());
+
+	if (!pending.empty()) {
+		const auto buckets = build_buckets(pending);
+
+		const auto dos_header = reinterpret_cast<PIMAGE_DOS_HEADER>(base);
+		const auto nt_headers = reinterpret_cast<PIMAGE_NT_HEADERS>(base + dos_header->e_lfanew);
+		auto section = IMAGE_FIRST_SECTION(nt_headers);
+
+		// One pass per executable section covers every pattern
+		for (int i = 0; i < nt_headers->FileHeader.NumberOfSections; i++, section++) {
+			if (!(section->Characteristics & IMAGE_SCN_MEM_EXECUTE)) {
+				continue;
+			}
+
+			const auto begin = reinterpret_cast<const uint8_t*>(base + section->VirtualAddress);
+			const auto end = begin + section->Misc.VirtualSize;
+
+			if (has_avx2()) {
+				scan_region_avx2(begin, end, pending, buckets, base, matches);
+			} else if (has_ssse3()) {
+				scan_region_ssse3(begin, end, pending, buckets, base, matches);
+			} else {
+				scan_region(begin, end, pending, buckets, base, matches);
+			}
+		}
+	}
+
+	lock.lock();
+
+	for (size_t i = 0; i < pending.size(); i++) {
+		cached_matches[id + "|" + patterns[pending_ids[i]]] = std::move(matches[i]);
+	}
+
+	for (size_t i = 0; i < patterns.size(); i++) {
+		for (const auto rva : cached_matches[id + "|" + patterns[i]]) {
+			results[i].push_back(reinterpret_cast<void*>(base + rva));
+		}
+	}
+
+	return results;
+}
+
+std::string SignatureScanner::build_id(HMODULE module) {
+	const auto base = reinterpret_cast<uintptr_t>(module);
+	const auto dos_header = reinterpret_cast<PIMAGE_DOS_HEADER>(base);
+	const auto nt_headers = reinterpret_cast<PIMAGE_NT_HEADERS>(base + dos_header->e_lfanew);
+	const auto& directory = nt_headers->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_DEBUG];
+
+	char buffer[64] = { 0 };
+
+	if (directory.VirtualAddress != 0) {
+		const auto debug_directory = reinterpret_cast<PIMAGE_DEBUG_DIRECTORY>(base + directory.VirtualAddress);
+		const size_t count = directory.Size / sizeof(IMAGE_DEBUG_DIRECTORY);
+
+		for (size_t i = 0; i < count; i++) {
+			// RSDS record: signature, 16 byte GUID, age, pdb path
+			const auto codeview = reinterpret_cast<const uint8_t*>(base + debug_directory[i].AddressOfRawData);
+
+			if (debug_directory[i].Type != IMAGE_DEBUG_TYPE_CODEVIEW || debug_directory[i].AddressOfRawData == 0
+				|| std::memcmp(codeview, "RSDS", 4) != 0) {
+				continue;
+			}
+
+			std::string id;
+
+			for (size_t j = 0; j < 20; j++) {
+				std::snprintf(buffer, sizeof(buffer), "%02x", codeview[4 + j]);
+				id += buffer;
+			}
+
+			return id;
+		}
+	}
+
+	std::snprintf(buffer, sizeof(buffer), "%08lx%08lx", (unsigned long)nt_headers->FileHeader.TimeDateStamp,
+		(unsigned long)nt_headers->OptionalHeader.SizeOfImage);
+
+	return buffer;
+}
+
+bool SignatureScanner::parse(const std::string& text, Pattern& pattern) {
+	size_t i = 0;
+
+	while (i < text.size()) {
+		if (text[i] == ' ') {
+			i++;
+			continue;
+		}
+
+		if (text[i] == '?') {
+			pattern.bytes.push_back(0);
+			pattern.mask.push_back(0);
+			i += (i + 1 < text.size() && text[i + 1] == '?') ? 2 : 1;
+			continue;
+		}
+
+		if (i + 1 >= text.size() || !std::isxdigit((unsigned char)text[i]) || !std::isxdigit((unsigned char)text[i + 1])) {
+			return false;
+		}
+
+		pattern.bytes.push_back(static_cast<uint8_t>(std::stoul(text.substr(i, 2), nullptr, 16)));
+		pattern.mask.push_back(0xFF);
+		i += 2;
+	}
+
+	// Anchor on the least common pair of adjacent fixed bytes
+	auto best_score = std::numeric_limits<uint32_t>::max();
+
+	for (size_t j = 0; j + 1 < pattern.bytes.size(); j++) {
+		if (!pattern.mask[j] || !pattern.mask[j + 1]) {
+			continue;
+		}
+
+		const auto score = byte_commonness(pattern.bytes[j]) + byte_commonness(pattern.bytes[j + 1]);
+
+		if (score < best_score) {
+			best_score = score;
+			pattern.anchor = j;
+			pattern.anchor_value = static_cast<uint16_t>(pattern.bytes[j] | (pattern.bytes[j + 1] << 8));
+		}
+	}
+
+	return best_score != std::numeric_limits<uint32_t>::max();
+}
+
+SignatureScanner::Buckets SignatureScanner::build_buckets(const std::vector<Pattern>& patterns) {
+	Buckets buckets;
+	std::memset(buckets.low_nibbles, 0, sizeof(buckets.low_nibbles));
+	std::memset(buckets.high_nibbles, 0, sizeof(buckets.high_nibbles));
+
+	for (size_t i = 0; i < patterns.size(); i++) {
+		const auto& pattern = patterns[i];
+
+		// Patterns with the same anchor share a bucket and with it their filter bits
+		const auto bucket = (pattern.anchor_value * 0x9E37u >> 8) & 7;
+		const uint8_t bit = 1 << bucket;
+
+		for (size_t j = 0; j < 2; j++) {
+			const auto value = pattern.bytes[pattern.anchor + j];
+
+			buckets.low_nibbles[j][value & 0x0F] |= bit;
+			buckets.high_nibbles[j][value >> 4] |= bit;
+		}
+
+		buckets.patterns[bucket].push_back(i);
+	}
+
+	return buckets;
+}
+
+void SignatureScanner::scan_region(const uint8_t* begin, const uint8_t* end, const std::vector<Pattern>& patterns, const Buckets& buckets,
+	uintptr_t base, std::vector<std::vector<uint32_t>>& matches) {
+	for (auto position = begin; position + 1 < end; position++) {
+		const auto first = position[0];
+		const auto second = position[1];
+
+		const uint8_t bucket_bits = buckets.low_nibbles[0][first & 0x0F] & buckets.high_nibbles[0][first >> 4]
+			& buckets.low_nibbles[1][second & 0x0F] & buckets.high_nibbles[1][second >> 4];
+
+		if (bucket_bits != 0) {
+			verify(position, bucket_bits, begin, end, patterns, buckets, base, matches);
+		}
+	}
+}
+
+void SignatureScanner::scan_region_avx2(const uint8_t* begin, const uint8_t* end, const std::vector<Pattern>& patterns, const Buckets& buckets,
+	uintptr_t base, std::vector<std::vector<uint32_t>>& matches) {
+	const auto nibble_mask = _mm256_set1_epi8(0x0F);
+	const auto zero = _mm256_setzero_si256();
+
+	// pshufb works per 128-bit lane, so both lanes get the same tables
+	const auto low_first = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(buckets.low_nibbles[0])));
+	const auto high_first = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(buckets.high_nibbles[0])));
+	const auto low_second = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(buckets.low_nibbles[1])));
+	const auto high_second = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(buckets.high_nibbles[1])));
+
+	auto position = begin;
+	alignas(32) uint8_t bucket_bits[32];
+
+	for (; position + 33 <= end; position += 32) {
+		const auto first = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(position));
+		const auto second = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(position + 1));
+
+		const auto first_bits = _mm256_and_si256(
+			_mm256_shuffle_epi8(low_first, _mm256_and_si256(first, nibble_mask)),
+			_mm256_shuffle_epi8(high_first, _mm256_and_si256(_mm256_srli_epi16(first, 4), nibble_mask)));
+
+		const auto second_bits = _mm256_and_si256(
+			_mm256_shuffle_epi8(low_second, _mm256_and_si256(second, nibble_mask)),
+			_mm256_shuffle_epi8(high_second, _mm256_and_si256(_mm256_srli_epi16(second, 4), nibble_mask)));
+
+		const auto candidates = _mm256_and_si256(first_bits, second_bits);
+		auto mask = ~static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(candidates, zero)));
+
+		if (mask == 0) {
+			continue;
+		}
+
+		_mm256_store_si256(reinterpret_cast<__m256i*>(bucket_bits), candidates);
+
+		while (mask != 0) {
+			unsigned long index;
+			_BitScanForward(&index, mask);
+			mask &= mask - 1;
+
+			verify(position + index, bucket_bits[index], begin, end, patterns, buckets, base, matches);
+		}
+	}
+
+	scan_region(position, end, patterns, buckets, base, matches);
+}
+
+void SignatureScanner::scan_region_ssse3(const uint8_t* begin, const uint8_t* end, const std::vector<Pattern>& patterns, const Buckets& buckets,
+	uintptr_t base, std::vector<std::vector<uint32_t>>& matches) {
+	const auto nibble_mask = _mm_set1_epi8(0x0F);
+	const auto zero = _mm_setzero_si128();
+
+	const auto low_first = _mm_load_si128(reinterpret_cast<const __m128i*>(buckets.low_nibbles[0]));
+	const auto high_first = _mm_load_si128(reinterpret_cast<const __m128i*>(buckets.high_nibbles[0]));
+	const auto low_second = _mm_load_si128(reinterpret_cast<const __m128i*>(buckets.low_nibbles[1]));
+	const auto high_second = _mm_load_si128(reinterpret_cast<const __m128i*>(buckets.high_nibbles[1]));
+
+	auto position = begin;
+	alignas(16) uint8_t bucket_bits[16];
+
+	for (; position + 17 <= end; position += 16) {
+		const auto first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(position));
+		const auto second = _mm_loadu_si128(reinterpret_cast<const __m128i*>(position + 1));
+
+		const auto first_bits = _mm_and_si128(
+			_mm_shuffle_epi8(low_first, _mm_and_si128(first, nibble_mask)),
+			_mm_shuffle_epi8(high_first, _mm_and_si128(_mm_srli_epi16(first, 4), nibble_mask)));
+
+		const auto second_bits = _mm_and_si128(
+			_mm_shuffle_epi8(low_second, _mm_and_si128(second, nibble_mask)),
+			_mm_shuffle_epi8(high_second, _mm_and_si128(_mm_srli_epi16(second, 4), nibble_mask)));
+
+		const auto candidates = _mm_and_si128(first_bits, second_bits);
+		auto mask = ~static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(candidates, zero))) & 0xFFFF;
+
+		if (mask == 0) {
+			continue;
+		}
+
+		_mm_store_si128(reinterpret_cast<__m128i*>(bucket_bits), candidates);
+
+		while (mask != 0) {
+			unsigned long index;
+			_BitScanForward(&index, mask);
+			mask &= mask - 1;
+
+			verify(position + index, bucket_bits[index], begin, end, patterns, buckets, base, matches);
+		}
+	}
+
+	scan_region(position, end, patterns, buckets, base, matches);
+}
+
+void SignatureScanner::verify(const uint8_t* position, uint8_t bucket_bits, const uint8_t* begin, const uint8_t* end,
+	const std::vector<Pattern>& patterns, const Buckets& buckets, uintptr_t base, std::vector<std::vector<uint32_t>>& matches) {
+	const auto anchor_value = static_cast<uint16_t>(position[0] | (position[1] << 8));
+
+	for (size_t bucket = 0; bucket < 8; bucket++) {
+		if (!(bucket_bits & (1 << bucket))) {
+			continue;
+		}
+
+		for (const auto id : buckets.patterns[bucket]) {
+			const auto& pattern = patterns[id];
+
+			// The nibble filter lets through mixes of different anchors, the exact pair settles it
+			if (pattern.anchor_value != anchor_value) {
+				continue;
+			}
+
+			const auto start = position - pattern.anchor;
+
+			if (start < begin || pattern.bytes.size() > (size_t)(end - start)) {
+				continue;
+			}
+
+			bool is_match = true;
+
+			for (size_t i = 0; i < pattern.bytes.size() && is_match; i++) {
+				is_match = (start[i] & pattern.mask[i]) == pattern.bytes[i];
+			}
+
+			if (is_match) {
+				matches[id].push_back(static_cast<uint32_t>(reinterpret_cast<uintptr_t>(start) - base));
+			}
+		}
+	}
+}
+
+bool SignatureScanner::has_avx2() {
+	static const bool supported = []() {
+		int info[4];
+		__cpuid(info, 1);
+
+		// OSXSAVE and AVX, then the OS has to save the YMM state
+		const bool has_avx = (info[2] & (1 << 27)) && (info[2] & (1 << 28));
+
+		if (!has_avx || (_xgetbv(0) & 0x6) != 0x6) {
+			return false;
+		}
+
+		__cpuidex(info, 7, 0);
+
+		return (info[1] & (1 << 5)) != 0;
+	}();
+
+	return supported;
+}
+
+bool SignatureScanner::has_ssse3() {
+	static const bool supported = []() {
+		int info[4];
+		__cpuid(info, 1);
+
+		return (info[2] & (1 << 9)) != 0;
+	}();
+
+	return supported;
+}
\ No newline at end of file
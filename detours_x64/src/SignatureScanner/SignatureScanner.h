@@ -0,0 +1,63 @@
+#pragma once
+
+#include <Windows.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+
+class SignatureScanner {
+private:
+	struct Pattern {
+		std::vector<uint8_t> bytes;
+		std::vector<uint8_t> mask;
+
+		// Offset of the two fixed bytes the SIMD filter looks for
+		size_t anchor;
+		uint16_t anchor_value;
+	};
+
+	// Nibble tables of the filter, bit `k` of an entry stands for bucket `k`
+	struct Buckets {
+		alignas(16) uint8_t low_nibbles[2][16];
+		alignas(16) uint8_t high_nibbles[2][16];
+
+		std::vector<size_t> patterns[8];
+	};
+
+	// Build id + pattern -> RVAs of the matches
+	static std::unordered_map<std::string, std::vector<uint32_t>> cached_matches;
+
+	// Guards `cached_matches`, the scan itself runs without it
+	static std::mutex cache_mutex;
+
+public:
+	// Scans every executable section of `module` once for all patterns ("48 8B ?? 24 E8").
+	// Returns one list of matches per pattern, in pattern order.
+	static std::vector<std::vector<void*>> scan(HMODULE module, const std::vector<std::string>& patterns);
+
+	// CodeView GUID and age if the image has them, time stamp and image size otherwise
+	static std::string build_id(HMODULE module);
+
+private:
+	static bool parse(const std::string& text, Pattern& pattern);
+
+	static Buckets build_buckets(const std::vector<Pattern>& patterns);
+
+	static void scan_region(const uint8_t* begin, const uint8_t* end, const std::vector<Pattern>& patterns, const Buckets& buckets,
+		uintptr_t base, std::vector<std::vector<uint32_t>>& matches);
+
+	static void scan_region_avx2(const uint8_t* begin, const uint8_t* end, const std::vector<Pattern>& patterns, const Buckets& buckets,
+		uintptr_t base, std::vector<std::vector<uint32_t>>& matches);
+
+	static void scan_region_ssse3(const uint8_t* begin, const uint8_t* end, const std::vector<Pattern>& patterns, const Buckets& buckets,
+		uintptr_t base, std::vector<std::vector<uint32_t>>& matches);
+
+	static void verify(const uint8_t* position, uint8_t bucket_bits, const uint8_t* begin, const uint8_t* end,
+		const std::vector<Pattern>& patterns, const Buckets& buckets, uintptr_t base, std::vector<std::vector<uint32_t>>& matches);
+
+	static bool has_avx2();
+
+	static bool has_ssse3();
+};
\ No newline at end of file
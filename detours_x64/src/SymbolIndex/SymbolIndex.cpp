@@ -0,0 +1,185 @@
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <algorithm>
+
+#include "SymbolIndex.h"
+
+std::unordered_map<HMODULE, std::shared_ptr<const SymbolIndex>> SymbolIndex::module_indices;
+std::recursive_mutex SymbolIndex::index_mutex;
+
+void* SymbolIndex::resolve(const std::string& qualified_name) {
+	const auto separator = qualified_name.find('!');
+
+	if (separator == std::string::npos || separator == 0 || separator + 1 == qualified_name.size()) {
+		std::printf("[error] expected module!symbol, got %s\n", qualified_name.c_str());
+		return nullptr;
+	}
+
+	const auto module_name = qualified_name.substr(0, separator);
+	const auto symbol_name = qualified_name.substr(separator + 1);
+
+	const auto module = GetModuleHandleA(module_name.c_str());
+
+	if (module == nullptr) {
+		std::printf("[error] module %s is not loaded\n", module_name.c_str());
+		return nullptr;
+	}
+
+	const auto index = for_module(module);
+
+	if (symbol_name[0] == '#') {
+		return index->find(static_cast<uint32_t>(std::strtoul(symbol_name.c_str() + 1, nullptr, 10)));
+	}
+
+	return index->find(symbol_name.c_str());
+}
+
+std::shared_ptr<const SymbolIndex> SymbolIndex::for_module(HMODULE module) {
+	const auto base = reinterpret_cast<uintptr_t>(module);
+	const auto dos_header = reinterpret_cast<PIMAGE_DOS_HEADER>(base);
+	const auto nt_headers = reinterpret_cast<PIMAGE_NT_HEADERS>(base + dos_header->e_lfanew);
+
+	std::lock_guard<std::recursive_mutex> lock(index_mutex);
+
+	auto& index = module_indices[module];
+
+	if (index == nullptr || index->time_date_stamp != nt_headers->FileHeader.TimeDateStamp
+		|| index->image_size != nt_headers->OptionalHeader.SizeOfImage) {
+		const auto fresh = std::make_shared<SymbolIndex>();
+		fresh->build(module);
+
+		index = fresh;
+	}
+
+	return index;
+}
+
+void* SymbolIndex::find(const char* name) const {
+	if (exports == nullptr) {
+		return nullptr;
+	}
+
+	// The export name pointer table is sorted lexically, the image is its own name index
+	size_t low = 0;
+	size_t high = exports->NumberOfNames;
+
+	while (low < high) {
+		const auto middle = low + (high - low) / 2;
+		const auto result = std::strcmp(name, reinterpret_cast<const char*>(base + names[middle]));
+
+		if (result == 0) {
+			return resolve_function(name_ordinals[middle]);
+		}
+
+		if (result < 0) {
+			high = middle;
+		} else {
+			low = middle + 1;
+		}
+	}
+
+	return nullptr;
+}
+
+void* SymbolIndex::find(uint32_t ordinal) const {
+	if (exports == nullptr || ordinal < exports->Base) {
+		return nullptr;
+	}
+
+	return resolve_function(ordinal - exports->Base);
+}
+
+std::string SymbolIndex::name_of(const void* address) {
+	char buffer[MAX_PATH + 32];
+	HMODULE module = nullptr;
+
+	if (!GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+		static_cast<LPCSTR>(address), &module)) {
+		std::snprintf(buffer, sizeof(buffer), "%p", address);
+		return buffer;
+	}
+
+	char module_path[MAX_PATH] = { 0 };
+	GetModuleFileNameA(module, module_path, MAX_PATH);
+
+	const auto separator = std::strrchr(module_path, '\\');
+	const auto module_name = separator != nullptr ? separator + 1 : module_path;
+
+	const auto index = for_module(module);
+	const auto rva = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(address) - index->base);
+
+	if (index->exports != nullptr) {
+		std::lock_guard<std::recursive_mutex> lock(index_mutex);
+
+		if (index->names_by_address.empty()) {
+			for (uint32_t i = 0; i < index->exports->NumberOfNames; i++) {
+				index->names_by_address.push_back(std::make_pair(index->functions[index->name_ordinals[i]], i));
+			}
+
+			std::sort(index->names_by_address.begin(), index->names_by_address.end());
+		}
+
+		const auto it = std::lower_bound(index->names_by_address.begin(), index->names_by_address.end(), std::make_pair(rva, 0u));
+
+		if (it != index->names_by_address.end() && it->first == rva) {
+			return std::string(module_name) + "!" + reinterpret_cast<const char*>(index->base + index->names[it->second]);
+		}
+	}
+
+	std::snprintf(buffer, sizeof(buffer), "%s+0x%x", module_name, rva);
+
+	return buffer;
+}
+
+void SymbolIndex::build(HMODULE module) {
+	base = reinterpret_cast<uintptr_t>(module);
+
+	const auto dos_header = reinterpret_cast<PIMAGE_DOS_HEADER>(base);
+	const auto nt_headers = reinterpret_cast<PIMAGE_NT_HEADERS>(base + dos_header->e_lfanew);
+
+	time_date_stamp = nt_headers->FileHeader.TimeDateStamp;
+	image_size = nt_headers->OptionalHeader.SizeOfImage;
+
+	const auto& directory = nt_headers->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT];
+
+	if (directory.VirtualAddress == 0 || directory.Size == 0) {
+		return;
+	}
+
+	exports_begin = base + directory.VirtualAddress;
+	exports_end = exports_begin + directory.Size;
+
+	exports = reinterpret_cast<const IMAGE_EXPORT_DIRECTORY*>(exports_begin);
+	names = reinterpret_cast<const DWORD*>(base + exports->AddressOfNames);
+	name_ordinals = reinterpret_cast<const WORD*>(base + exports->AddressOfNameOrdinals);
+	functions = reinterpret_cast<const DWORD*>(base + exports->AddressOfFunctions);
+}
+
+void* SymbolIndex::resolve_function(uint32_t index) const {
+	if (index >= exports->NumberOfFunctions || functions[index] == 0) {
+		return nullptr;
+	}
+
+	const auto address = base + functions[index];
+
+	// Addresses inside the export directory are "module.symbol" forwarder strings
+	if (address >= exports_begin && address < exports_end) {
+		return resolve_forwarder(reinterpret_cast<const char*>(address));
+	}
+
+	return reinterpret_cast<void*>(address);
+}
+
+void* SymbolIndex::resolve_forwarder(const char* forwarder) {
+	std::string qualified_name = forwarder;
+	const auto separator = qualified_name.rfind('.');
+
+	if (separator == std::string::npos) {
+		return nullptr;
+	}
+
+	qualified_name[separator] = '!';
+
+	return resolve(qualified_name);
+}
\ No newline at end of file
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <Windows.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+
+class SymbolIndex {
+private:
+	static std::unordered_map<HMODULE, std::shared_ptr<const SymbolIndex>> module_indices;
+
+	// Guards `module_indices` and the lazily built `names_by_address`. Recursive because forwarders resolve
+	// through another module's index.
+	static std::recursive_mutex index_mutex;
+
+	// Tells the image the index was built for from another one mapped at the same base after an unload
+	DWORD time_date_stamp = 0;
+	DWORD image_size = 0;
+
+	// Everything points into the mapped image, nothing is copied
+	uintptr_t base = 0;
+	uintptr_t exports_begin = 0;
+	uintptr_t exports_end = 0;
+
+	const IMAGE_EXPORT_DIRECTORY* exports = nullptr;
+	const DWORD* names = nullptr;
+	const WORD* name_ordinals = nullptr;
+	const DWORD* functions = nullptr;
+
+	// (function RVA, name index) sorted by RVA, built on the first reverse lookup under `index_mutex`
+	mutable std::vector<std::pair<uint32_t, uint32_t>> names_by_address;
+
+public:
+	// Resolves "module!symbol" or "module!#ordinal", returns nullptr if either part is unknown
+	static void* resolve(const std::string& qualified_name);
+
+	// Rebuilt if a different image got loaded at `module` since the last call. Thread-safe, a caller that still
+	// holds the old index finishes with it.
+	static std::shared_ptr<const SymbolIndex> for_module(HMODULE module);
+
+	void* find(const char* name) const;
+
+	void* find(uint32_t ordinal) const;
+
+	// "module!symbol" if an export starts at `address`, "module+0x<rva>" inside a module, the plain address otherwise
+	static std::string name_of(const void* address);
+
+private:
+	void build(HMODULE module);
+
+	void* resolve_function(uint32_t index) const;
+
+	static void* resolve_forwarder(const char* forwarder);
+};
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include <Windows.h>
+#include <intrin.h>
 #include <cstdint>
 #include <string>
 
@@ -48,6 +49,26 @@ std::wstring SystemInfo::last_error_string() {
 	return std::wstring(message_buffer);
 }
 
+uint64_t SystemInfo::tsc_frequency() {
+	if (m_tsc_frequency == 0) {
+		LARGE_INTEGER frequency, begin, end;
+		QueryPerformanceFrequency(&frequency);
+
+		QueryPerformanceCounter(&begin);
+		const auto tsc_begin = __rdtsc();
+
+		Sleep(10);
+
+		QueryPerformanceCounter(&end);
+		const auto tsc_end = __rdtsc();
+
+		const auto seconds = static_cast<double>(end.QuadPart - begin.QuadPart) / frequency.QuadPart;
+		m_tsc_frequency = static_cast<uint64_t>((tsc_end - tsc_begin) / seconds);
+	}
+
+	return m_tsc_frequency;
+}
 
 uint32_t SystemInfo::m_allocation_granularity = 0;
-uint32_t SystemInfo::m_page_size = 0;
\ No newline at end of file
+uint32_t SystemInfo::m_page_size = 0;
+uint64_t SystemInfo::m_tsc_frequency = 0;
\ No newline at end of file
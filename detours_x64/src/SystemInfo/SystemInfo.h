@@ -6,12 +6,16 @@ class SystemInfo {
 private:
 	static uint32_t m_allocation_granularity;
 	static uint32_t m_page_size;
+	static uint64_t m_tsc_frequency;
 
 public:
 	static uint32_t allocation_granularity();
 	static uint32_t page_size();
 	static std::wstring last_error_string();
 
+	// TSC ticks per second, measured against the performance counter on first use
+	static uint64_t tsc_frequency();
+
 private:
 	static void init();
 };
\ No newline at end of file
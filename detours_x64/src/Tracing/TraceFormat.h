@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+
+// On-disk layout of a trace: one TraceFileHeader followed by `record_count` TraceRecords.
+// Shared with the trace_reader tool, so it must not depend on anything else in the library.
+
+static constexpr uint32_t trace_magic = 0x52545444;	// "DTTR"
+static constexpr uint32_t trace_version = 1;
+
+static constexpr size_t trace_max_arguments = 5;
+
+struct TraceFileHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t reserved;
+
+	// TSC ticks per second measured when tracing started
+	uint64_t tsc_frequency;
+
+	uint64_t record_count;
+
+	// Records lost to full rings, a full file or threads beyond the ring pool
+	uint64_t dropped_count;
+};
+
+struct TraceRecord {
+	uint64_t tsc;
+	uint32_t hook_id;
+	uint32_t thread_id;
+	uint32_t argument_count;
+	uint32_t reserved;
+	uint64_t arguments[trace_max_arguments];
+};
+
+static_assert(sizeof(TraceRecord) == 64, "one record per cache line");
\ No newline at end of file
@@ -0,0 +1,232 @@
+#include <intrin.h>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+
+#include "Tracing.h"
+#include "SystemInfo/SystemInfo.h"
+
+thread_local Tracing::TraceRing* Tracing::current_ring = nullptr;
+thread_local Tracing::RingLease Tracing::lease;
+
+Tracing::TraceRing* Tracing::rings = nullptr;
+size_t Tracing::ring_count = 0;
+std::atomic<size_t> Tracing::next_ring = 0;
+std::atomic<uint64_t> Tracing::unassigned_dropped = 0;
+uint64_t Tracing::reported_dropped = 0;
+
+std::atomic<bool> Tracing::is_running = false;
+std::thread Tracing::consumer;
+
+HANDLE Tracing::file = INVALID_HANDLE_VALUE;
+HANDLE Tracing::mapping = nullptr;
+TraceFileHeader* Tracing::view = nullptr;
+size_t Tracing::file_capacity = 0;
+
+bool Tracing::start(const std::string& path, size_t capacity, size_t max_threads) {
+	if (is_running.load()) {
+		return false;
+	}
+
+	if (rings == nullptr) {
+		// VirtualAlloc hands out zeroed memory, which is exactly the empty state of a ring
+		rings = static_cast<TraceRing*>(VirtualAlloc(nullptr, max_threads * sizeof(TraceRing), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+
+		if (rings == nullptr) {
+			std::printf("[error] failed to allocate %zu trace rings\n", max_threads);
+			return false;
+		}
+
+		ring_count = max_threads;
+	}
+
+	const auto file_size = sizeof(TraceFileHeader) + capacity * sizeof(TraceRecord);
+
+	file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+	if (file == INVALID_HANDLE_VALUE) {
+		std::printf("[error] failed to create %s\n", path.c_str());
+		return false;
+	}
+
+	mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, static_cast<DWORD>(file_size >> 32), static_cast<DWORD>(file_size), nullptr);
+	view = mapping != nullptr ? static_cast<TraceFileHeader*>(MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, file_size)) : nullptr;
+
+	if (view == nullptr) {
+		std::printf("[error] failed to map %s\n", path.c_str());
+
+		if (mapping != nullptr) {
+			CloseHandle(mapping);
+		}
+
+		CloseHandle(file);
+		return false;
+	}
+
+	view->magic = trace_magic;
+	view->version = trace_version;
+	view->record_size = sizeof(TraceRecord);
+	view->tsc_frequency = SystemInfo::tsc_frequency();
+	view->record_count = 0;
+	view->dropped_count = 0;
+
+	file_capacity = capacity;
+
+	is_running.store(true);
+	consumer = std::thread(consume);
+
+	return true;
+}
+
+void Tracing::stop() {
+	if (!is_running.exchange(false)) {
+		return;
+	}
+
+	consumer.join();
+	drain();
+
+	const auto file_size = sizeof(TraceFileHeader) + view->record_count * sizeof(TraceRecord);
+
+	FlushViewOfFile(view, 0);
+	UnmapViewOfFile(view);
+	CloseHandle(mapping);
+
+	// The mapping reserved room for `file_capacity` records, only keep what was written
+	LARGE_INTEGER end;
+	end.QuadPart = static_cast<LONGLONG>(file_size);
+
+	SetFilePointerEx(file, end, nullptr, FILE_BEGIN);
+	SetEndOfFile(file);
+	CloseHandle(file);
+
+	view = nullptr;
+	mapping = nullptr;
+	file = INVALID_HANDLE_VALUE;
+}
+
+void Tracing::record(uint32_t hook_id, const uint64_t* arguments, uint32_t argument_count) {
+	auto ring = current_ring;
+
+	if (ring == nullptr) {
+		ring = claim_ring();
+
+		if (ring == nullptr) {
+			return;
+		}
+	}
+
+	const auto head = ring->head.load(std::memory_order_relaxed);
+
+	if (head - ring->tail.load(std::memory_order_acquire) == ring_capacity) {
+		ring->dropped.store(ring->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		return;
+	}
+
+	auto& record = ring->records[head & (ring_capacity - 1)];
+	record.tsc = __rdtsc();
+	record.hook_id = hook_id;
+	record.thread_id = ring->thread_id;
+	record.argument_count = std::min<uint32_t>(argument_count, trace_max_arguments);
+
+	for (uint32_t i = 0; i < record.argument_count; i++) {
+		record.arguments[i] = arguments[i];
+	}
+
+	ring->head.store(head + 1, std::memory_order_release);
+}
+
+Tracing::TraceRing* Tracing::claim_ring() {
+	if (rings == nullptr) {
+		return nullptr;
+	}
+
+	// A single fetch_add while fresh rings are left, so the first record of a thread stays wait-free
+	const auto index = next_ring.fetch_add(1, std::memory_order_relaxed);
+	TraceRing* ring = nullptr;
+	auto expected = false;
+
+	if (index < ring_count && rings[index].is_claimed.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+		ring = &rings[index];
+	}
+
+	// Otherwise look for a ring an exited thread gave back, only among the handed out ones the drain already walks
+	const auto handed_out = std::min(next_ring.load(std::memory_order_relaxed), ring_count);
+
+	for (size_t i = 0; ring == nullptr && i < handed_out; i++) {
+		expected = false;
+
+		if (rings[i].is_claimed.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+			ring = &rings[i];
+		}
+	}
+
+	if (ring == nullptr) {
+		unassigned_dropped.fetch_add(1, std::memory_order_relaxed);
+		return nullptr;
+	}
+
+	ring->thread_id = GetCurrentThreadId();
+
+	current_ring = ring;
+	lease.ring = ring;
+
+	return ring;
+}
+
+Tracing::RingLease::~RingLease() {
+	if (ring == nullptr) {
+		return;
+	}
+
+	// Records written so far are published by the release, the next owner carries on from the same head
+	current_ring = nullptr;
+	ring->is_claimed.store(false, std::memory_order_release);
+}
+
+void Tracing::consume() {
+	while (is_running.load(std::memory_order_relaxed)) {
+		if (drain() == 0) {
+			Sleep(1);
+		}
+	}
+}
+
+size_t Tracing::drain() {
+	const auto claimed = std::min(next_ring.load(std::memory_order_acquire), ring_count);
+	const auto records = reinterpret_cast<TraceRecord*>(view + 1);
+
+	size_t taken = 0;
+	uint64_t dropped = unassigned_dropped.load(std::memory_order_relaxed);
+
+	for (size_t i = 0; i < claimed; i++) {
+		auto& ring = rings[i];
+
+		const auto head = ring.head.load(std::memory_order_acquire);
+		auto tail = ring.tail.load(std::memory_order_relaxed);
+
+		while (tail != head) {
+			// Up to the end of the ring buffer in one copy, the wrapped part in the next iteration
+			const auto offset = tail & (ring_capacity - 1);
+			const auto count = std::min<uint64_t>(head - tail, ring_capacity - offset);
+			const auto space = file_capacity - view->record_count;
+			const auto copied = std::min<uint64_t>(count, space);
+
+			std::memcpy(&records[view->record_count], &ring.records[offset], copied * sizeof(TraceRecord));
+
+			view->record_count += copied;
+			view->dropped_count += count - copied;
+			tail += count;
+			taken += count;
+		}
+
+		ring.tail.store(tail, std::memory_order_release);
+		dropped += ring.dropped.load(std::memory_order_relaxed);
+	}
+
+	// Ring-side drops are running totals, file-side drops were added above
+	view->dropped_count += dropped - reported_dropped;
+	reported_dropped = dropped;
+
+	return taken;
+}
\ No newline at end of file
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <Windows.h>
+#include <cstdint>
+#include <string>
+#include <atomic>
+#include <thread>
+
+#include "TraceFormat.h"
+
+class Tracing {
+private:
+	// Records per thread, must be a power of two
+	static constexpr size_t ring_capacity = 4096;
+
+	// Single producer (the owning thread), single consumer (the drain thread)
+	struct TraceRing {
+		alignas(64) std::atomic<uint64_t> head;
+		alignas(64) std::atomic<uint64_t> tail;
+
+		// Written by the producer only
+		alignas(64) std::atomic<uint64_t> dropped;
+		uint32_t thread_id;
+
+		// Held by the owning thread until it exits, a released ring keeps its pending records for the drain
+		std::atomic<bool> is_claimed;
+
+		TraceRecord records[ring_capacity];
+	};
+
+	// Gives the thread's ring back when the thread exits, only touched on the claim path so
+	// record() keeps reading a plain pointer
+	struct RingLease {
+		TraceRing* ring = nullptr;
+
+		~RingLease();
+	};
+
+	static thread_local TraceRing* current_ring;
+	static thread_local RingLease lease;
+
+	// Allocated once on the first start and kept for the life of the process, producers never see them go away
+	static TraceRing* rings;
+	static size_t ring_count;
+	static std::atomic<size_t> next_ring;
+	static std::atomic<uint64_t> unassigned_dropped;
+
+	// Drop total already added to the file header, only the drain thread touches it
+	static uint64_t reported_dropped;
+
+	static std::atomic<bool> is_running;
+	static std::thread consumer;
+
+	static HANDLE file;
+	static HANDLE mapping;
+	static TraceFileHeader* view;
+	static size_t file_capacity;
+
+public:
+	// Maps `path` with room for `capacity` records and starts draining into it.
+	// `max_threads` rings are set aside on the first start, rings of exited threads are reused and
+	// threads beyond that only add to the drop count.
+	static bool start(const std::string& path, size_t capacity, size_t max_threads = 256);
+
+	// Drains what is left, finalizes the header and cuts the file to the records written
+	static void stop();
+
+	// Wait-free and allocation-free, meant to be called from hook handlers.
+	// The record is dropped if the calling thread's ring is full.
+	static void record(uint32_t hook_id, const uint64_t* arguments = nullptr, uint32_t argument_count = 0);
+
+private:
+	static TraceRing* claim_ring();
+
+	static void consume();
+
+	// Copies every ring's pending records into the file, returns the number of records taken
+	static size_t drain();
+};
\ No newline at end of file
@@ -6,14 +6,24 @@ AnnotatedInstruction::AnnotatedInstruction(uintptr_t instruction_address, const
 	this->absolute_address = 0;
 	this->relative_operand_id = 0;
 
+	// Hidden operands are kept as well, rewrites must not clobber implicitly used registers
+	for (int i = 0; i < instruction.operand_count; i++) {
+		this->operands[i] = operands[i];
+	}
+
 	for (int i = 0; i < instruction.operand_count_visible; i++) {
 		const auto operand = operands[i];
 
-		this->operands[i] = operand;
+		// Branch targets are relative immediates, data references are RIP-relative memory operands
+		const bool is_relative_immediate = operand.type == ZYDIS_OPERAND_TYPE_IMMEDIATE && operand.imm.is_relative;
+		const bool is_relative_memory = operand.type == ZYDIS_OPERAND_TYPE_MEMORY && operand.mem.base == ZYDIS_REGISTER_RIP;
+
+		if (is_relative_immediate || is_relative_memory) {
+			ZyanU64 result_address = 0;
+			ZydisCalcAbsoluteAddress(&instruction, &operand, instruction_address, &result_address);
 
-		if (operand.type == ZYDIS_OPERAND_TYPE_MEMORY) {
 			this->relative_operand_id = operand.id;
-			this->absolute_address = (instruction_address + instruction.length) + operand.mem.disp.value;
+			this->absolute_address = static_cast<uintptr_t>(result_address);
 		}
 	}
 }
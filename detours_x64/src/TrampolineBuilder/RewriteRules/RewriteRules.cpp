@@ -0,0 +1,315 @@
+#include "RewriteRules.h"
+
+#include <cstdlib>
+
+const std::vector<RewriteRules::Rule> RewriteRules::rules = {
+	// Target still reachable with a 32-bit displacement, nothing to spill
+	{ "reencode", ZYDIS_MNEMONIC_INVALID, OperandShape::any, &RewriteRules::rewrite_reencode, false },
+
+	// lea reg, [rip+x] -> mov reg, imm
+	{ "lea", ZYDIS_MNEMONIC_LEA, OperandShape::reg_mem, &RewriteRules::rewrite_lea, false },
+
+	// mov reg, [rip+x] -> mov reg64, imm64; mov reg, [reg64]
+	{ "mov-load", ZYDIS_MNEMONIC_MOV, OperandShape::reg_mem, &RewriteRules::rewrite_load_through_destination, false },
+	{ "movzx-load", ZYDIS_MNEMONIC_MOVZX, OperandShape::reg_mem, &RewriteRules::rewrite_load_through_destination, false },
+	{ "movsx-load", ZYDIS_MNEMONIC_MOVSX, OperandShape::reg_mem, &RewriteRules::rewrite_load_through_destination, false },
+	{ "movsxd-load", ZYDIS_MNEMONIC_MOVSXD, OperandShape::reg_mem, &RewriteRules::rewrite_load_through_destination, false },
+
+	// Stores, compares and vector accesses go through a spilled scratch base register
+	{ "mov-store", ZYDIS_MNEMONIC_MOV, OperandShape::mem_reg, &RewriteRules::rewrite_scratch_base, true },
+	{ "mov-store-imm", ZYDIS_MNEMONIC_MOV, OperandShape::mem_imm, &RewriteRules::rewrite_scratch_base, true },
+	{ "cmp-imm", ZYDIS_MNEMONIC_CMP, OperandShape::mem_imm, &RewriteRules::rewrite_scratch_base, true },
+	{ "test-imm", ZYDIS_MNEMONIC_TEST, OperandShape::mem_imm, &RewriteRules::rewrite_scratch_base, true },
+	{ "vector-load", ZYDIS_MNEMONIC_INVALID, OperandShape::vector_mem, &RewriteRules::rewrite_scratch_base, true },
+	{ "vector-store", ZYDIS_MNEMONIC_INVALID, OperandShape::mem_vector, &RewriteRules::rewrite_scratch_base, true },
+
+	// Stack and control flow through memory cannot spill with a plain push/pop pair
+	{ "push-mem", ZYDIS_MNEMONIC_PUSH, OperandShape::mem_only, &RewriteRules::rewrite_push_memory, true },
+	{ "jmp-mem", ZYDIS_MNEMONIC_JMP, OperandShape::mem_only, &RewriteRules::rewrite_jump_memory, true },
+	{ "call-mem", ZYDIS_MNEMONIC_CALL, OperandShape::mem_only, &RewriteRules::rewrite_call_memory, true },
+
+	// Everything else
+	{ "scratch-base", ZYDIS_MNEMONIC_INVALID, OperandShape::any, &RewriteRules::rewrite_scratch_base, true },
+};
+
+const RewriteRules::Rule* RewriteRules::rewrite(const AnnotatedInstruction& instruction, uintptr_t runtime_address, std::vector<uint8_t>& bytes) {
+	const auto mnemonic = instruction.get_raw().mnemonic;
+	const auto shape = classify(instruction);
+
+	for (const auto& rule : rules) {
+		if (rule.mnemonic != ZYDIS_MNEMONIC_INVALID && rule.mnemonic != mnemonic) {
+			continue;
+		}
+
+		if (rule.shape != OperandShape::any && rule.shape != shape) {
+			continue;
+		}
+
+		bytes.clear();
+
+		if ((this->*rule.rewrite)(instruction, runtime_address, bytes)) {
+			return &rule;
+		}
+	}
+
+	bytes.clear();
+
+	return nullptr;
+}
+
+OperandShape RewriteRules::classify(const AnnotatedInstruction& instruction) {
+	const auto& raw_instruction = instruction.get_raw();
+	const ZydisDecodedOperand* operands = instruction.get_operands();
+	const size_t memory_op_id = instruction.get_relative_operand_id();
+
+	if (operands[memory_op_id].type != ZYDIS_OPERAND_TYPE_MEMORY) {
+		return OperandShape::other;
+	}
+
+	if (raw_instruction.operand_count_visible == 1) {
+		return OperandShape::mem_only;
+	}
+
+	bool has_gpr = false;
+	bool has_vector = false;
+	bool has_immediate = false;
+
+	for (int i = 0; i < raw_instruction.operand_count_visible; i++) {
+		if (i == memory_op_id) {
+			continue;
+		}
+
+		const auto& operand = operands[i];
+
+		if (operand.type == ZYDIS_OPERAND_TYPE_IMMEDIATE) {
+			has_immediate = true;
+		} else if (operand.type == ZYDIS_OPERAND_TYPE_REGISTER) {
+			switch (ZydisRegisterGetClass(operand.reg.value)) {
+			case ZYDIS_REGCLASS_GPR8:
+			case ZYDIS_REGCLASS_GPR16:
+			case ZYDIS_REGCLASS_GPR32:
+			case ZYDIS_REGCLASS_GPR64:
+				has_gpr = true;
+				break;
+			case ZYDIS_REGCLASS_XMM:
+			case ZYDIS_REGCLASS_YMM:
+			case ZYDIS_REGCLASS_ZMM:
+				has_vector = true;
+				break;
+			default:
+				return OperandShape::other;
+			}
+		}
+	}
+
+	if (has_vector && !has_gpr) {
+		return memory_op_id == 0 ? OperandShape::mem_vector : OperandShape::vector_mem;
+	}
+
+	if (raw_instruction.operand_count_visible == 2) {
+		if (has_immediate) {
+			return OperandShape::mem_imm;
+		}
+
+		if (has_gpr) {
+			return memory_op_id == 0 ? OperandShape::mem_reg : OperandShape::reg_mem;
+		}
+	}
+
+	return OperandShape::other;
+}
+
+bool RewriteRules::rewrite_reencode(const AnnotatedInstruction& instruction, uintptr_t runtime_address, std::vector<uint8_t>& bytes) {
+	const auto target = instruction.get_absolute_address();
+	const auto distance = (long long)target - (long long)runtime_address;
+
+	// Leave headroom for the instruction length, the displacement is relative to its end
+	if (std::abs(distance) >= (1LL << 31) - ZYDIS_MAX_INSTRUCTION_LENGTH) {
+		return false;
+	}
+
+	const auto& raw_instruction = instruction.get_raw();
+	const size_t memory_op_id = instruction.get_relative_operand_id();
+
+	ZydisEncoderRequest req;
+	ZydisEncoderDecodedInstructionToEncoderRequest(&raw_instruction, instruction.get_operands(), raw_instruction.operand_count_visible, &req);
+	req.operands[memory_op_id].mem.displacement = target;
+
+	size_t size = 0;
+	return append(bytes, zydis_utils.encode_absolute(req, runtime_address, size));
+}
+
+bool RewriteRules::rewrite_lea(const AnnotatedInstruction& instruction, uintptr_t runtime_address, std::vector<uint8_t>& bytes) {
+	const auto destination = instruction.get_operands()[0].reg.value;
+	const auto width = ZydisRegisterGetWidth(ZYDIS_MACHINE_MODE_LONG_64, destination);
+
+	// LEA truncates the effective address to the destination width
+	uint64_t address = instruction.get_absolute_address();
+
+	if (width == 32) {
+		address = static_cast<uint32_t>(address);
+	} else if (width == 16) {
+		address = static_cast<uint16_t>(address);
+	}
+
+	size_t size = 0;
+	return append(bytes, zydis_utils.encode_mov_reg_imm(destination, address, size));
+}
+
+bool RewriteRules::rewrite_load_through_destination(const AnnotatedInstruction& instruction, uintptr_t runtime_address, std::vector<uint8_t>& bytes) {
+	const auto& raw_instruction = instruction.get_raw();
+	const ZydisDecodedOperand* operands = instruction.get_operands();
+	const auto destination = operands[0].reg.value;
+
+	// 8 and 16-bit writes keep the upper bits, which would still hold the address
+	if (ZydisRegisterGetWidth(ZYDIS_MACHINE_MODE_LONG_64, destination) < 32) {
+		return false;
+	}
+
+	const auto base = ZydisRegisterGetLargestEnclosing(ZYDIS_MACHINE_MODE_LONG_64, destination);
+
+	ZydisEncoderRequest req;
+	ZydisEncoderDecodedInstructionToEncoderRequest(&raw_instruction, operands, raw_instruction.operand_count_visible, &req);
+	req.operands[1].mem.base = base;
+	req.operands[1].mem.displacement = 0;
+
+	size_t size = 0;
+	return append(bytes, zydis_utils.encode_mov_reg_imm(base, instruction.get_absolute_address(), size))
+		&& append(bytes, zydis_utils.encode(req, size));
+}
+
+bool RewriteRules::rewrite_scratch_base(const AnnotatedInstruction& instruction, uintptr_t runtime_address, std::vector<uint8_t>& bytes) {
+	const auto& raw_instruction = instruction.get_raw();
+	const ZydisDecodedOperand* operands = instruction.get_operands();
+
+	// The spill moves RSP, so anything that reads or writes the stack pointer would see the wrong value
+	if (uses_stack_pointer(raw_instruction, operands)) {
+		return false;
+	}
+
+	const auto scratch = find_scratch_register(raw_instruction, operands);
+
+	if (scratch == ZYDIS_REGISTER_NONE) {
+		return false;
+	}
+
+	ZydisEncoderRequest req;
+	ZydisEncoderDecodedInstructionToEncoderRequest(&raw_instruction, operands, raw_instruction.operand_count_visible, &req);
+	req.operands[instruction.get_relative_operand_id()].mem.base = scratch;
+	req.operands[instruction.get_relative_operand_id()].mem.displacement = 0;
+
+	size_t size = 0;
+	return append(bytes, zydis_utils.encode_push_reg(scratch, size))
+		&& append(bytes, zydis_utils.encode_mov_reg_imm(scratch, instruction.get_absolute_address(), size))
+		&& append(bytes, zydis_utils.encode(req, size))
+		&& append(bytes, zydis_utils.encode_pop_reg(scratch, size));
+}
+
+bool RewriteRules::rewrite_push_memory(const AnnotatedInstruction& instruction, uintptr_t runtime_address, std::vector<uint8_t>& bytes) {
+	// push rax; push rax; mov rax, imm64; mov rax, [rax]; mov [rsp+8], rax; pop rax
+	// The second push reserves the slot, the first one leaves the loaded value on top
+	size_t size = 0;
+	return append(bytes, zydis_utils.encode_push_reg(ZYDIS_REGISTER_RAX, size))
+		&& append(bytes, zydis_utils.encode_push_reg(ZYDIS_REGISTER_RAX, size))
+		&& append(bytes, zydis_utils.encode_mov_reg_imm(ZYDIS_REGISTER_RAX, instruction.get_absolute_address(), size))
+		&& append(bytes, zydis_utils.encode_mov_reg_ptr(ZYDIS_REGISTER_RAX, ZYDIS_REGISTER_RAX, 0, size))
+		&& append(bytes, zydis_utils.encode_mov_ptr_reg(ZYDIS_REGISTER_RSP, sizeof(uintptr_t), ZYDIS_REGISTER_RAX, size))
+		&& append(bytes, zydis_utils.encode_pop_reg(ZYDIS_REGISTER_RAX, size));
+}
+
+bool RewriteRules::rewrite_jump_memory(const AnnotatedInstruction& instruction, uintptr_t runtime_address, std::vector<uint8_t>& bytes) {
+	// jmp [x] behaves like push [x]; ret
+	size_t size = 0;
+	return rewrite_push_memory(instruction, runtime_address, bytes)
+		&& append(bytes, zydis_utils.encode_ret(size));
+}
+
+bool RewriteRules::rewrite_call_memory(const AnnotatedInstruction& instruction, uintptr_t runtime_address, std::vector<uint8_t>& bytes) {
+	// call thunk; jmp short done; thunk: <jmp [x]>; done:
+	std::vector<uint8_t> thunk;
+
+	if (!rewrite_jump_memory(instruction, runtime_address, thunk)) {
+		return false;
+	}
+
+	constexpr size_t call_size = 5;
+	constexpr size_t jump_short_size = 2;
+
+	const auto thunk_address = runtime_address + call_size + jump_short_size;
+	const auto done_address = thunk_address + thunk.size();
+
+	size_t size = 0;
+	return append(bytes, zydis_utils.encode_branch(ZYDIS_MNEMONIC_CALL, thunk_address, runtime_address, ZYDIS_BRANCH_WIDTH_32, size))
+		&& append(bytes, zydis_utils.encode_branch(ZYDIS_MNEMONIC_JMP, done_address, runtime_address + call_size, ZYDIS_BRANCH_WIDTH_8, size))
+		&& append(bytes, thunk);
+}
+
+bool RewriteRules::append(std::vector<uint8_t>& bytes, const std::vector<uint8_t>& encoded) {
+	if (encoded.empty()) {
+		return false;
+	}
+
+	bytes.insert(bytes.end(), encoded.begin(), encoded.end());
+
+	return true;
+}
+
+bool RewriteRules::uses_stack_pointer(const ZydisDecodedInstruction& instruction, const ZydisDecodedOperand operands[]) {
+	for (int i = 0; i < instruction.operand_count; i++) {
+		const auto& operand = operands[i];
+
+		if (operand.type == ZYDIS_OPERAND_TYPE_REGISTER
+			&& ZydisRegisterGetLargestEnclosing(ZYDIS_MACHINE_MODE_LONG_64, operand.reg.value) == ZYDIS_REGISTER_RSP) {
+			return true;
+		}
+
+		if (operand.type == ZYDIS_OPERAND_TYPE_MEMORY
+			&& (operand.mem.base == ZYDIS_REGISTER_RSP || operand.mem.index == ZYDIS_REGISTER_RSP)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+ZydisRegister RewriteRules::find_scratch_register(const ZydisDecodedInstruction& instruction, const ZydisDecodedOperand operands[]) {
+	static const ZydisRegister candidates[] = {
+		ZYDIS_REGISTER_RAX,
+		ZYDIS_REGISTER_RCX,
+		ZYDIS_REGISTER_RDX,
+		ZYDIS_REGISTER_RBX,
+		ZYDIS_REGISTER_RSI,
+		ZYDIS_REGISTER_RDI,
+		ZYDIS_REGISTER_RBP,
+		ZYDIS_REGISTER_R8,
+		ZYDIS_REGISTER_R9,
+		ZYDIS_REGISTER_R10,
+		ZYDIS_REGISTER_R11,
+		ZYDIS_REGISTER_R12,
+		ZYDIS_REGISTER_R13,
+		ZYDIS_REGISTER_R14,
+		ZYDIS_REGISTER_R15,
+	};
+
+	for (const auto candidate : candidates) {
+		bool is_used = false;
+
+		// Compare full-width registers, `ecx` and `cl` occupy `rcx` just as well
+		for (int i = 0; i < instruction.operand_count && !is_used; i++) {
+			const auto& operand = operands[i];
+
+			if (operand.type == ZYDIS_OPERAND_TYPE_REGISTER) {
+				is_used = ZydisRegisterGetLargestEnclosing(ZYDIS_MACHINE_MODE_LONG_64, operand.reg.value) == candidate;
+			} else if (operand.type == ZYDIS_OPERAND_TYPE_MEMORY) {
+				is_used = ZydisRegisterGetLargestEnclosing(ZYDIS_MACHINE_MODE_LONG_64, operand.mem.base) == candidate
+					|| ZydisRegisterGetLargestEnclosing(ZYDIS_MACHINE_MODE_LONG_64, operand.mem.index) == candidate;
+			}
+		}
+
+		if (!is_used) {
+			return candidate;
+		}
+	}
+
+	return ZYDIS_REGISTER_NONE;
+}
\ No newline at end of file
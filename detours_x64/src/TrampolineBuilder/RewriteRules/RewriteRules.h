@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "lib/Zydis/Zydis.h"
+#include "ZydisUtils/ZydisUtils.h"
+#include "TrampolineBuilder/AnnotatedInstruction/AnnotatedInstruction.h"
+
+// Shape of the operands around the RIP-relative memory operand
+enum class OperandShape {
+	any,
+	reg_mem,
+	mem_reg,
+	mem_imm,
+	mem_only,
+	vector_mem,
+	mem_vector,
+	other
+};
+
+class RewriteRules {
+public:
+	using RewriteFn = bool (RewriteRules::*)(const AnnotatedInstruction& instruction, uintptr_t runtime_address, std::vector<uint8_t>& bytes);
+
+	struct Rule {
+		const char* name;
+		ZydisMnemonic mnemonic; // ZYDIS_MNEMONIC_INVALID matches every mnemonic
+		OperandShape shape;
+		RewriteFn rewrite;
+
+		// Saves a register on the stack around the rewritten instruction
+		bool spills;
+	};
+
+private:
+	static const std::vector<Rule> rules;
+
+	ZydisUtils zydis_utils;
+
+public:
+	// Rewrites an instruction with a RIP-relative memory operand for `runtime_address`.
+	// Rules are tried in table order, so the cheapest rewrite of each class has to come first.
+	const Rule* rewrite(const AnnotatedInstruction& instruction, uintptr_t runtime_address, std::vector<uint8_t>& bytes);
+
+	static OperandShape classify(const AnnotatedInstruction& instruction);
+
+private:
+	bool rewrite_reencode(const AnnotatedInstruction& instruction, uintptr_t runtime_address, std::vector<uint8_t>& bytes);
+
+	bool rewrite_lea(const AnnotatedInstruction& instruction, uintptr_t runtime_address, std::vector<uint8_t>& bytes);
+
+	bool rewrite_load_through_destination(const AnnotatedInstruction& instruction, uintptr_t runtime_address, std::vector<uint8_t>& bytes);
+
+	bool rewrite_scratch_base(const AnnotatedInstruction& instruction, uintptr_t runtime_address, std::vector<uint8_t>& bytes);
+
+	bool rewrite_push_memory(const AnnotatedInstruction& instruction, uintptr_t runtime_address, std::vector<uint8_t>& bytes);
+
+	bool rewrite_jump_memory(const AnnotatedInstruction& instruction, uintptr_t runtime_address, std::vector<uint8_t>& bytes);
+
+	bool rewrite_call_memory(const AnnotatedInstruction& instruction, uintptr_t runtime_address, std::vector<uint8_t>& bytes);
+
+	static bool append(std::vector<uint8_t>& bytes, const std::vector<uint8_t>& encoded);
+
+	static bool uses_stack_pointer(const ZydisDecodedInstruction& instruction, const ZydisDecodedOperand operands[]);
+
+	static ZydisRegister find_scratch_register(const ZydisDecodedInstruction& instruction, const ZydisDecodedOperand operands[]);
+};
\ No newline at end of file
@@ -1,7 +1,12 @@
 #include "TrampolineBuilder.h"
 
-TrampolineBuilder::TrampolineBuilder(void* original_address, const size_t stolen_size, void* cave_address) {
+TrampolineBuilder::TrampolineBuilder(void* original_address, const size_t stolen_size, void* cave_address, const size_t cave_size, void* cave_writable_address) {
 	this->cave_address = (uintptr_t)cave_address;
+	this->cave_size = cave_size;
+	this->write_delta = cave_writable_address != nullptr ? (intptr_t)cave_writable_address - (intptr_t)cave_address : 0;
+	this->used_size = 0;
+	this->unwind_table = nullptr;
+	this->unsupported_mnemonic = ZYDIS_MNEMONIC_INVALID;
 
 	ZydisDecoderInit(&decoder, ZYDIS_MACHINE_MODE_LONG_64, ZYDIS_STACK_WIDTH_64);
 	ZydisFormatterInit(&formatter, ZYDIS_FORMATTER_STYLE_INTEL);
@@ -11,41 +16,129 @@ TrampolineBuilder::TrampolineBuilder(void* original_address, const size_t stolen
 }
 
 void* TrampolineBuilder::get_jump_back_ptr() {
-	return (void*)(cave_address + 0x50);
+	return (void*)get_relocation_stub(jump_back_slot);
 }
 
 void* TrampolineBuilder::get_jump_to_hook_ptr() {
-	return (void*)(cave_address + 0x58);
+	return (void*)get_relocation_stub(jump_to_hook_slot);
 }
 
-void TrampolineBuilder::build(void* hook_function) {
-	place_relocation(hook_function);
+size_t TrampolineBuilder::get_used_size() const {
+	return used_size;
+}
+
+size_t TrampolineBuilder::get_code_size() const {
+	return jump_table_address - cave_address;
+}
+
+size_t TrampolineBuilder::get_jump_table_size() const {
+	return relocation_targets.size() * jump_stub_size;
+}
+
+size_t TrampolineBuilder::get_relocation_count() const {
+	return relocation_targets.size() > 2 ? relocation_targets.size() - 2 : 0;
+}
+
+const std::vector<const RewriteRules::Rule*>& TrampolineBuilder::get_applied_rules() const {
+	return applied_rules;
+}
+
+ZydisMnemonic TrampolineBuilder::get_unsupported_mnemonic() const {
+	return unsupported_mnemonic;
+}
+
+PRUNTIME_FUNCTION TrampolineBuilder::get_unwind_table() const {
+	return unwind_table;
+}
+
+const std::vector<std::pair<size_t, size_t>>& TrampolineBuilder::get_instruction_offsets() const {
+	return instruction_offsets;
+}
 
+bool TrampolineBuilder::build(void* hook_function) {
+	jump_to_hook_slot = intern_relocation((uintptr_t)hook_function);
+
+	// First pass: branch displacements are always encoded with 32 bits, so the
+	// code size does not depend on where the tables end up
 	std::vector<uint8_t> bytes;
-	uintptr_t runtime_address = cave_address;
 
-	for (const auto& instruction : annotated_instructions) {
-		const auto& instruction_bytes = rewrite_instruction(instruction, runtime_address);
+	if (!rewrite_instructions(bytes) || !layout_tables(bytes.size() + 5)) {
+		return false;
+	}
 
-		for (auto byte : instruction_bytes) {
-			bytes.push_back(byte);
-		}
+	// Second pass: emit against the final table placement
+	if (!rewrite_instructions(bytes)) {
+		return false;
 	}
 
-	std::memcpy((void*)cave_address, bytes.data(), bytes.size());
+	std::memcpy((void*)(cave_address + write_delta), bytes.data(), bytes.size());
 	place_jump((uint8_t*)cave_address + bytes.size(), get_jump_back_ptr());
+	place_relocations();
+
+	// Rewritten pushes and call thunks move rsp, without unwind info a stack walk from in there stops dead.
+	// The tables go into the unused tail of the cave.
+	size_t unwind_size = cave_size - used_size;
+	unwind_table = UnwindInfo::register_code(cave_address, get_code_size(), cave_address + used_size, unwind_size, write_delta);
+	used_size += unwind_size;
+
+	return true;
 }
 
 void TrampolineBuilder::initialize_tables(uintptr_t original_address, const size_t stolen_size) {
-	jump_table_address = cave_address + 0x50;
-	address_table_address = cave_address + 0x100;
+	jump_table_address = cave_address;
+	address_table_address = cave_address;
+
+	jump_back_slot = intern_relocation(original_address + stolen_size);
+}
+
+bool TrampolineBuilder::layout_tables(size_t code_size) {
+	jump_table_address = cave_address + code_size;
+
+	// Address slots are qword-aligned so a single store can retarget them
+	const auto jump_table_end = jump_table_address + relocation_targets.size() * jump_stub_size;
+	address_table_address = (jump_table_end + sizeof(uintptr_t) - 1) & ~(sizeof(uintptr_t) - 1);
+
+	used_size = (address_table_address + relocation_targets.size() * sizeof(uintptr_t)) - cave_address;
+
+	if (used_size > cave_size) {
+		std::printf("[error] trampoline needs 0x%zx bytes but the cave only holds 0x%zx\n", used_size, cave_size);
+		return false;
+	}
 
-	place_relocation((void*)(original_address + stolen_size)); // jump back ptr
+	return true;
 }
 
 void TrampolineBuilder::place_jump(void* from, void* to) {
-	*reinterpret_cast<uint8_t*>(from) = 0xE9;
-	*reinterpret_cast<uint32_t*>(reinterpret_cast<uint8_t*>(from) + 1) = static_cast<uint32_t>(reinterpret_cast<uint8_t*>(to) - (reinterpret_cast<uint8_t*>(from) + 5));
+	const auto write_address = reinterpret_cast<uint8_t*>(from) + write_delta;
+
+	*write_address = 0xE9;
+	*reinterpret_cast<uint32_t*>(write_address + 1) = static_cast<uint32_t>(reinterpret_cast<uint8_t*>(to) - (reinterpret_cast<uint8_t*>(from) + 5));
+}
+
+bool TrampolineBuilder::rewrite_instructions(std::vector<uint8_t>& bytes) {
+	bytes.clear();
+	applied_rules.clear();
+	instruction_offsets.clear();
+	uintptr_t runtime_address = cave_address;
+	size_t original_offset = 0;
+
+	for (const auto& instruction : annotated_instructions) {
+		instruction_offsets.push_back(std::make_pair(original_offset, (size_t)(runtime_address - cave_address)));
+
+		const auto& instruction_bytes = rewrite_instruction(instruction, runtime_address);
+
+		if (instruction_bytes.empty()) {
+			return false;
+		}
+
+		bytes.insert(bytes.end(), instruction_bytes.begin(), instruction_bytes.end());
+		original_offset += instruction.get_raw().length;
+	}
+
+	// The jump back stands for the first instruction after the stolen bytes
+	instruction_offsets.push_back(std::make_pair(original_offset, (size_t)(runtime_address - cave_address)));
+
+	return true;
 }
 
 std::vector<uint8_t> TrampolineBuilder::rewrite_instruction(const AnnotatedInstruction& instruction, uintptr_t& runtime_address) {
@@ -62,60 +155,75 @@ std::vector<uint8_t> TrampolineBuilder::rewrite_instruction(const AnnotatedInstr
 		return bytes;
 	}
 
-	if (zydis_utils.is_jump(mnemonic) || mnemonic == ZYDIS_MNEMONIC_CALL) {
-		place_relocation((void*)instruction.get_absolute_address());
-		uintptr_t target = jump_table_address - sizeof(uintptr_t);
+	const bool is_relative_branch = operands[instruction.get_relative_operand_id()].type == ZYDIS_OPERAND_TYPE_IMMEDIATE;
+
+	if (is_relative_branch && (zydis_utils.is_jump(mnemonic) || mnemonic == ZYDIS_MNEMONIC_CALL)) {
+		const auto slot = intern_relocation(instruction.get_absolute_address());
+		const uintptr_t target = get_relocation_stub(slot);
 
 		// Rewrite JCC/CALL
 		ZydisEncoderRequest req;
 		ZydisEncoderDecodedInstructionToEncoderRequest(&raw_instruction, operands, raw_instruction.operand_count_visible, &req);
 		req.operands[0].type = ZYDIS_OPERAND_TYPE_IMMEDIATE;
-		req.operands[0].imm.s = target - (runtime_address + raw_instruction.length);
+		req.operands[0].imm.u = target;
 
-		size_t size;
-		const auto rewritten_insn = zydis_utils.encode(req, size);
+		// JrCXZ and LOOPcc only exist with rel8, everything else is pinned to rel32 to keep the layout stable
+		const bool is_rel8_only = mnemonic == ZYDIS_MNEMONIC_JCXZ || mnemonic == ZYDIS_MNEMONIC_JECXZ || mnemonic == ZYDIS_MNEMONIC_JRCXZ
+			|| mnemonic == ZYDIS_MNEMONIC_LOOP || mnemonic == ZYDIS_MNEMONIC_LOOPE || mnemonic == ZYDIS_MNEMONIC_LOOPNE;
+
+		req.branch_type = ZYDIS_BRANCH_TYPE_NONE;
+		req.branch_width = is_rel8_only ? ZYDIS_BRANCH_WIDTH_8 : ZYDIS_BRANCH_WIDTH_32;
+
+		size_t size = 0;
+		const auto rewritten_insn = zydis_utils.encode_absolute(req, runtime_address, size);
 		rewritten_bytes.insert(rewritten_bytes.end(), rewritten_insn.begin(), rewritten_insn.end());
 
 		runtime_address += size;
 	} else {
-		const auto unused_reg = instruction_get_unused_register(raw_instruction, operands);
+		std::vector<uint8_t> rewritten_insn;
 
-		const size_t relative_op_id = instruction.get_relative_operand_id();
-		const size_t other_op_id = relative_op_id == 0 ? 1 : 0;
+		const auto rule = rewrite_rules.rewrite(instruction, runtime_address, rewritten_insn);
 
-		ZydisEncoderRequest req;
-		ZydisEncoderDecodedInstructionToEncoderRequest(&raw_instruction, operands, raw_instruction.operand_count_visible, &req);
-		req.operands[relative_op_id].type = ZYDIS_OPERAND_TYPE_REGISTER;
-		req.operands[relative_op_id].reg.value = fit_register(unused_reg, req.operands[other_op_id].reg.value);
+		if (rule == nullptr) {
+			std::printf("[error] no rewrite rule for instruction: %s\n", zydis_utils.to_string(raw_instruction, operands).c_str());
+			unsupported_mnemonic = mnemonic;
+			return { };
+		}
 
-		size_t size = 0;
+		applied_rules.push_back(rule);
 
-		auto rewritten_insn = zydis_utils.encode_push_reg(unused_reg, size);
 		rewritten_bytes.insert(rewritten_bytes.end(), rewritten_insn.begin(), rewritten_insn.end());
-		runtime_address += size;
+		runtime_address += rewritten_insn.size();
+	}
 
-		rewritten_insn = zydis_utils.encode_mov_reg_mem(unused_reg, instruction.get_absolute_address(), size);
-		rewritten_bytes.insert(rewritten_bytes.end(), rewritten_insn.begin(), rewritten_insn.end());
-		runtime_address += size;
+	return rewritten_bytes;
+}
 
-		rewritten_insn = zydis_utils.encode(req, size);
-		rewritten_bytes.insert(rewritten_bytes.end(), rewritten_insn.begin(), rewritten_insn.end());
-		runtime_address += size;
+size_t TrampolineBuilder::intern_relocation(uintptr_t to) {
+	const auto it = relocation_slots.find(to);
 
-		rewritten_insn = zydis_utils.encode_pop_reg(unused_reg, size);
-		rewritten_bytes.insert(rewritten_bytes.end(), rewritten_insn.begin(), rewritten_insn.end());
-		runtime_address += size;
+	if (it != relocation_slots.end()) {
+		return it->second;
 	}
 
-	return rewritten_bytes;
+	const auto slot = relocation_targets.size();
+	relocation_targets.push_back(to);
+	relocation_slots.insert(std::make_pair(to, slot));
+
+	return slot;
+}
+
+uintptr_t TrampolineBuilder::get_relocation_stub(size_t slot) const {
+	return jump_table_address + slot * jump_stub_size;
 }
 
-void TrampolineBuilder::place_relocation(void* to) {
-	*reinterpret_cast<uintptr_t*>(address_table_address) = (uintptr_t)to;
-	place_qword_jump((void*)jump_table_address, (void*)address_table_address);
+void TrampolineBuilder::place_relocations() {
+	for (size_t slot = 0; slot < relocation_targets.size(); slot++) {
+		const auto address_slot = address_table_address + slot * sizeof(uintptr_t);
 
-	jump_table_address += sizeof(uintptr_t);
-	address_table_address += sizeof(uintptr_t);
+		*reinterpret_cast<uintptr_t*>(address_slot + write_delta) = relocation_targets[slot];
+		place_qword_jump((void*)get_relocation_stub(slot), (void*)address_slot);
+	}
 }
 
 void TrampolineBuilder::place_qword_jump(void* from, void* to) {
@@ -124,7 +232,7 @@ void TrampolineBuilder::place_qword_jump(void* from, void* to) {
 
 	*(uint32_t*)(jump_qword + 2) = static_cast<uint32_t>(disp);
 
-	std::memcpy(from, jump_qword, sizeof(jump_qword));
+	std::memcpy((uint8_t*)from + write_delta, jump_qword, sizeof(jump_qword));
 }
 
 void TrampolineBuilder::build_annotated_instructions(uintptr_t address, const uint8_t* buffer, const size_t buffer_size) {
@@ -141,59 +249,4 @@ void TrampolineBuilder::build_annotated_instructions(uintptr_t address, const ui
 
 		offset += instruction.length;
 	}
-}
-
-ZydisRegister TrampolineBuilder::fit_register(ZydisRegister reg, ZydisRegister other_reg) {
-	// `reg` is always 64-bit wide
-	const auto width_other = ZydisRegisterGetWidth(ZYDIS_MACHINE_MODE_LONG_64, other_reg);
-
-	if (width_other == 32) {
-		return (ZydisRegister)((size_t)reg - 16);
-	}
-	else if (width_other == 16) {
-		return (ZydisRegister)((size_t)reg - 32);
-	}
-	else if (width_other == 8) {
-		return (ZydisRegister)((size_t)reg - 48);
-	}
-
-	return reg;
-}
-
-ZydisRegister TrampolineBuilder::instruction_get_unused_register(const ZydisDecodedInstruction& instruction, const ZydisDecodedOperand operands[]) {
-	std::set<ZydisRegister> regs = {
-		ZYDIS_REGISTER_RAX,
-		ZYDIS_REGISTER_RBX,
-		ZYDIS_REGISTER_RCX,
-		ZYDIS_REGISTER_RDX,
-		ZYDIS_REGISTER_RSI,
-		ZYDIS_REGISTER_RDI,
-		ZYDIS_REGISTER_RBP,
-		ZYDIS_REGISTER_R8,
-		ZYDIS_REGISTER_R9,
-		ZYDIS_REGISTER_R10,
-		ZYDIS_REGISTER_R11,
-		ZYDIS_REGISTER_R12,
-		ZYDIS_REGISTER_R13,
-		ZYDIS_REGISTER_R14,
-		ZYDIS_REGISTER_R15,
-	};
-
-	std::set<ZydisRegister> used_regs = {};
-
-	for (int i = 0; i < instruction.operand_count; i++) {
-		const auto& operand = operands[i];
-
-		if (operand.type == ZYDIS_OPERAND_TYPE_REGISTER) {
-			used_regs.insert(operand.reg.value);
-		}
-	}
-
-	for (const auto& reg : regs) {
-		if (!used_regs.contains(reg)) {
-			return reg;
-		}
-	}
-
-	return ZydisRegister::ZYDIS_REGISTER_MAX_VALUE;
 }
\ No newline at end of file
@@ -2,47 +2,102 @@
 
 #include <vector>
 #include <cstdint>
-#include <set>
+#include <unordered_map>
 
 #include "lib/Zydis/Zydis.h"
 #include "ZydisUtils/ZydisUtils.h"
 #include "AnnotatedInstruction/AnnotatedInstruction.h"
+#include "RewriteRules/RewriteRules.h"
+#include "UnwindInfo/UnwindInfo.h"
 
 class TrampolineBuilder {
 private:
+	// FF25 disp32 - jmp qword ptr [rip+disp32]
+	static constexpr size_t jump_stub_size = 6;
+
 	ZydisDecoder decoder;
 	ZydisFormatter formatter;
 	ZydisUtils zydis_utils;
+	RewriteRules rewrite_rules;
 
 	std::vector<AnnotatedInstruction> annotated_instructions;
 
+	// Every unique absolute target owns exactly one jump stub and one address slot
+	std::vector<uintptr_t> relocation_targets;
+	std::unordered_map<uintptr_t, size_t> relocation_slots;
+
 	uintptr_t cave_address;
+	size_t cave_size;
+
+	// Writable view minus executable view, 0 unless the cave is mapped twice
+	intptr_t write_delta;
+	size_t used_size;
+
 	uintptr_t jump_table_address;
 	uintptr_t address_table_address;
 
+	size_t jump_back_slot;
+	size_t jump_to_hook_slot;
+
+	// Rewrite rule of every RIP-relative non-branch instruction of the last pass, in order
+	std::vector<const RewriteRules::Rule*> applied_rules;
+
+	// First instruction no rewrite rule accepted, ZYDIS_MNEMONIC_INVALID if there was none
+	ZydisMnemonic unsupported_mnemonic;
+
+	// Registered for the code while it runs with something pushed, nullptr for stack neutral trampolines
+	PRUNTIME_FUNCTION unwind_table;
+
+	// (offset in the stolen bytes, offset in the cave) of every instruction of the last pass, closed by the jump back
+	std::vector<std::pair<size_t, size_t>> instruction_offsets;
+
 public:
-	TrampolineBuilder(void* original_address, const size_t stolen_size, void* cave_address);
+	// `cave_writable_address` is where the cave is written to if it differs from where it runs, see CodeArena
+	TrampolineBuilder(void* original_address, const size_t stolen_size, void* cave_address, const size_t cave_size, void* cave_writable_address = nullptr);
 
 	void* get_jump_back_ptr();
 
 	void* get_jump_to_hook_ptr();
 
-	void build(void* hook_function);
+	size_t get_used_size() const;
+
+	// Rewritten instructions plus the jump back, the jump table follows directly
+	size_t get_code_size() const;
+
+	size_t get_jump_table_size() const;
+
+	// Branch targets outside the stolen bytes, the jump back and the jump to the hook are not counted
+	size_t get_relocation_count() const;
+
+	const std::vector<const RewriteRules::Rule*>& get_applied_rules() const;
+
+	ZydisMnemonic get_unsupported_mnemonic() const;
+
+	// Owned by the caller once `build` succeeded, release it with UnwindInfo::unregister before freeing the cave
+	PRUNTIME_FUNCTION get_unwind_table() const;
+
+	const std::vector<std::pair<size_t, size_t>>& get_instruction_offsets() const;
+
+	bool build(void* hook_function);
 
 private:
 	void initialize_tables(uintptr_t original_address, const size_t stolen_size);
 
-	static void place_jump(void* from, void* to);
+	bool layout_tables(size_t code_size);
+
+	void place_jump(void* from, void* to);
+
+	bool rewrite_instructions(std::vector<uint8_t>& bytes);
 
 	std::vector<uint8_t> rewrite_instruction(const AnnotatedInstruction& instruction, uintptr_t& runtime_address);
 
-	void place_relocation(void* to);
+	size_t intern_relocation(uintptr_t to);
 
-	void place_qword_jump(void* from, void* to);
+	uintptr_t get_relocation_stub(size_t slot) const;
 
-	void build_annotated_instructions(uintptr_t address, const uint8_t* buffer, const size_t buffer_size);
+	void place_relocations();
 
-	ZydisRegister fit_register(ZydisRegister reg, ZydisRegister other_reg);
+	void place_qword_jump(void* from, void* to);
 
-	ZydisRegister instruction_get_unused_register(const ZydisDecodedInstruction& instruction, const ZydisDecodedOperand operands[]);
+	void build_annotated_instructions(uintptr_t address, const uint8_t* buffer, const size_t buffer_size);
 };
\ No newline at end of file
@@ -0,0 +1,276 @@
+#include <cstring>
+#include <map>
+
+#include "UnwindInfo.h"
+
+// UNWIND_CODE operations, see the x64 exception handling documentation
+enum UnwindOperation : uint8_t {
+	UWOP_PUSH_NONVOL = 0,
+	UWOP_ALLOC_LARGE = 1,
+	UWOP_ALLOC_SMALL = 2
+};
+
+PRUNTIME_FUNCTION UnwindInfo::register_code(uintptr_t code, size_t code_size, uintptr_t table, size_t& table_size, intptr_t write_delta) {
+	const auto ranges = track_stack(code, code_size);
+
+	if (ranges.empty()) {
+		table_size = 0;
+		return nullptr;
+	}
+
+	// Ranges with the same stack share one UNWIND_INFO
+	std::map<std::vector<uint16_t>, size_t> unwind_offsets;
+	std::vector<uint8_t> unwind_data;
+	std::vector<RUNTIME_FUNCTION> functions;
+
+	const auto table_begin = (table + 3) & ~static_cast<uintptr_t>(3);
+	const auto unwind_begin = table_begin + ranges.size() * sizeof(RUNTIME_FUNCTION);
+
+	for (const auto& range : ranges) {
+		const auto codes = encode(range.operations);
+
+		if (codes.empty()) {
+			continue;
+		}
+
+		auto it = unwind_offsets.find(codes);
+
+		if (it == unwind_offsets.end()) {
+			// Version 1, no flags, no prolog: every code applies wherever rip is in the range
+			const uint8_t header[] = { 1, 0, static_cast<uint8_t>(codes.size()), 0 };
+
+			it = unwind_offsets.insert(std::make_pair(codes, unwind_data.size())).first;
+
+			unwind_data.insert(unwind_data.end(), header, header + sizeof(header));
+			unwind_data.insert(unwind_data.end(), reinterpret_cast<const uint8_t*>(codes.data()), reinterpret_cast<const uint8_t*>(codes.data() + codes.size()));
+
+			// The code array is padded to an even count
+			if (codes.size() % 2 != 0) {
+				unwind_data.insert(unwind_data.end(), { 0, 0 });
+			}
+		}
+
+		RUNTIME_FUNCTION function;
+		function.BeginAddress = range.begin;
+		function.EndAddress = range.end;
+		function.UnwindData = static_cast<DWORD>(unwind_begin - code + it->second);
+
+		functions.push_back(function);
+	}
+
+	const auto needed = (unwind_begin - table) + unwind_data.size();
+
+	if (functions.empty() || needed > table_size) {
+		table_size = 0;
+		return nullptr;
+	}
+
+	std::memcpy(reinterpret_cast<void*>(table_begin + write_delta), functions.data(), functions.size() * sizeof(RUNTIME_FUNCTION));
+	std::memcpy(reinterpret_cast<void*>(unwind_begin + write_delta), unwind_data.data(), unwind_data.size());
+
+	const auto registered = reinterpret_cast<PRUNTIME_FUNCTION>(table_begin);
+
+	if (!RtlAddFunctionTable(registered, static_cast<DWORD>(functions.size()), static_cast<DWORD64>(code))) {
+		table_size = 0;
+		return nullptr;
+	}
+
+	table_size = needed;
+
+	return registered;
+}
+
+void UnwindInfo::unregister(PRUNTIME_FUNCTION table) {
+	if (table != nullptr) {
+		RtlDeleteFunctionTable(table);
+	}
+}
+
+std::vector<UnwindInfo::StackRange> UnwindInfo::track_stack(uintptr_t code, size_t code_size) {
+	ZydisDecoder decoder;
+	ZydisDecoderInit(&decoder, ZYDIS_MACHINE_MODE_LONG_64, ZYDIS_STACK_WIDTH_64);
+
+	ZydisDecodedInstruction instruction;
+	ZydisDecodedOperand operands[ZYDIS_MAX_OPERAND_COUNT];
+
+	std::vector<StackRange> ranges;
+
+	// Stack at branch targets inside the code, e.g. the thunk behind a rewritten call [mem]
+	std::map<uint32_t, std::vector<StackOperation>> target_states;
+
+	std::vector<StackOperation> operations;
+	bool is_known = true;
+	uint32_t offset = 0;
+
+	while (offset < code_size) {
+		if (ZYAN_FAILED(ZydisDecoderDecodeFull(&decoder, reinterpret_cast<const void*>(code + offset), code_size - offset, &instruction, operands))) {
+			break;
+		}
+
+		const auto target_state = target_states.find(offset);
+
+		if (target_state != target_states.end()) {
+			operations = target_state->second;
+			is_known = true;
+		}
+
+		const auto next = offset + instruction.length;
+
+		if (is_known && !operations.empty()) {
+			if (!ranges.empty() && ranges.back().end == offset && ranges.back().operations == operations) {
+				ranges.back().end = next;
+			} else {
+				ranges.push_back({ offset, next, operations });
+			}
+		}
+
+		if (is_known && instruction.attributes & ZYDIS_ATTRIB_IS_RELATIVE && operands[0].type == ZYDIS_OPERAND_TYPE_IMMEDIATE) {
+			ZyanU64 target = 0;
+			ZydisCalcAbsoluteAddress(&instruction, &operands[0], code + offset, &target);
+
+			if (target >= code && target < code + code_size) {
+				auto state = operations;
+
+				// The return address sits on top of the stack at a call target
+				if (instruction.mnemonic == ZYDIS_MNEMONIC_CALL) {
+					state.push_back({ ZYDIS_REGISTER_NONE, 8 });
+				}
+
+				target_states.insert(std::make_pair(static_cast<uint32_t>(target - code), state));
+			}
+		}
+
+		switch (instruction.mnemonic) {
+		case ZYDIS_MNEMONIC_JMP:
+		case ZYDIS_MNEMONIC_RET:
+			// Whatever follows is only reached through a branch target
+			is_known = false;
+			break;
+		case ZYDIS_MNEMONIC_CALL:
+			break;
+		default:
+			is_known = is_known && apply(instruction, operands, operations);
+			break;
+		}
+
+		offset = next;
+	}
+
+	return ranges;
+}
+
+bool UnwindInfo::apply(const ZydisDecodedInstruction& instruction, const ZydisDecodedOperand operands[], std::vector<StackOperation>& operations) {
+	const auto is_rsp = [&](size_t i) {
+		return operands[i].type == ZYDIS_OPERAND_TYPE_REGISTER && operands[i].reg.value == ZYDIS_REGISTER_RSP;
+	};
+
+	switch (instruction.mnemonic) {
+	case ZYDIS_MNEMONIC_PUSH:
+		if (operands[0].type == ZYDIS_OPERAND_TYPE_REGISTER && operands[0].size == 64) {
+			operations.push_back({ operands[0].reg.value, 8 });
+		} else {
+			operations.push_back({ ZYDIS_REGISTER_NONE, instruction.operand_width / 8u });
+		}
+
+		return true;
+	case ZYDIS_MNEMONIC_PUSHFQ:
+		operations.push_back({ ZYDIS_REGISTER_NONE, 8 });
+		return true;
+	case ZYDIS_MNEMONIC_POP:
+	case ZYDIS_MNEMONIC_POPFQ:
+		return release(operations, 8);
+	case ZYDIS_MNEMONIC_SUB:
+	case ZYDIS_MNEMONIC_ADD:
+		if (is_rsp(0) && operands[1].type == ZYDIS_OPERAND_TYPE_IMMEDIATE) {
+			const auto value = static_cast<int64_t>(operands[1].imm.value.s);
+			const auto allocated = instruction.mnemonic == ZYDIS_MNEMONIC_SUB ? value : -value;
+
+			if (allocated >= 0) {
+				operations.push_back({ ZYDIS_REGISTER_NONE, static_cast<uint32_t>(allocated) });
+				return true;
+			}
+
+			return release(operations, static_cast<uint32_t>(-allocated));
+		}
+
+		break;
+	case ZYDIS_MNEMONIC_LEA:
+		if (is_rsp(0) && operands[1].mem.base == ZYDIS_REGISTER_RSP && operands[1].mem.index == ZYDIS_REGISTER_NONE) {
+			const auto displacement = operands[1].mem.disp.value;
+
+			if (displacement <= 0) {
+				operations.push_back({ ZYDIS_REGISTER_NONE, static_cast<uint32_t>(-displacement) });
+				return true;
+			}
+
+			return release(operations, static_cast<uint32_t>(displacement));
+		}
+
+		break;
+	default:
+		break;
+	}
+
+	// Anything else that writes rsp (mov rsp, and rsp, ...) leaves the stack undescribable
+	for (size_t i = 0; i < instruction.operand_count; i++) {
+		if (is_rsp(i) && operands[i].actions & ZYDIS_OPERAND_ACTION_MASK_WRITE) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool UnwindInfo::release(std::vector<StackOperation>& operations, uint32_t size) {
+	while (size != 0) {
+		// Popping what the code was entered with
+		if (operations.empty()) {
+			return false;
+		}
+
+		auto& last = operations.back();
+
+		if (last.size <= size) {
+			size -= last.size;
+			operations.pop_back();
+		} else {
+			// A partly released push is just an allocation now
+			last = { ZYDIS_REGISTER_NONE, last.size - size };
+			size = 0;
+		}
+	}
+
+	return true;
+}
+
+std::vector<uint16_t> UnwindInfo::encode(const std::vector<StackOperation>& operations) {
+	std::vector<uint16_t> codes;
+
+	const auto code = [](UnwindOperation operation, uint8_t info) {
+		return static_cast<uint16_t>((operation | (info << 4)) << 8);
+	};
+
+	// Unwind codes are listed in reverse order of execution
+	for (auto it = operations.rbegin(); it != operations.rend(); it++) {
+		if (it->size % 8 != 0) {
+			return { };
+		}
+
+		if (it->reg != ZYDIS_REGISTER_NONE) {
+			codes.push_back(code(UWOP_PUSH_NONVOL, static_cast<uint8_t>(it->reg - ZYDIS_REGISTER_RAX)));
+		} else if (it->size == 0) {
+			continue;
+		} else if (it->size <= 128) {
+			codes.push_back(code(UWOP_ALLOC_SMALL, static_cast<uint8_t>(it->size / 8 - 1)));
+		} else if (it->size <= 0x7FFF8) {
+			codes.push_back(code(UWOP_ALLOC_LARGE, 0));
+			codes.push_back(static_cast<uint16_t>(it->size / 8));
+		} else {
+			codes.push_back(code(UWOP_ALLOC_LARGE, 1));
+			codes.push_back(static_cast<uint16_t>(it->size));
+			codes.push_back(static_cast<uint16_t>(it->size >> 16));
+		}
+	}
+
+	return codes;
+}
\ No newline at end of file
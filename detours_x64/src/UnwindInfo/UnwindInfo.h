@@ -0,0 +1,44 @@
+#pragma once
+
+#include <Windows.h>
+#include <cstdint>
+#include <vector>
+
+#include "lib/Zydis/Zydis.h"
+
+// Stack change since the code was entered, in execution order
+struct StackOperation {
+	// ZYDIS_REGISTER_NONE for allocations and pushes of anything but a 64-bit register
+	ZydisRegister reg;
+	uint32_t size;
+
+	bool operator==(const StackOperation& other) const = default;
+};
+
+class UnwindInfo {
+private:
+	struct StackRange {
+		uint32_t begin;
+		uint32_t end;
+		std::vector<StackOperation> operations;
+	};
+
+public:
+	// Tracks rsp through [code, code + code_size) and registers a RUNTIME_FUNCTION for every run of instructions
+	// with something on the stack. The tables are written to [table, table + table_size), which has to lie above
+	// `code` and within 4 GB of it, through `table + write_delta` if the memory is mapped twice. Returns the
+	// registered table for RtlDeleteFunctionTable, or nullptr.
+	static PRUNTIME_FUNCTION register_code(uintptr_t code, size_t code_size, uintptr_t table, size_t& table_size, intptr_t write_delta = 0);
+
+	static void unregister(PRUNTIME_FUNCTION table);
+
+private:
+	static std::vector<StackRange> track_stack(uintptr_t code, size_t code_size);
+
+	// Applies `instruction` to `operations`, false once rsp moves in a way unwind codes cannot express
+	static bool apply(const ZydisDecodedInstruction& instruction, const ZydisDecodedOperand operands[], std::vector<StackOperation>& operations);
+
+	static bool release(std::vector<StackOperation>& operations, uint32_t size);
+
+	static std::vector<uint16_t> encode(const std::vector<StackOperation>& operations);
+};
\ No newline at end of file
@@ -0,0 +1,29 @@
+#include "VirtualTable.h"
+
+size_t VirtualTable::count_entries(void** vtable) {
+	size_t count = 0;
+
+	// The table ends where the next table's RTTI locator or unrelated data begins
+	while (count < max_entries && is_executable(vtable[count])) {
+		count++;
+	}
+
+	return count;
+}
+
+std::vector<void*> VirtualTable::clone(void** vtable) {
+	const auto count = count_entries(vtable);
+
+	// MSVC keeps the complete object locator at index -1, typeid and dynamic_cast read it from there
+	return std::vector<void*>(vtable - 1, vtable + count);
+}
+
+bool VirtualTable::is_executable(const void* address) {
+	MEMORY_BASIC_INFORMATION mbi;
+
+	if (address == nullptr || !VirtualQuery(address, &mbi, sizeof(mbi)) || mbi.State != MEM_COMMIT) {
+		return false;
+	}
+
+	return (mbi.Protect & (PAGE_EXECUTE | PAGE_EXECUTE_READ | PAGE_EXECUTE_READWRITE | PAGE_EXECUTE_WRITECOPY)) != 0;
+}
\ No newline at end of file
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <Windows.h>
+#include <cstdint>
+#include <vector>
+
+class VirtualTable {
+private:
+	static constexpr size_t max_entries = 1024;
+
+public:
+	static void** get(const void* object) {
+		return *static_cast<void** const*>(object);
+	}
+
+	static void set(void* object, void** vtable) {
+		*static_cast<void***>(object) = vtable;
+	}
+
+	// Number of leading entries that point to executable memory, there is no size stored anywhere
+	static size_t count_entries(void** vtable);
+
+	// Copy of `vtable` including the RTTI locator in front of it, the usable table starts at element 1
+	static std::vector<void*> clone(void** vtable);
+
+private:
+	static bool is_executable(const void* address);
+};
\ No newline at end of file
@@ -44,6 +44,21 @@ std::vector<uint8_t> ZydisUtils::encode(const ZydisDecodedInstruction& instructi
 	return encoded;
 }
 
+std::vector<uint8_t> ZydisUtils::encode_absolute(ZydisEncoderRequest req, uintptr_t runtime_address, size_t& size) {
+	uint8_t encoded_instruction[ZYDIS_MAX_INSTRUCTION_LENGTH];
+	size_t encoded_length = sizeof(encoded_instruction);
+
+	// Relative operands in `req` hold absolute targets, Zydis computes the displacement for `runtime_address`
+	if (ZYAN_FAILED(ZydisEncoderEncodeInstructionAbsolute(&req, encoded_instruction, &encoded_length, runtime_address))) {
+		std::printf("Failed to encode instruction\n");
+		return { };
+	}
+
+	size = encoded_length;
+
+	return std::vector<uint8_t>(encoded_instruction, encoded_instruction + encoded_length);
+}
+
 std::vector<uint8_t> ZydisUtils::encode_push_reg(ZydisRegister reg, size_t& size) {
 	ZydisEncoderRequest req;
 	memset(&req, 0, sizeof(req));
@@ -89,6 +104,87 @@ std::vector<uint8_t> ZydisUtils::encode_mov_reg_mem(ZydisRegister reg, uintptr_t
 	return encode(req, size);
 }
 
+std::vector<uint8_t> ZydisUtils::encode_mov_reg_imm(ZydisRegister reg, uint64_t immediate, size_t& size) {
+	ZydisEncoderRequest req;
+	memset(&req, 0, sizeof(req));
+
+	req.mnemonic = ZYDIS_MNEMONIC_MOV;
+	req.machine_mode = ZYDIS_MACHINE_MODE_LONG_64;
+	req.operand_count = 2;
+
+	req.operands[0].type = ZYDIS_OPERAND_TYPE_REGISTER;
+	req.operands[0].reg.value = reg;
+
+	req.operands[1].type = ZYDIS_OPERAND_TYPE_IMMEDIATE;
+	req.operands[1].imm.u = immediate;
+
+	return encode(req, size);
+}
+
+std::vector<uint8_t> ZydisUtils::encode_mov_reg_ptr(ZydisRegister reg, ZydisRegister base, int64_t displacement, size_t& size) {
+	ZydisEncoderRequest req;
+	memset(&req, 0, sizeof(req));
+
+	req.mnemonic = ZYDIS_MNEMONIC_MOV;
+	req.machine_mode = ZYDIS_MACHINE_MODE_LONG_64;
+	req.operand_count = 2;
+
+	req.operands[0].type = ZYDIS_OPERAND_TYPE_REGISTER;
+	req.operands[0].reg.value = reg;
+
+	req.operands[1].type = ZYDIS_OPERAND_TYPE_MEMORY;
+	req.operands[1].mem.base = base;
+	req.operands[1].mem.displacement = displacement;
+	req.operands[1].mem.size = ZydisRegisterGetWidth(ZYDIS_MACHINE_MODE_LONG_64, reg) / 8;
+
+	return encode(req, size);
+}
+
+std::vector<uint8_t> ZydisUtils::encode_mov_ptr_reg(ZydisRegister base, int64_t displacement, ZydisRegister reg, size_t& size) {
+	ZydisEncoderRequest req;
+	memset(&req, 0, sizeof(req));
+
+	req.mnemonic = ZYDIS_MNEMONIC_MOV;
+	req.machine_mode = ZYDIS_MACHINE_MODE_LONG_64;
+	req.operand_count = 2;
+
+	req.operands[0].type = ZYDIS_OPERAND_TYPE_MEMORY;
+	req.operands[0].mem.base = base;
+	req.operands[0].mem.displacement = displacement;
+	req.operands[0].mem.size = ZydisRegisterGetWidth(ZYDIS_MACHINE_MODE_LONG_64, reg) / 8;
+
+	req.operands[1].type = ZYDIS_OPERAND_TYPE_REGISTER;
+	req.operands[1].reg.value = reg;
+
+	return encode(req, size);
+}
+
+std::vector<uint8_t> ZydisUtils::encode_branch(ZydisMnemonic mnemonic, uintptr_t target, uintptr_t runtime_address, ZydisBranchWidth width, size_t& size) {
+	ZydisEncoderRequest req;
+	memset(&req, 0, sizeof(req));
+
+	req.mnemonic = mnemonic;
+	req.machine_mode = ZYDIS_MACHINE_MODE_LONG_64;
+	req.branch_type = ZYDIS_BRANCH_TYPE_NONE;
+	req.branch_width = width;
+	req.operand_count = 1;
+
+	req.operands[0].type = ZYDIS_OPERAND_TYPE_IMMEDIATE;
+	req.operands[0].imm.u = target;
+
+	return encode_absolute(req, runtime_address, size);
+}
+
+std::vector<uint8_t> ZydisUtils::encode_ret(size_t& size) {
+	ZydisEncoderRequest req;
+	memset(&req, 0, sizeof(req));
+
+	req.mnemonic = ZYDIS_MNEMONIC_RET;
+	req.machine_mode = ZYDIS_MACHINE_MODE_LONG_64;
+
+	return encode(req, size);
+}
+
 std::string ZydisUtils::encode_and_format(const ZydisEncoderRequest& req, size_t& size) {
 	uint8_t encoded_instruction[ZYDIS_MAX_INSTRUCTION_LENGTH];
 	size_t encoded_length = sizeof(encoded_instruction);
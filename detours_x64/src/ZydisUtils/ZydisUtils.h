@@ -19,12 +19,24 @@ public:
 
 	std::vector<uint8_t> encode(const ZydisDecodedInstruction& instruction, const ZydisDecodedOperand operands[], size_t& size);
 
+	std::vector<uint8_t> encode_absolute(ZydisEncoderRequest req, uintptr_t runtime_address, size_t& size);
+
 	std::vector<uint8_t> encode_push_reg(ZydisRegister reg, size_t& size);
 
 	std::vector<uint8_t> encode_pop_reg(ZydisRegister reg, size_t& size);
 
 	std::vector<uint8_t> encode_mov_reg_mem(ZydisRegister reg, uintptr_t memory_address, size_t& size);
 
+	std::vector<uint8_t> encode_mov_reg_imm(ZydisRegister reg, uint64_t immediate, size_t& size);
+
+	std::vector<uint8_t> encode_mov_reg_ptr(ZydisRegister reg, ZydisRegister base, int64_t displacement, size_t& size);
+
+	std::vector<uint8_t> encode_mov_ptr_reg(ZydisRegister base, int64_t displacement, ZydisRegister reg, size_t& size);
+
+	std::vector<uint8_t> encode_branch(ZydisMnemonic mnemonic, uintptr_t target, uintptr_t runtime_address, ZydisBranchWidth width, size_t& size);
+
+	std::vector<uint8_t> encode_ret(size_t& size);
+
 	std::string encode_and_format(const ZydisEncoderRequest& req, size_t& size);
 
 	std::string to_string(const ZydisDecodedInstruction& instruction, const ZydisDecodedOperand operands[]);
@@ -0,0 +1,693 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <random>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <Windows.h>
+
+#include "lib/Zydis/Zydis.h"
+#include "HookLib/HookLib.h"
+#include "PatchSite/PatchSite.h"
+#include "PaddingIndex/PaddingIndex.h"
+#include "ControlFlowGraph/ControlFlowGraph.h"
+#include "SymbolIndex/SymbolIndex.h"
+#include "TrampolineBuilder/TrampolineBuilder.h"
+#include "TrampolineBuilder/RewriteRules/RewriteRules.h"
+#include "UnwindInfo/UnwindInfo.h"
+#include "StepExecutor/StepExecutor.h"
+
+static constexpr size_t cave_size = 0x1000;
+static constexpr size_t data_size = 0x4000;
+
+// The low part only takes the exception dispatch of every step, the compared part holds the frame
+static constexpr size_t stack_size = 0x10000;
+static constexpr size_t compared_stack_size = 0x4000;
+
+// CF, PF, AF, ZF, SF, DF, OF
+static constexpr DWORD compared_flags = 0xCD5;
+
+// Rule cases run their original at the start of a block with the referenced data one page in
+static constexpr size_t rule_block_size = 0x2000;
+static constexpr size_t rule_data_offset = 0x1000;
+static constexpr size_t rule_near_cave_offset = 0x100;
+
+// Modules loaded into the harness itself would have their globals overwritten, so the defaults are ones it never loads
+static const char* default_modules[] = {
+	"ws2_32.dll", "shell32.dll", "crypt32.dll", "wininet.dll", "winhttp.dll", "dbghelp.dll", "setupapi.dll", "d3d11.dll"
+};
+
+struct Region {
+	uintptr_t begin;
+	uintptr_t end;
+
+	bool contains(uintptr_t address) const {
+		return address >= begin && address < end;
+	}
+};
+
+struct Scratch {
+	uint8_t* data;
+	uint8_t* stack;
+
+	// Random contents both runs of a state start from
+	std::vector<uint8_t> data_image;
+	std::vector<uint8_t> stack_image;
+};
+
+struct ModuleResult {
+	std::string name;
+	uint64_t functions = 0;
+	uint64_t tested = 0;
+	uint64_t skipped = 0;
+	uint64_t mismatched = 0;
+};
+
+// One instruction with a RIP-relative operand, its displacement is filled in for wherever the case runs.
+// `expected` is hex with "imm64" for the absolute target and "disp32" for a displacement to it from the end of the field.
+struct RuleCase {
+	const char* rule;
+	std::vector<uint8_t> input;
+	const char* expected;
+
+	// Rewritten within rel32 of the target, every other case is rewritten more than 2 GB away from it
+	bool is_near;
+};
+
+static const std::vector<RuleCase> rule_cases = {
+	{ "reencode",		{ 0x48, 0x8B, 0x05, 0, 0, 0, 0 },								"48 8B 05 disp32", true },
+	{ "lea",			{ 0x48, 0x8D, 0x05, 0, 0, 0, 0 },								"48 B8 imm64", false },
+	{ "mov-load",		{ 0x8B, 0x0D, 0, 0, 0, 0 },										"48 B9 imm64 8B 09", false },
+	{ "movzx-load",		{ 0x0F, 0xB6, 0x15, 0, 0, 0, 0 },								"48 BA imm64 0F B6 12", false },
+	{ "movsx-load",		{ 0x48, 0x0F, 0xBF, 0x1D, 0, 0, 0, 0 },							"48 BB imm64 48 0F BF 1B", false },
+	{ "movsxd-load",	{ 0x48, 0x63, 0x35, 0, 0, 0, 0 },								"48 BE imm64 48 63 36", false },
+	{ "mov-store",		{ 0x48, 0x89, 0x05, 0, 0, 0, 0 },								"51 48 B9 imm64 48 89 01 59", false },
+	{ "mov-store-imm",	{ 0xC7, 0x05, 0, 0, 0, 0, 0x78, 0x56, 0x34, 0x12 },				"50 48 B8 imm64 C7 00 78 56 34 12 58", false },
+	{ "cmp-imm",		{ 0x83, 0x3D, 0, 0, 0, 0, 0x05 },								"50 48 B8 imm64 83 38 05 58", false },
+	{ "test-imm",		{ 0xF6, 0x05, 0, 0, 0, 0, 0x01 },								"50 48 B8 imm64 F6 00 01 58", false },
+	{ "vector-load",	{ 0x0F, 0x28, 0x05, 0, 0, 0, 0 },								"50 48 B8 imm64 0F 28 00 58", false },
+	{ "vector-store",	{ 0x0F, 0x29, 0x0D, 0, 0, 0, 0 },								"50 48 B8 imm64 0F 29 08 58", false },
+	{ "push-mem",		{ 0xFF, 0x35, 0, 0, 0, 0 },										"50 50 48 B8 imm64 48 8B 00 48 89 44 24 08 58", false },
+	{ "jmp-mem",		{ 0xFF, 0x25, 0, 0, 0, 0 },										"50 50 48 B8 imm64 48 8B 00 48 89 44 24 08 58 C3", false },
+	{ "call-mem",		{ 0xFF, 0x15, 0, 0, 0, 0 },										"E8 02 00 00 00 EB 16 50 50 48 B8 imm64 48 8B 00 48 89 44 24 08 58 C3", false },
+	{ "scratch-base",	{ 0x48, 0x03, 0x05, 0, 0, 0, 0 },								"51 48 B9 imm64 48 03 01 59", false },
+};
+
+// Memory the stolen bytes address RIP-relative, restored before and compared after every run
+struct TouchedMemory {
+	uintptr_t address;
+	size_t size;
+	std::vector<uint8_t> initial;
+};
+
+static bool is_unsafe(ZydisMnemonic mnemonic) {
+	switch (mnemonic) {
+	// Would really run with random arguments
+	case ZYDIS_MNEMONIC_SYSCALL:
+	case ZYDIS_MNEMONIC_SYSENTER:
+	case ZYDIS_MNEMONIC_INT:
+	case ZYDIS_MNEMONIC_INT1:
+	case ZYDIS_MNEMONIC_INT3:
+	case ZYDIS_MNEMONIC_INTO:
+	case ZYDIS_MNEMONIC_HLT:
+	case ZYDIS_MNEMONIC_UD0:
+	case ZYDIS_MNEMONIC_UD1:
+	case ZYDIS_MNEMONIC_UD2:
+	// Differ from one run to the next by design
+	case ZYDIS_MNEMONIC_RDTSC:
+	case ZYDIS_MNEMONIC_RDTSCP:
+	case ZYDIS_MNEMONIC_RDRAND:
+	case ZYDIS_MNEMONIC_RDSEED:
+	case ZYDIS_MNEMONIC_RDPID:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// False if the stolen bytes cannot be run with random state, collects their RIP-relative memory otherwise
+static bool inspect_stolen_bytes(void* function, size_t size, std::vector<TouchedMemory>& touched) {
+	ZydisDecoder decoder;
+	ZydisDecoderInit(&decoder, ZYDIS_MACHINE_MODE_LONG_64, ZYDIS_STACK_WIDTH_64);
+
+	ZydisDecodedInstruction instruction;
+	ZydisDecodedOperand operands[ZYDIS_MAX_OPERAND_COUNT];
+
+	const auto entry = reinterpret_cast<uintptr_t>(function);
+
+	for (size_t offset = 0; offset < size; offset += instruction.length) {
+		if (ZYAN_FAILED(ZydisDecoderDecodeFull(&decoder, reinterpret_cast<const void*>(entry + offset), size - offset, &instruction, operands))
+			|| is_unsafe(instruction.mnemonic)) {
+			return false;
+		}
+
+		for (size_t i = 0; i < instruction.operand_count_visible; i++) {
+			const auto& operand = operands[i];
+
+			if (operand.type != ZYDIS_OPERAND_TYPE_MEMORY || operand.mem.base != ZYDIS_REGISTER_RIP || operand.size == 0) {
+				continue;
+			}
+
+			ZyanU64 address = 0;
+			ZydisCalcAbsoluteAddress(&instruction, &operand, entry + offset, &address);
+
+			TouchedMemory memory = { static_cast<uintptr_t>(address), operand.size / 8u, { } };
+			memory.initial.assign(reinterpret_cast<const uint8_t*>(address), reinterpret_cast<const uint8_t*>(address) + memory.size);
+
+			touched.push_back(memory);
+		}
+	}
+
+	return true;
+}
+
+static void restore(const Scratch& scratch, const std::vector<TouchedMemory>& touched) {
+	std::memcpy(scratch.data, scratch.data_image.data(), data_size);
+	std::memcpy(scratch.stack + stack_size - compared_stack_size, scratch.stack_image.data(), compared_stack_size);
+
+	// Read-only memory never changes, so only writable memory ends up written here
+	for (const auto& memory : touched) {
+		if (std::memcmp(reinterpret_cast<const void*>(memory.address), memory.initial.data(), memory.size) != 0) {
+			std::memcpy(reinterpret_cast<void*>(memory.address), memory.initial.data(), memory.size);
+		}
+	}
+}
+
+static CONTEXT random_context(std::mt19937_64& random, const Scratch& scratch) {
+	CONTEXT context = { };
+
+	DWORD64* registers[] = {
+		&context.Rax, &context.Rcx, &context.Rdx, &context.Rbx, &context.Rbp, &context.Rsi, &context.Rdi,
+		&context.R8, &context.R9, &context.R10, &context.R11, &context.R12, &context.R13, &context.R14, &context.R15
+	};
+
+	// Half of the registers point into the data buffer so loads and stores through them land somewhere compared
+	for (const auto reg : registers) {
+		switch (random() % 4) {
+		case 0:
+		case 1:
+			*reg = reinterpret_cast<uintptr_t>(scratch.data) + data_size / 4 + ((random() % (data_size / 2)) & ~7ull);
+			break;
+		case 2:
+			*reg = random() % 256;
+			break;
+		default:
+			*reg = random();
+			break;
+		}
+	}
+
+	// rsp is 8 mod 16 at a function entry, there is room for pushes below and stack arguments above
+	const auto frame = reinterpret_cast<uintptr_t>(scratch.stack) + stack_size - compared_stack_size / 2;
+	context.Rsp = frame - (random() % 64) * 16 - 8;
+
+	// IF and the always-set bit 1, DF stays clear as the ABI requires
+	context.EFlags = 0x202 | (static_cast<DWORD>(random()) & (compared_flags & ~0x400));
+	context.MxCsr = 0x1F80;
+
+	for (size_t i = 0; i < 16; i++) {
+		context.FltSave.XmmRegisters[i].Low = random();
+		context.FltSave.XmmRegisters[i].High = static_cast<LONGLONG>(random());
+	}
+
+	return context;
+}
+
+// The trampoline pushes its own addresses where the original pushes return addresses into the stolen bytes
+static bool is_equivalent(uint64_t original, uint64_t rewritten, const Region& stolen, const Region& trampoline) {
+	return original == rewritten || (trampoline.contains(rewritten) && original >= stolen.begin && original <= stolen.end);
+}
+
+static bool compare(const ExecutionResult& original, const ExecutionResult& rewritten, const Region& stolen, const Region& trampoline, uintptr_t entry_rsp,
+	const std::vector<TouchedMemory>& original_touched, const std::vector<TouchedMemory>& rewritten_touched,
+	const std::vector<uint8_t>& original_data, const std::vector<uint8_t>& original_stack, const Scratch& scratch, std::string& difference) {
+	char buffer[256];
+
+	if (original.exit != rewritten.exit) {
+		std::snprintf(buffer, sizeof(buffer), "exit kind %d vs %d", (int)original.exit, (int)rewritten.exit);
+		difference = buffer;
+		return false;
+	}
+
+	// Spills may still be live at the fault, only what faulted has to match
+	if (original.exit == ExitKind::fault) {
+		if (original.exception_code != rewritten.exception_code || original.fault_address != rewritten.fault_address) {
+			std::snprintf(buffer, sizeof(buffer), "fault %08lx at %p vs %08lx at %p", original.exception_code, (void*)original.fault_address,
+				rewritten.exception_code, (void*)rewritten.fault_address);
+			difference = buffer;
+			return false;
+		}
+
+		return true;
+	}
+
+	if (original.exit == ExitKind::step_limit) {
+		return true;
+	}
+
+	const auto& a = original.context;
+	const auto& b = rewritten.context;
+
+	const std::pair<const char*, std::pair<DWORD64, DWORD64>> registers[] = {
+		{ "rip", { a.Rip, b.Rip } }, { "rax", { a.Rax, b.Rax } }, { "rcx", { a.Rcx, b.Rcx } }, { "rdx", { a.Rdx, b.Rdx } },
+		{ "rbx", { a.Rbx, b.Rbx } }, { "rsp", { a.Rsp, b.Rsp } }, { "rbp", { a.Rbp, b.Rbp } }, { "rsi", { a.Rsi, b.Rsi } },
+		{ "rdi", { a.Rdi, b.Rdi } }, { "r8", { a.R8, b.R8 } }, { "r9", { a.R9, b.R9 } }, { "r10", { a.R10, b.R10 } },
+		{ "r11", { a.R11, b.R11 } }, { "r12", { a.R12, b.R12 } }, { "r13", { a.R13, b.R13 } }, { "r14", { a.R14, b.R14 } },
+		{ "r15", { a.R15, b.R15 } }
+	};
+
+	for (const auto& [name, values] : registers) {
+		if (!is_equivalent(values.first, values.second, stolen, trampoline)) {
+			std::snprintf(buffer, sizeof(buffer), "%s %llx vs %llx", name, (unsigned long long)values.first, (unsigned long long)values.second);
+			difference = buffer;
+			return false;
+		}
+	}
+
+	if ((a.EFlags & compared_flags) != (b.EFlags & compared_flags) || a.MxCsr != b.MxCsr) {
+		std::snprintf(buffer, sizeof(buffer), "flags %lx vs %lx", a.EFlags & compared_flags, b.EFlags & compared_flags);
+		difference = buffer;
+		return false;
+	}
+
+	for (size_t i = 0; i < 16; i++) {
+		const auto& x = a.FltSave.XmmRegisters[i];
+		const auto& y = b.FltSave.XmmRegisters[i];
+
+		if (x.Low != y.Low || x.High != y.High) {
+			std::snprintf(buffer, sizeof(buffer), "xmm%zu differs", i);
+			difference = buffer;
+			return false;
+		}
+	}
+
+	if (std::memcmp(original_data.data(), scratch.data, data_size) != 0) {
+		difference = "data buffer differs";
+		return false;
+	}
+
+	// Below the final rsp there are only dead spills. Between it and the entry rsp, what neither run wrote is left over
+	// from the exception dispatch of the single steps.
+	const auto stack_begin = reinterpret_cast<uintptr_t>(scratch.stack);
+	const auto image_begin = stack_begin + stack_size - compared_stack_size;
+	const auto live_begin = std::max<uintptr_t>(a.Rsp & ~7ull, image_begin);
+
+	for (uintptr_t slot = live_begin; slot < stack_begin + stack_size; slot += sizeof(uint64_t)) {
+		bool is_written = slot >= entry_rsp;
+
+		for (uintptr_t byte = slot; byte < slot + sizeof(uint64_t) && !is_written; byte++) {
+			is_written = original.is_stack_written(byte - stack_begin) || rewritten.is_stack_written(byte - stack_begin);
+		}
+
+		if (!is_written) {
+			continue;
+		}
+
+		uint64_t x, y;
+		std::memcpy(&x, original_stack.data() + (slot - image_begin), sizeof(x));
+		std::memcpy(&y, reinterpret_cast<const void*>(slot), sizeof(y));
+
+		if (!is_equivalent(x, y, stolen, trampoline)) {
+			std::snprintf(buffer, sizeof(buffer), "stack at entry rsp%+lld: %llx vs %llx", (long long)slot - (long long)entry_rsp,
+				(unsigned long long)x, (unsigned long long)y);
+			difference = buffer;
+			return false;
+		}
+	}
+
+	for (size_t i = 0; i < original_touched.size(); i++) {
+		if (original_touched[i].initial != rewritten_touched[i].initial) {
+			std::snprintf(buffer, sizeof(buffer), "memory at %p differs", (void*)original_touched[i].address);
+			difference = buffer;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static std::vector<TouchedMemory> snapshot(const std::vector<TouchedMemory>& touched) {
+	auto result = touched;
+
+	for (auto& memory : result) {
+		memory.initial.assign(reinterpret_cast<const uint8_t*>(memory.address), reinterpret_cast<const uint8_t*>(memory.address) + memory.size);
+	}
+
+	return result;
+}
+
+// Runs the stolen bytes in place and the trampoline in its cave from the same states. Returns false on a mismatch.
+static bool test_function(void* function, size_t size, uint8_t* cave, size_t cave_used, const std::vector<TouchedMemory>& touched,
+	Scratch& scratch, uint64_t seed, uint32_t states, std::string& difference) {
+	const Region stolen = { reinterpret_cast<uintptr_t>(function), reinterpret_cast<uintptr_t>(function) + size };
+	const Region trampoline = { reinterpret_cast<uintptr_t>(cave), reinterpret_cast<uintptr_t>(cave) + cave_used };
+
+	std::mt19937_64 random(seed ^ reinterpret_cast<uintptr_t>(function));
+
+	std::vector<uint8_t> original_data(data_size);
+	std::vector<uint8_t> original_stack(compared_stack_size);
+
+	for (uint32_t state = 0; state < states; state++) {
+		auto context = random_context(random, scratch);
+		ExecutionResult original, rewritten;
+
+		restore(scratch, touched);
+		context.Rip = stolen.begin;
+
+		if (!StepExecutor::run(context, stolen.begin, stolen.end, original)) {
+			std::exit(2);
+		}
+
+		const auto original_touched = snapshot(touched);
+		std::memcpy(original_data.data(), scratch.data, data_size);
+		std::memcpy(original_stack.data(), scratch.stack + stack_size - compared_stack_size, compared_stack_size);
+
+		restore(scratch, touched);
+		context.Rip = trampoline.begin;
+
+		if (!StepExecutor::run(context, trampoline.begin, trampoline.end, rewritten)) {
+			std::exit(2);
+		}
+
+		const auto rewritten_touched = snapshot(touched);
+
+		if (!compare(original, rewritten, stolen, trampoline, context.Rsp, original_touched, rewritten_touched, original_data, original_stack, scratch, difference)) {
+			difference = "state " + std::to_string(state) + ": " + difference;
+			restore(scratch, touched);
+			return false;
+		}
+	}
+
+	restore(scratch, touched);
+
+	return true;
+}
+
+static std::vector<uint8_t> expand(const char* pattern, uintptr_t target, uintptr_t runtime_address) {
+	std::vector<uint8_t> bytes;
+	const std::string text = pattern;
+
+	for (size_t position = 0; position < text.size();) {
+		const auto end = std::min(text.find(' ', position), text.size());
+		const auto token = text.substr(position, end - position);
+
+		if (token == "imm64") {
+			bytes.insert(bytes.end(), reinterpret_cast<const uint8_t*>(&target), reinterpret_cast<const uint8_t*>(&target) + sizeof(target));
+		} else if (token == "disp32") {
+			const auto disp = static_cast<int32_t>(target - (runtime_address + bytes.size() + sizeof(int32_t)));
+			bytes.insert(bytes.end(), reinterpret_cast<const uint8_t*>(&disp), reinterpret_cast<const uint8_t*>(&disp) + sizeof(disp));
+		} else {
+			bytes.push_back(static_cast<uint8_t>(std::strtoul(token.c_str(), nullptr, 16)));
+		}
+
+		position = end + 1;
+	}
+
+	return bytes;
+}
+
+static std::string to_hex(const std::vector<uint8_t>& bytes) {
+	std::string text;
+	char buffer[4];
+
+	for (const auto value : bytes) {
+		std::snprintf(buffer, sizeof(buffer), "%02X ", value);
+		text += buffer;
+	}
+
+	return text;
+}
+
+// Block at least 8 GB above `address`, so nothing in it is within rel32 of `address` and its addresses need 64 bits
+static uint8_t* allocate_beyond(const void* address, size_t size) {
+	const auto granularity = SystemInfo::allocation_granularity();
+	auto candidate = (reinterpret_cast<uintptr_t>(address) + (8ull << 30)) & ~(uintptr_t)(granularity - 1);
+
+	for (int i = 0; i < 256; i++, candidate += 1ull << 30) {
+		const auto block = VirtualAlloc(reinterpret_cast<void*>(candidate), size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+
+		if (block != nullptr) {
+			return static_cast<uint8_t*>(block);
+		}
+	}
+
+	return nullptr;
+}
+
+// Every rewrite rule against its table entry: the rule RewriteRules picks, the exact bytes it emits, and the same
+// state after running the original instruction and the rewrite followed by a jump back
+static bool test_rules(Scratch& scratch, uint64_t seed, uint32_t states, ModuleResult& result) {
+	const auto far_cave = static_cast<uint8_t*>(VirtualAlloc(nullptr, cave_size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE));
+	const auto block = far_cave != nullptr ? allocate_beyond(far_cave, rule_block_size) : nullptr;
+
+	if (block == nullptr) {
+		std::printf("[error] failed to allocate the rule test blocks\n");
+		return false;
+	}
+
+	ZydisDecoder decoder;
+	ZydisDecoderInit(&decoder, ZYDIS_MACHINE_MODE_LONG_64, ZYDIS_STACK_WIDTH_64);
+
+	RewriteRules rewrite_rules;
+	std::mt19937_64 random(seed);
+
+	const auto original = block;
+	const auto target = reinterpret_cast<uintptr_t>(block) + rule_data_offset;
+
+	result.name = "rewrite_rules";
+	result.functions = rule_cases.size();
+
+	for (const auto& rule_case : rule_cases) {
+		const auto cave = rule_case.is_near ? block + rule_near_cave_offset : far_cave;
+
+		ZydisDecodedInstruction instruction;
+		ZydisDecodedOperand operands[ZYDIS_MAX_OPERAND_COUNT];
+
+		std::memcpy(original, rule_case.input.data(), rule_case.input.size());
+
+		if (ZYAN_FAILED(ZydisDecoderDecodeFull(&decoder, original, rule_case.input.size(), &instruction, operands))) {
+			std::printf("[mismatch] rule %s: input does not decode\n", rule_case.rule);
+			result.mismatched++;
+			continue;
+		}
+
+		result.tested++;
+
+		const auto disp = static_cast<int32_t>(target - (reinterpret_cast<uintptr_t>(original) + instruction.length));
+		std::memcpy(original + instruction.raw.disp.offset, &disp, sizeof(disp));
+		ZydisDecoderDecodeFull(&decoder, original, instruction.length, &instruction, operands);
+
+		std::vector<uint8_t> bytes;
+		const AnnotatedInstruction annotated(reinterpret_cast<uintptr_t>(original), instruction, operands);
+		const auto rule = rewrite_rules.rewrite(annotated, reinterpret_cast<uintptr_t>(cave), bytes);
+
+		if (rule == nullptr || std::strcmp(rule->name, rule_case.rule) != 0) {
+			std::printf("[mismatch] rule %s: got %s\n", rule_case.rule, rule != nullptr ? rule->name : "no rule");
+			result.mismatched++;
+			continue;
+		}
+
+		const auto expected = expand(rule_case.expected, target, reinterpret_cast<uintptr_t>(cave));
+
+		if (bytes != expected) {
+			std::printf("[mismatch] rule %s: emitted %sexpected %s\n", rule_case.rule, to_hex(bytes).c_str(), to_hex(expected).c_str());
+			result.mismatched++;
+			continue;
+		}
+
+		// jmp qword ptr [rip] back behind the original, like the trampoline's jump back
+		const auto jump_back = reinterpret_cast<uintptr_t>(original) + instruction.length;
+		const uint8_t jump[] = { 0xFF, 0x25, 0, 0, 0, 0 };
+
+		std::memcpy(cave, bytes.data(), bytes.size());
+		std::memcpy(cave + bytes.size(), jump, sizeof(jump));
+		std::memcpy(cave + bytes.size() + sizeof(jump), &jump_back, sizeof(jump_back));
+
+		FlushInstructionCache(GetCurrentProcess(), block, rule_block_size);
+		FlushInstructionCache(GetCurrentProcess(), far_cave, cave_size);
+
+		// Random contents for loads and stores, a branch through it lands outside both regions
+		TouchedMemory memory = { target, 16, std::vector<uint8_t>(16) };
+
+		for (auto& value : memory.initial) {
+			value = static_cast<uint8_t>(random());
+		}
+
+		if (instruction.mnemonic == ZYDIS_MNEMONIC_JMP || instruction.mnemonic == ZYDIS_MNEMONIC_CALL) {
+			const auto branch_target = target + 0x800;
+			std::memcpy(memory.initial.data(), &branch_target, sizeof(branch_target));
+		}
+
+		std::string difference;
+
+		if (!test_function(original, instruction.length, cave, bytes.size() + sizeof(jump) + sizeof(jump_back), { memory }, scratch, seed, states,
+			difference)) {
+			std::printf("[mismatch] rule %s: %s\n", rule_case.rule, difference.c_str());
+			result.mismatched++;
+		}
+	}
+
+	VirtualFree(block, 0, MEM_RELEASE);
+	VirtualFree(far_cave, 0, MEM_RELEASE);
+
+	return true;
+}
+
+static bool test_module(const std::string& name, Scratch& scratch, uint64_t seed, uint32_t states, ModuleResult& result) {
+	if (GetModuleHandleA(name.c_str()) != nullptr) {
+		std::printf("[error] %s is loaded into the harness, its globals are not ours to overwrite\n", name.c_str());
+		return false;
+	}
+
+	char directory[MAX_PATH] = { 0 };
+	GetSystemDirectoryA(directory, MAX_PATH);
+
+	// Mapped as an image without running its entry point or loading its imports
+	const auto module = LoadLibraryExA((std::string(directory) + "\\" + name).c_str(), nullptr, DONT_RESOLVE_DLL_REFERENCES);
+
+	if (module == nullptr) {
+		std::printf("[error] failed to load %s\n", name.c_str());
+		return false;
+	}
+
+	auto cave = static_cast<uint8_t*>(HookLib::allocate_around_2gb(module, cave_size));
+
+	if (cave == nullptr) {
+		cave = static_cast<uint8_t*>(VirtualAlloc(nullptr, cave_size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE));
+	}
+
+	if (cave == nullptr) {
+		std::printf("[error] failed to allocate a cave for %s\n", name.c_str());
+		return false;
+	}
+
+	const auto functions = HookLib::enumerate_functions(module);
+
+	result.name = name;
+	result.functions = functions.size();
+
+	for (const auto function : functions) {
+		const auto plan = PatchSite::plan(function, (uintptr_t)cave, (uintptr_t)cave + cave_size);
+		const auto size = HookLib::compute_hook_size(function, plan.entry_size);
+		const auto padding = PaddingIndex::lookup(function);
+
+		std::vector<TouchedMemory> touched;
+
+		// Only what HookLib would actually hook
+		if (size < plan.entry_size || (uintptr_t)function + size > padding.end
+			|| ControlFlowGraph::build((uintptr_t)function, padding.end).find_inbound_target((uintptr_t)function + 1, (uintptr_t)function + size) != 0
+			|| !inspect_stolen_bytes(function, size, touched)) {
+			result.skipped++;
+			continue;
+		}
+
+		TrampolineBuilder trampoline_builder(function, size, cave, cave_size);
+
+		// The jump to the hook is never taken, the trampoline is entered directly
+		if (!trampoline_builder.build(cave)) {
+			result.skipped++;
+			continue;
+		}
+
+		FlushInstructionCache(GetCurrentProcess(), cave, cave_size);
+
+		std::string difference;
+
+		if (!test_function(function, size, cave, trampoline_builder.get_used_size(), touched, scratch, seed, states, difference)) {
+			std::printf("[mismatch] %s: %s\n", SymbolIndex::name_of(function).c_str(), difference.c_str());
+			result.mismatched++;
+		}
+
+		UnwindInfo::unregister(trampoline_builder.get_unwind_table());
+		result.tested++;
+	}
+
+	VirtualFree(cave, 0, MEM_RELEASE);
+
+	return true;
+}
+
+// differential_test [--seed <n>] [--states <n>] [module...]
+// Checks every rewrite rule against its table entry first. Then runs the stolen bytes of every hookable function in the given System32 DLLs and the trampoline built for them
+// from the same random register, flag, stack and memory states, one instruction at a time, and compares where
+// each leaves off. Prints every mismatch, then one CSV row per module. Exits with 1 if anything mismatched.
+int main(int argc, char** argv) {
+	uint64_t seed = 1;
+	uint32_t states = 16;
+	std::vector<std::string> modules;
+
+	for (int i = 1; i < argc; i++) {
+		if (std::strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+			seed = std::strtoull(argv[++i], nullptr, 0);
+		} else if (std::strcmp(argv[i], "--states") == 0 && i + 1 < argc) {
+			states = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 0));
+		} else {
+			modules.push_back(argv[i]);
+		}
+	}
+
+	if (modules.empty()) {
+		modules.assign(std::begin(default_modules), std::end(default_modules));
+	}
+
+	Scratch scratch;
+	scratch.data = static_cast<uint8_t*>(VirtualAlloc(nullptr, data_size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+	scratch.stack = static_cast<uint8_t*>(VirtualAlloc(nullptr, stack_size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+
+	if (scratch.data == nullptr || scratch.stack == nullptr) {
+		std::printf("[error] failed to allocate the scratch buffers\n");
+		return 2;
+	}
+
+	std::mt19937_64 random(seed);
+
+	for (auto* image : { &scratch.data_image, &scratch.stack_image }) {
+		image->resize(image == &scratch.data_image ? data_size : compared_stack_size);
+
+		for (auto& value : *image) {
+			value = static_cast<uint8_t>(random());
+		}
+	}
+
+	if (!StepExecutor::start(reinterpret_cast<uintptr_t>(scratch.stack), reinterpret_cast<uintptr_t>(scratch.stack) + stack_size)) {
+		return 2;
+	}
+
+	std::vector<ModuleResult> results;
+	ModuleResult rule_result;
+
+	if (test_rules(scratch, seed, states, rule_result)) {
+		results.push_back(rule_result);
+	}
+
+	for (const auto& name : modules) {
+		ModuleResult result;
+
+		if (test_module(name, scratch, seed, states, result)) {
+			results.push_back(result);
+		}
+	}
+
+	ModuleResult total;
+	total.name = "total";
+
+	for (const auto& result : results) {
+		total.functions += result.functions;
+		total.tested += result.tested;
+		total.skipped += result.skipped;
+		total.mismatched += result.mismatched;
+	}
+
+	results.push_back(total);
+
+	std::printf("module,functions,tested,skipped,mismatched\n");
+
+	for (const auto& result : results) {
+		std::printf("%s,%llu,%llu,%llu,%llu\n", result.name.c_str(), (unsigned long long)result.functions, (unsigned long long)result.tested,
+			(unsigned long long)result.skipped, (unsigned long long)result.mismatched);
+	}
+
+	return total.mismatched != 0 ? 1 : 0;
+}
\ No newline at end of file
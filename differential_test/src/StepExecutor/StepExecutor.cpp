@@ -0,0 +1,201 @@
+#include <cstdio>
+
+#include "StepExecutor.h"
+
+uintptr_t StepExecutor::stack_begin = 0;
+uintptr_t StepExecutor::stack_end = 0;
+
+HANDLE StepExecutor::job_ready = nullptr;
+HANDLE StepExecutor::job_done = nullptr;
+DWORD StepExecutor::worker_id = 0;
+
+ZydisDecoder StepExecutor::decoder;
+ZydisRegisterContext StepExecutor::registers;
+
+CONTEXT StepExecutor::job_context;
+uintptr_t StepExecutor::job_begin = 0;
+uintptr_t StepExecutor::job_end = 0;
+ExecutionResult* StepExecutor::job_result = nullptr;
+bool StepExecutor::is_running = false;
+
+bool StepExecutor::start(uintptr_t scratch_begin, uintptr_t scratch_end) {
+	job_ready = CreateEventA(nullptr, FALSE, FALSE, nullptr);
+	job_done = CreateEventA(nullptr, FALSE, FALSE, nullptr);
+
+	if (job_ready == nullptr || job_done == nullptr) {
+		std::printf("[error] failed to create the executor events\n");
+		return false;
+	}
+
+	stack_begin = scratch_begin;
+	stack_end = scratch_end;
+
+	ZydisDecoderInit(&decoder, ZYDIS_MACHINE_MODE_LONG_64, ZYDIS_STACK_WIDTH_64);
+
+	AddVectoredExceptionHandler(1, &handle_exception);
+
+	if (CreateThread(nullptr, 0, &worker_main, nullptr, 0, &worker_id) == nullptr) {
+		std::printf("[error] failed to create the executor thread\n");
+		return false;
+	}
+
+	// Parked in the handler once its first breakpoint came in
+	return WaitForSingleObject(job_done, run_timeout) == WAIT_OBJECT_0;
+}
+
+bool StepExecutor::run(const CONTEXT& context, uintptr_t region_begin, uintptr_t region_end, ExecutionResult& result) {
+	job_context = context;
+	job_begin = region_begin;
+	job_end = region_end;
+	job_result = &result;
+
+	// Set up here, the handler must not allocate while it runs on the scratch stack
+	result.exit = ExitKind::step_limit;
+	result.exception_code = 0;
+	result.fault_address = 0;
+	result.steps = 0;
+	result.stack_writes.assign((stack_end - stack_begin + 7) / 8, 0);
+
+	SetEvent(job_ready);
+
+	if (WaitForSingleObject(job_done, run_timeout) != WAIT_OBJECT_0) {
+		std::printf("[error] executor did not come back from %p\n", (void*)region_begin);
+		return false;
+	}
+
+	return true;
+}
+
+DWORD WINAPI StepExecutor::worker_main(void* parameter) {
+	// The code under test runs on the scratch stack, so that is the stack as far as the TEB is concerned
+	const auto tib = reinterpret_cast<NT_TIB*>(NtCurrentTeb());
+	tib->StackLimit = reinterpret_cast<void*>(stack_begin);
+	tib->StackBase = reinterpret_cast<void*>(stack_end);
+
+	__debugbreak();
+
+	return 0;
+}
+
+LONG CALLBACK StepExecutor::handle_exception(PEXCEPTION_POINTERS pointers) {
+	if (GetCurrentThreadId() != worker_id) {
+		return EXCEPTION_CONTINUE_SEARCH;
+	}
+
+	const auto record = pointers->ExceptionRecord;
+	const auto context = pointers->ContextRecord;
+
+	if (is_running) {
+		auto& result = *job_result;
+		result.steps++;
+
+		if (record->ExceptionCode == EXCEPTION_SINGLE_STEP) {
+			const bool is_inside = context->Rip >= job_begin && context->Rip < job_end;
+
+			if (is_inside && result.steps < max_steps) {
+				record_writes(*context);
+				context->EFlags |= trap_flag;
+				return EXCEPTION_CONTINUE_EXECUTION;
+			}
+
+			result.exit = is_inside ? ExitKind::step_limit : ExitKind::left_region;
+		} else {
+			result.exit = ExitKind::fault;
+			result.exception_code = record->ExceptionCode;
+
+			if (record->ExceptionCode == EXCEPTION_ACCESS_VIOLATION && record->NumberParameters >= 2) {
+				result.fault_address = record->ExceptionInformation[1];
+			}
+		}
+
+		result.context = *context;
+		result.context.EFlags &= ~trap_flag;
+		is_running = false;
+	}
+
+	SetEvent(job_done);
+	WaitForSingleObject(job_ready, INFINITE);
+
+	load_context(*context, job_context);
+	record_writes(*context);
+	context->EFlags |= trap_flag;
+	is_running = true;
+
+	return EXCEPTION_CONTINUE_EXECUTION;
+}
+
+void StepExecutor::load_context(CONTEXT& to, const CONTEXT& from) {
+	to.Rax = from.Rax;
+	to.Rcx = from.Rcx;
+	to.Rdx = from.Rdx;
+	to.Rbx = from.Rbx;
+	to.Rsp = from.Rsp;
+	to.Rbp = from.Rbp;
+	to.Rsi = from.Rsi;
+	to.Rdi = from.Rdi;
+	to.R8 = from.R8;
+	to.R9 = from.R9;
+	to.R10 = from.R10;
+	to.R11 = from.R11;
+	to.R12 = from.R12;
+	to.R13 = from.R13;
+	to.R14 = from.R14;
+	to.R15 = from.R15;
+	to.Rip = from.Rip;
+	to.EFlags = from.EFlags;
+	to.MxCsr = from.MxCsr;
+
+	for (size_t i = 0; i < 16; i++) {
+		to.FltSave.XmmRegisters[i] = from.FltSave.XmmRegisters[i];
+	}
+
+	to.FltSave.MxCsr = from.MxCsr;
+}
+
+void StepExecutor::record_writes(const CONTEXT& context) {
+	ZydisDecodedInstruction instruction;
+	ZydisDecodedOperand operands[ZYDIS_MAX_OPERAND_COUNT];
+
+	if (ZYAN_FAILED(ZydisDecoderDecodeFull(&decoder, reinterpret_cast<const void*>(context.Rip), ZYDIS_MAX_INSTRUCTION_LENGTH, &instruction, operands))) {
+		return;
+	}
+
+	const std::pair<ZydisRegister, DWORD64> values[] = {
+		{ ZYDIS_REGISTER_RAX, context.Rax }, { ZYDIS_REGISTER_RCX, context.Rcx }, { ZYDIS_REGISTER_RDX, context.Rdx },
+		{ ZYDIS_REGISTER_RBX, context.Rbx }, { ZYDIS_REGISTER_RSP, context.Rsp }, { ZYDIS_REGISTER_RBP, context.Rbp },
+		{ ZYDIS_REGISTER_RSI, context.Rsi }, { ZYDIS_REGISTER_RDI, context.Rdi }, { ZYDIS_REGISTER_R8, context.R8 },
+		{ ZYDIS_REGISTER_R9, context.R9 }, { ZYDIS_REGISTER_R10, context.R10 }, { ZYDIS_REGISTER_R11, context.R11 },
+		{ ZYDIS_REGISTER_R12, context.R12 }, { ZYDIS_REGISTER_R13, context.R13 }, { ZYDIS_REGISTER_R14, context.R14 },
+		{ ZYDIS_REGISTER_R15, context.R15 }, { ZYDIS_REGISTER_RIP, context.Rip }
+	};
+
+	for (const auto& [reg, value] : values) {
+		registers.values[reg] = value;
+	}
+
+	for (size_t i = 0; i < instruction.operand_count; i++) {
+		const auto& operand = operands[i];
+
+		if (operand.type != ZYDIS_OPERAND_TYPE_MEMORY || !(operand.actions & ZYDIS_OPERAND_ACTION_MASK_WRITE)) {
+			continue;
+		}
+
+		ZyanU64 address = 0;
+		const auto size = static_cast<uintptr_t>(operand.size / 8);
+
+		// push, call and pushfq store below the current rsp
+		if (operand.visibility == ZYDIS_OPERAND_VISIBILITY_HIDDEN && operand.mem.base == ZYDIS_REGISTER_RSP) {
+			address = context.Rsp - size;
+		} else if (ZYAN_FAILED(ZydisCalcAbsoluteAddressEx(&instruction, &operand, context.Rip, &registers, &address))) {
+			continue;
+		}
+
+		// rep stos and friends trap after every element, so each one is marked on its own
+		for (uintptr_t byte = address; byte < address + size; byte++) {
+			if (byte >= stack_begin && byte < stack_end) {
+				const auto offset = byte - stack_begin;
+				job_result->stack_writes[offset / 8] |= static_cast<uint8_t>(1 << (offset % 8));
+			}
+		}
+	}
+}
\ No newline at end of file
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <Windows.h>
+#include <cstdint>
+#include <vector>
+
+#include "lib/Zydis/Zydis.h"
+
+enum class ExitKind {
+	// Execution reached an address outside the region, `context.Rip` is that address
+	left_region,
+	fault,
+	step_limit
+};
+
+struct ExecutionResult {
+	CONTEXT context;
+	ExitKind exit;
+	DWORD exception_code;
+
+	// Data address of an access violation
+	uintptr_t fault_address;
+	uint32_t steps;
+
+	// One bit per byte of the scratch stack the code wrote to. Everything else below the entry rsp holds
+	// leftovers of the exception dispatch for the single steps, which differ from run to run.
+	std::vector<uint8_t> stack_writes;
+
+	bool is_stack_written(uintptr_t offset) const {
+		return (stack_writes[offset / 8] >> (offset % 8)) & 1;
+	}
+};
+
+// Runs code one instruction at a time on a worker thread until it leaves a given region. The worker never returns
+// from its vectored handler: every run is a context it continues into, every trap brings it back.
+class StepExecutor {
+private:
+	static constexpr uint32_t max_steps = 4096;
+	static constexpr DWORD run_timeout = 5000;
+
+	// EFLAGS.TF
+	static constexpr DWORD trap_flag = 0x100;
+
+	static uintptr_t stack_begin;
+	static uintptr_t stack_end;
+
+	static HANDLE job_ready;
+	static HANDLE job_done;
+	static DWORD worker_id;
+
+	static ZydisDecoder decoder;
+	static ZydisRegisterContext registers;
+
+	static CONTEXT job_context;
+	static uintptr_t job_begin;
+	static uintptr_t job_end;
+	static ExecutionResult* job_result;
+	static bool is_running;
+
+public:
+	// Code runs on [scratch_begin, scratch_end), the exception dispatch for every step lands below its rsp there as well
+	static bool start(uintptr_t scratch_begin, uintptr_t scratch_end);
+
+	// Only general purpose registers, flags, MXCSR and xmm0-15 are taken from `context`
+	static bool run(const CONTEXT& context, uintptr_t region_begin, uintptr_t region_end, ExecutionResult& result);
+
+private:
+	static DWORD WINAPI worker_main(void* parameter);
+
+	static LONG CALLBACK handle_exception(PEXCEPTION_POINTERS pointers);
+
+	static void load_context(CONTEXT& to, const CONTEXT& from);
+
+	// Marks the stack bytes the instruction at rip is about to write
+	static void record_writes(const CONTEXT& context);
+};
\ No newline at end of file
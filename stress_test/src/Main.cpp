@@ -0,0 +1,390 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <intrin.h>
+#include <Windows.h>
+
+#include "HookLib/HookLib.h"
+#include "SystemInfo/SystemInfo.h"
+#include "LatencyHistogram/LatencyHistogram.h"
+
+using generated_function = int(*)(int value);
+
+// Every generated function returns value + index and sits in the middle of a slot of int3 padding
+static constexpr size_t function_slot_size = 64;
+
+// Picked by function index, each puts something else into the bytes a hook steals
+enum FunctionShape : size_t {
+	plain_shape,			// mov eax, imm32; add eax, ecx; ret
+	call_shape,				// sub rsp, 28h; call [rip+callee]; add rsp, 28h; add eax, imm32; ret
+	rip_relative_shape,		// mov eax, [rip+index]; add eax, ecx; ret
+	two_byte_shape,			// mov eax, ecx; add eax, imm32; ret - a short hop steals exactly the first instruction
+	shape_count
+};
+
+// One caller blocks in the callee of call-shaped functions every this many calls, for longer than RetiredCode's
+// 100 ms grace period. The trampoline it will return into may be retired meanwhile.
+static constexpr uint64_t block_interval = 256;
+static constexpr DWORD block_ms = 150;
+
+// Every caller times one call out of this many
+static constexpr uint64_t sample_interval = 16;
+
+struct Options {
+	uint64_t seed = 1;
+	double duration = 10.0;
+	size_t functions = 64;
+	size_t callers = 0;
+	size_t mutators = 1;
+};
+
+struct Counters {
+	std::atomic<uint64_t> calls{ 0 };
+	std::atomic<uint64_t> wrong_results{ 0 };
+
+	// Detour entered before apply_hook_x64 returned the trampoline
+	std::atomic<uint64_t> early_entries{ 0 };
+
+	std::atomic<uint64_t> faults{ 0 };
+	std::atomic<uint64_t> applied{ 0 };
+	std::atomic<uint64_t> removed{ 0 };
+	std::atomic<uint64_t> toggled{ 0 };
+	std::atomic<uint64_t> failed_applies{ 0 };
+};
+
+static uint8_t* code = nullptr;
+
+// Behind the function slots: the callee pointer of call-shaped functions, then one index per function
+static uint8_t* data = nullptr;
+static std::vector<std::atomic<generated_function>> originals;
+
+// Keeps `originals` in step with the hook of its function, HookLib calls on different functions still overlap
+static std::vector<std::mutex> function_mutexes;
+static Counters counters;
+
+static std::atomic<bool> is_stopping{ false };
+static std::atomic<uint32_t> latency_id{ UINT32_MAX };
+
+static thread_local bool is_caller = false;
+static thread_local bool is_blocking_caller = false;
+static thread_local size_t current_index = 0;
+static thread_local uint64_t callee_calls = 0;
+
+static void* function_at(size_t index) {
+	return code + index * function_slot_size + function_slot_size / 2;
+}
+
+static int blocking_callee(int value) {
+	if (is_blocking_caller && ++callee_calls % block_interval == 0) {
+		Sleep(block_ms);
+	}
+
+	return value;
+}
+
+static bool generate_functions(size_t count) {
+	const auto code_size = count * function_slot_size;
+	const auto data_size = sizeof(void*) + count * sizeof(uint32_t);
+
+	code = static_cast<uint8_t*>(VirtualAlloc(nullptr, code_size + data_size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE));
+
+	if (code == nullptr) {
+		return false;
+	}
+
+	data = code + code_size;
+	std::memset(code, 0xCC, code_size);
+
+	const auto callee = reinterpret_cast<uintptr_t>(&blocking_callee);
+	std::memcpy(data, &callee, sizeof(callee));
+
+	for (size_t i = 0; i < count; i++) {
+		const auto entry = static_cast<uint8_t*>(function_at(i));
+		const auto value = static_cast<uint32_t>(i);
+		const auto index_slot = data + sizeof(void*) + i * sizeof(uint32_t);
+
+		std::memcpy(index_slot, &value, sizeof(value));
+
+		std::vector<uint8_t> bytes;
+
+		const auto emit = [&](std::initializer_list<uint8_t> values) {
+			bytes.insert(bytes.end(), values);
+		};
+
+		const auto emit_u32 = [&](uint32_t value) {
+			const auto raw = reinterpret_cast<const uint8_t*>(&value);
+			bytes.insert(bytes.end(), raw, raw + sizeof(value));
+		};
+
+		// disp32 of a RIP-relative operand ending right after it
+		const auto emit_disp = [&](const uint8_t* target) {
+			emit_u32(static_cast<uint32_t>(target - (entry + bytes.size() + sizeof(uint32_t))));
+		};
+
+		switch (i % shape_count) {
+		case plain_shape:
+			emit({ 0xB8 });
+			emit_u32(value);
+			emit({ 0x01, 0xC8, 0xC3 });
+			break;
+		case call_shape:
+			emit({ 0x48, 0x83, 0xEC, 0x28 });
+			emit({ 0xFF, 0x15 });
+			emit_disp(data);
+			emit({ 0x48, 0x83, 0xC4, 0x28 });
+			emit({ 0x05 });
+			emit_u32(value);
+			emit({ 0xC3 });
+			break;
+		case rip_relative_shape:
+			emit({ 0x8B, 0x05 });
+			emit_disp(index_slot);
+			emit({ 0x01, 0xC8, 0xC3 });
+			break;
+		case two_byte_shape:
+			emit({ 0x89, 0xC8, 0x05 });
+			emit_u32(value);
+			emit({ 0xC3 });
+			break;
+		}
+
+		std::memcpy(entry, bytes.data(), bytes.size());
+	}
+
+	FlushInstructionCache(GetCurrentProcess(), code, code_size);
+
+	return true;
+}
+
+// Passes through to the trampoline like a real hook would, which is what makes removal racy
+static int stress_detour(int value) {
+	const auto original = originals[current_index].load(std::memory_order_acquire);
+
+	if (original == nullptr) {
+		counters.early_entries.fetch_add(1, std::memory_order_relaxed);
+		return value + static_cast<int>(current_index);
+	}
+
+	return original(value);
+}
+
+static void caller_fault_exit() {
+	ExitThread(1);
+}
+
+// A caller that faults is counted and its thread ends, everything else is not ours to handle
+static LONG CALLBACK handle_exception(PEXCEPTION_POINTERS pointers) {
+	const auto code = pointers->ExceptionRecord->ExceptionCode;
+
+	if (!is_caller || (code != EXCEPTION_ACCESS_VIOLATION && code != EXCEPTION_ILLEGAL_INSTRUCTION && code != EXCEPTION_PRIV_INSTRUCTION)) {
+		return EXCEPTION_CONTINUE_SEARCH;
+	}
+
+	std::printf("[error] caller fault %08lx at %p\n", code, pointers->ExceptionRecord->ExceptionAddress);
+	counters.faults.fetch_add(1, std::memory_order_relaxed);
+
+	const auto context = pointers->ContextRecord;
+	context->Rsp = (context->Rsp & ~0xFull) - 8;
+	context->Rip = reinterpret_cast<DWORD64>(&caller_fault_exit);
+
+	return EXCEPTION_CONTINUE_EXECUTION;
+}
+
+static void caller_main(size_t thread_index, const Options& options) {
+	is_caller = true;
+	is_blocking_caller = thread_index == 0;
+
+	std::mt19937_64 random(options.seed * 0x9E3779B97F4A7C15ull + thread_index);
+	uint64_t calls = 0;
+
+	while (!is_stopping.load(std::memory_order_relaxed)) {
+		const auto index = random() % options.functions;
+		const auto value = static_cast<int>(random() % 1000);
+		const auto function = reinterpret_cast<generated_function>(function_at(index));
+
+		current_index = index;
+
+		int result;
+
+		if (calls % sample_interval == 0) {
+			const auto begin = __rdtsc();
+			result = function(value);
+			LatencyHistogram::record(latency_id.load(std::memory_order_relaxed), LatencyKind::original, __rdtsc() - begin);
+		} else {
+			result = function(value);
+		}
+
+		if (result != value + static_cast<int>(index)) {
+			counters.wrong_results.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		calls++;
+	}
+
+	counters.calls.fetch_add(calls, std::memory_order_relaxed);
+}
+
+static void mutator_main(size_t thread_index, const Options& options) {
+	// One instance per mutator, they all share the process-wide hook registry
+	auto hook_lib = HookLib();
+	std::mt19937_64 random(options.seed * 0xC2B2AE3D27D4EB4Full + thread_index);
+
+	while (!is_stopping.load(std::memory_order_relaxed)) {
+		const auto index = random() % options.functions;
+		const auto function = function_at(index);
+		const auto operation = random() % 2;
+
+		std::lock_guard<std::mutex> lock(function_mutexes[index]);
+
+		if (originals[index].load(std::memory_order_relaxed) == nullptr) {
+			const auto trampoline = hook_lib.apply_hook_x64<generated_function>(function, &stress_detour);
+
+			if (trampoline == nullptr) {
+				counters.failed_applies.fetch_add(1, std::memory_order_relaxed);
+				continue;
+			}
+
+			originals[index].store(trampoline, std::memory_order_release);
+			counters.applied.fetch_add(1, std::memory_order_relaxed);
+		} else if (operation == 0) {
+			hook_lib.remove_hook(function);
+			originals[index].store(nullptr, std::memory_order_release);
+			counters.removed.fetch_add(1, std::memory_order_relaxed);
+		} else {
+			// Off and straight back on, the window callers see the unhooked function in is as short as it gets
+			hook_lib.remove_hook(function);
+			originals[index].store(nullptr, std::memory_order_release);
+
+			const auto trampoline = hook_lib.apply_hook_x64<generated_function>(function, &stress_detour);
+
+			if (trampoline == nullptr) {
+				counters.failed_applies.fetch_add(1, std::memory_order_relaxed);
+				continue;
+			}
+
+			originals[index].store(trampoline, std::memory_order_release);
+			counters.toggled.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+}
+
+// Runs the callers (and the mutators if any) for `seconds`, returns the calls made
+static uint64_t run_phase(const Options& options, double seconds, size_t mutator_count) {
+	is_stopping = false;
+	counters.calls = 0;
+
+	std::vector<std::thread> threads;
+
+	for (size_t i = 0; i < options.callers; i++) {
+		threads.emplace_back(caller_main, i, std::cref(options));
+	}
+
+	for (size_t i = 0; i < mutator_count; i++) {
+		threads.emplace_back(mutator_main, i, std::cref(options));
+	}
+
+	std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+	is_stopping = true;
+
+	for (auto& thread : threads) {
+		thread.join();
+	}
+
+	return counters.calls;
+}
+
+static void print_phase(const char* name, uint64_t calls, double seconds, uint32_t id) {
+	const auto summary = LatencyHistogram::summarize(id, LatencyKind::original);
+
+	std::printf("%s,%llu,%.0f,%.1f,%.1f,%.1f,%.1f\n", name, (unsigned long long)calls, calls / seconds,
+		summary.p50, summary.p99, summary.p999, summary.max);
+}
+
+// stress_test [--duration <seconds>] [--seed <n>] [--functions <n>] [--callers <n>] [--mutators <n>]
+// Callers (2x cores by default) call generated functions nonstop, first on their own for a quarter of the
+// duration as the baseline, then while the mutators apply, remove and toggle hooks on the same functions.
+// The functions come in four shapes, with a call, a RIP-relative load or a 2-byte instruction among the
+// stolen bytes, and the first caller keeps blocking inside the call past the trampolines' grace period.
+// Prints throughput and sampled call latency of both phases, then the mutation and fault counts as CSV.
+// Exits with 1 if a caller faulted or got a wrong result.
+int main(int argc, char** argv) {
+	Options options;
+	options.callers = 2 * std::max(1u, std::thread::hardware_concurrency());
+
+	for (int i = 1; i + 1 < argc; i += 2) {
+		if (std::strcmp(argv[i], "--duration") == 0) {
+			options.duration = std::strtod(argv[i + 1], nullptr);
+		} else if (std::strcmp(argv[i], "--seed") == 0) {
+			options.seed = std::strtoull(argv[i + 1], nullptr, 0);
+		} else if (std::strcmp(argv[i], "--functions") == 0) {
+			options.functions = std::max<size_t>(1, std::strtoull(argv[i + 1], nullptr, 0));
+		} else if (std::strcmp(argv[i], "--callers") == 0) {
+			options.callers = std::strtoull(argv[i + 1], nullptr, 0);
+		} else if (std::strcmp(argv[i], "--mutators") == 0) {
+			options.mutators = std::strtoull(argv[i + 1], nullptr, 0);
+		} else {
+			std::printf("[error] unknown option %s\n", argv[i]);
+			return 2;
+		}
+	}
+
+	if (!generate_functions(options.functions)) {
+		std::printf("[error] failed to allocate the generated functions\n");
+		return 2;
+	}
+
+	originals = std::vector<std::atomic<generated_function>>(options.functions);
+	function_mutexes = std::vector<std::mutex>(options.functions);
+
+	// Every phase starts its own callers, the churn callers take over the shards of the baseline ones
+	if (!LatencyHistogram::configure(2, options.callers + 1)) {
+		return 2;
+	}
+
+	const auto baseline_id = LatencyHistogram::allocate();
+	const auto churn_id = LatencyHistogram::allocate();
+
+	SystemInfo::tsc_frequency();
+	AddVectoredExceptionHandler(1, &handle_exception);
+
+	const auto baseline_seconds = options.duration / 4;
+
+	latency_id = baseline_id;
+	const auto baseline_calls = run_phase(options, baseline_seconds, 0);
+
+	latency_id = churn_id;
+	const auto churn_calls = run_phase(options, options.duration, options.mutators);
+
+	auto hook_lib = HookLib();
+
+	std::vector<void*> functions(options.functions);
+
+	for (size_t i = 0; i < options.functions; i++) {
+		functions[i] = function_at(i);
+	}
+
+	hook_lib.remove_hooks(functions);
+
+	std::printf("phase,calls,calls_per_second,p50_ns,p99_ns,p999_ns,max_ns\n");
+	print_phase("baseline", baseline_calls, baseline_seconds, baseline_id);
+	print_phase("churn", churn_calls, options.duration, churn_id);
+
+	const auto baseline_rate = baseline_calls / baseline_seconds;
+	const auto throughput_drop = baseline_rate != 0.0 ? 1.0 - (churn_calls / options.duration) / baseline_rate : 0.0;
+
+	std::printf("\nthroughput_drop,applied,removed,toggled,failed_applies,early_entries,wrong_results,faults\n");
+	std::printf("%.4f,%llu,%llu,%llu,%llu,%llu,%llu,%llu\n", throughput_drop, (unsigned long long)counters.applied.load(),
+		(unsigned long long)counters.removed.load(), (unsigned long long)counters.toggled.load(), (unsigned long long)counters.failed_applies.load(),
+		(unsigned long long)counters.early_entries.load(), (unsigned long long)counters.wrong_results.load(), (unsigned long long)counters.faults.load());
+
+	return counters.faults != 0 || counters.wrong_results != 0 ? 1 : 0;
+}
\ No newline at end of file
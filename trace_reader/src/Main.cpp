@@ -0,0 +1,81 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include "Tracing/TraceFormat.h"
+
+// trace_reader <trace file> [--summary]
+// Prints every record as "<microseconds> <thread> <hook> <arguments...>", or per-hook counts with --summary.
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		std::printf("usage: trace_reader <trace file> [--summary]\n");
+		return 1;
+	}
+
+	const bool summary = argc > 2 && std::strcmp(argv[2], "--summary") == 0;
+
+	std::ifstream input(argv[1], std::ios::binary);
+	TraceFileHeader header;
+
+	if (!input.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+		std::printf("[error] failed to read %s\n", argv[1]);
+		return 1;
+	}
+
+	if (header.magic != trace_magic || header.version != trace_version || header.record_size != sizeof(TraceRecord)) {
+		std::printf("[error] %s is not a version %u trace\n", argv[1], trace_version);
+		return 1;
+	}
+
+	std::vector<TraceRecord> records(header.record_count);
+
+	if (!input.read(reinterpret_cast<char*>(records.data()), records.size() * sizeof(TraceRecord))) {
+		std::printf("[error] %s is truncated\n", argv[1]);
+		return 1;
+	}
+
+	std::printf("%llu records, %llu dropped, TSC at %.3f GHz\n", (unsigned long long)header.record_count,
+		(unsigned long long)header.dropped_count, header.tsc_frequency / 1e9);
+
+	if (records.empty()) {
+		return 0;
+	}
+
+	if (summary) {
+		std::map<uint32_t, uint64_t> counts;
+
+		for (const auto& record : records) {
+			counts[record.hook_id]++;
+		}
+
+		for (const auto& [hook_id, count] : counts) {
+			std::printf("hook %u: %llu\n", hook_id, (unsigned long long)count);
+		}
+
+		return 0;
+	}
+
+	// Rings are drained one after another, so the file is only ordered per thread
+	uint64_t first_tsc = records[0].tsc;
+
+	for (const auto& record : records) {
+		first_tsc = std::min(first_tsc, record.tsc);
+	}
+
+	for (const auto& record : records) {
+		const double microseconds = header.tsc_frequency != 0 ? (record.tsc - first_tsc) * 1e6 / header.tsc_frequency : 0.0;
+
+		std::printf("%14.3f %6u %6u", microseconds, record.thread_id, record.hook_id);
+
+		for (uint32_t i = 0; i < record.argument_count && i < trace_max_arguments; i++) {
+			std::printf(" %llx", (unsigned long long)record.arguments[i]);
+		}
+
+		std::printf("\n");
+	}
+
+	return 0;
+}
\ No newline at end of file